@@ -86,7 +86,8 @@ int translate_partition_dev(char **devname, uint32_t *partition) {
   char *whole_devname;
   int partno;
 
-  require(devname && *devname && partition);
+  if (!devname || !*devname || !partition)
+    return CGPT_FAILED;
 
   if (!strlen(*devname)) {
     Error("empty drive argument\n");
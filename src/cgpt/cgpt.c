@@ -33,7 +33,12 @@ struct {
   {"prioritize", cmd_prioritize,
    "Reorder the priority of all kernel partitions"},
   {"legacy", cmd_legacy, "Switch between GPT and Legacy GPT"},
-  {"resize", cmd_resize, "Find and resize a partition"},
+  {"resize", cmd_resize, "Grow partitions into free space after them"},
+  {"switch", cmd_switch, "Make a root partition the one to boot next"},
+  {"batch", cmd_batch, "Apply a script of operations in one update"},
+  {"discard-free", cmd_discard_free, "Discard the unallocated sectors"},
+  {"compose", cmd_compose, "Build a disk image from a layout and files"},
+  {"flash", cmd_flash, "Write a disk image to a drive"},
 };
 
 void Usage(void) {
@@ -13,6 +13,7 @@
 #include "endian.h"
 #include "gpt.h"
 #include "cgptlib.h"
+#include "cgpt_params.h"
 
 
 struct legacy_partition {
@@ -42,22 +43,58 @@ struct pmbr {
 } __attribute__((packed));
 
 void PMBRToStr(struct pmbr *pmbr, char *str, unsigned int buflen);
-char *IsWholeDev(const char *basename);
+
+/* Returns pathname, filled in with the /dev path of the whole disk called
+ * basename, or NULL if there is none. */
+char *IsWholeDev(const char *basename, char *pathname, size_t size);
 
 // Handle to the drive storing the GPT.
+struct entry_index;
+struct extent_map;
+
 struct drive {
   int fd;           /* file descriptor */
   uint64_t size;    /* total size (in bytes) */
   GptData gpt;
   struct pmbr pmbr;
+  int pmbr_modified;            /* DriveClose writes pmbr back */
+  struct extent_map *extents;   /* see GetExtentMap() */
+  struct entry_index *entry_index;  /* see entry_index.h */
+  int uevent_timeout_ms;        /* DriveClose waits this long for the nodes
+                                   of added partitions, after unlocking the
+                                   drive, 0 to not wait */
+  GptEntry *discard_before;     /* see TrackDiscards() */
+  uint32_t num_discard_before;
 };
 
 
-/* mode should be O_RDONLY or O_RDWR */
+/* How long DriveOpen waits for another program to release the drive. */
+#define DRIVE_LOCK_TIMEOUT_MS 10000
+#define DRIVE_LOCK_POLL_MS 50
+
+/* flock()s the drive open on fd the way DriveOpen does, shared for O_RDONLY
+ * and exclusive for O_RDWR, waiting up to DRIVE_LOCK_TIMEOUT_MS. */
+int LockDrive(int fd, const char *drive_path, int mode);
+
+/* mode should be O_RDONLY or O_RDWR. The drive is flock()ed, shared for
+ * O_RDONLY and exclusive for O_RDWR, until DriveClose. */
 int DriveOpen(const char *drive_path, struct drive *drive,
               off_t min_size, int mode);
+/* Like DriveOpen, but image files use sector_bytes sized sectors instead of
+ * the size detected from the primary header. Block devices must already use
+ * that size. 0 behaves like DriveOpen. */
+int DriveOpenWithSectorSize(const char *drive_path, struct drive *drive,
+                            off_t min_size, int mode, uint32_t sector_bytes);
+/* Writes out what changed if update_as_needed, tells the kernel about it
+ * and then releases the drive. */
 int DriveClose(struct drive *drive, int update_as_needed);
+/* Closes the drive without writing anything, for tools that only read. */
+void DriveRelease(struct drive *drive);
 int CheckValid(const struct drive *drive);
+/* Preferred partition alignment in sectors, from the physical block size,
+ * minimum and optimal I/O sizes and discard granularity of a block device.
+ * Always 1 for image files. */
+uint64_t GetDriveAlignment(const struct drive *drive);
 
 /* Constant global type values to compare against */
 extern const Guid guid_chromeos_firmware;
@@ -130,6 +167,12 @@ void SetRaw(struct drive *drive, int secondary, uint32_t entry_index,
 
 void UpdateAllEntries(struct drive *drive);
 
+/* Finds an entries array wherever its header says it is, when the header is
+ * valid. Otherwise the array is assumed to be next to its header, with the
+ * size the other header declares or the standard 16 KB. */
+void GetEntriesLocation(GptData *gpt, int secondary,
+                        uint64_t *entries_lba, uint32_t *entries_sectors);
+
 uint8_t RepairHeader(GptData *gpt, const uint32_t valid_headers);
 uint8_t RepairEntries(GptData *gpt, const uint32_t valid_entries);
 void UpdateCrc(GptData *gpt);
@@ -139,6 +182,51 @@ int IsUnused(struct drive *drive, int secondary, uint32_t index);
 int IsKernel(struct drive *drive, int secondary, uint32_t index);
 int IsRoot(struct drive *drive, int secondary, uint32_t index);
 
+/* The commands as operations on an open drive, shared with cgpt batch. They
+ * only change memory; DriveClose(drive, 1) writes the result out. On failure
+ * the drive may be left half changed and must be closed without writing. */
+int CreateTable(struct drive *drive, CgptCreateParams *params);
+/* Needs the PMBR read in, see ReadPMBR(). */
+int AddEntry(struct drive *drive, CgptAddParams *params);
+/* Also needs the PMBR read in. */
+int SetBootPMBR(struct drive *drive, CgptBootParams *params);
+void SetLegacySignature(struct drive *drive, CgptLegacyParams *params);
+
+/* Renumbers the priorities of the CoreOS roots in memory the way cgpt
+ * prioritize does. Returns CGPT_FAILED if params names a partition that isn't
+ * a root. GptSanityCheck() must have been run on the drive. */
+int PrioritizeRoots(struct drive *drive, CgptPrioritizeParams *params);
+
+/* Names a single partition on a drive. Accepted forms:
+ *
+ *   "3"                        partition number
+ *   "PARTLABEL=ROOT"           partition label
+ *   "PARTTYPE=coreos-rootfs"   type alias or GUID
+ *   "PARTUUID=<guid>"          unique partition GUID
+ */
+enum partition_selector_kind {
+  SELECT_NUMBER,
+  SELECT_LABEL,
+  SELECT_TYPE,
+  SELECT_UNIQUE,
+};
+
+struct partition_selector {
+  enum partition_selector_kind kind;
+  uint32_t number;
+  const char *label;
+  Guid guid;
+};
+
+/* Returns CGPT_OK if str is a valid selector; otherwise CGPT_FAILED. */
+int ParsePartitionSelector(const char *str, struct partition_selector *sel);
+
+/* Finds the one partition matching sel and stores its zero-based index.
+ * Returns CGPT_FAILED if nothing matches or a label or type matches more
+ * than one partition. GptSanityCheck() must have been run on the drive. */
+int SelectPartition(struct drive *drive, const struct partition_selector *sel,
+                    uint32_t *index);
+
 // For usage and error messages.
 extern const char* progname;
 extern const char* command;
@@ -149,7 +237,8 @@ void Error(const char *format, ...);
 // on libuuid which then requires us to build it for 32-bit for the static
 // post-installer. So, we just expose this function pointer which should be
 // set to uuid_generate in case of the cgpt binary and can be null or some
-// no-op method in case of ilbcgpt-cc.a.
+// no-op method in case of ilbcgpt-cc.a. libcgpt.so sets it to uuid_generate
+// and defines progname and command as well, see libcgpt.c.
 extern void (*uuid_generator)(uint8_t* buffer);
 
 // Command functions.
@@ -163,6 +252,23 @@ int cmd_prioritize(int argc, char *argv[]);
 int cmd_legacy(int argc, char *argv[]);
 int cmd_next(int argc, char *argv[]);
 int cmd_resize(int argc, char *argv[]);
+int cmd_switch(int argc, char *argv[]);
+int cmd_batch(int argc, char *argv[]);
+int cmd_discard_free(int argc, char *argv[]);
+int cmd_compose(int argc, char *argv[]);
+int cmd_flash(int argc, char *argv[]);
+
+// Option parsers of the commands cgpt batch can run. They return CGPT_NOOP
+// after printing help and leave optind at the drive argument.
+int ParseCreateArgs(int argc, char *argv[], CgptCreateParams *params);
+int ParseAddArgs(int argc, char *argv[], CgptAddParams *params);
+int ParseBootArgs(int argc, char *argv[], CgptBootParams *params);
+int ParsePrioritizeArgs(int argc, char *argv[], CgptPrioritizeParams *params);
+int ParseLegacyArgs(int argc, char *argv[], CgptLegacyParams *params);
+
+// Runs a batch script. It drives the parsers above, and getopt isn't
+// reentrant, so it is part of the cgpt binary only and not of libcgpt.
+int CgptBatch(CgptBatchParams *params);
 
 #define ARRAY_COUNT(array) (sizeof(array)/sizeof((array)[0]))
 const char *GptError(int errnum);
@@ -171,6 +277,8 @@ const char *GptError(int errnum);
 #define GPT_PARTNAME_LEN 72
 
 /* The standard "assert" macro goes away when NDEBUG is defined. This doesn't.
+ * It exits the process, so it is only for internal invariants; anything a
+ * caller of libcgpt can get wrong must be reported with CGPT_FAILED.
  */
 #define require(A) do { \
   if (!(A)) { \
@@ -12,62 +12,65 @@
 #include "cgpt.h"
 #include "cgpt_params.h"
 #include "cgptlib_internal.h"
+#include "discard.h"
+#include "entry_index.h"
+#include "extent_map.h"
 #include "utility.h"
 #include "vboot_host.h"
 
-static const char* DumpCgptAddParams(const CgptAddParams *params) {
-  static char buf[256];
+static const char* DumpCgptAddParams(const CgptAddParams *params,
+                                     char *buf, size_t size) {
   char tmp[64];
 
   buf[0] = 0;
   snprintf(tmp, sizeof(tmp), "-i %d ", params->partition);
-  StrnAppend(buf, tmp, sizeof(buf));
+  StrnAppend(buf, tmp, size);
   if (params->label) {
     snprintf(tmp, sizeof(tmp), "-l %s ", params->label);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
   if (params->set_begin) {
     snprintf(tmp, sizeof(tmp), "-b %llu ", (unsigned long long)params->begin);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
   if (params->set_size) {
     snprintf(tmp, sizeof(tmp), "-s %llu ", (unsigned long long)params->size);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
   if (params->set_type) {
     GuidToStr(&params->type_guid, tmp, sizeof(tmp));
-    StrnAppend(buf, "-t ", sizeof(buf));
-    StrnAppend(buf, tmp, sizeof(buf));
-    StrnAppend(buf, " ", sizeof(buf));
+    StrnAppend(buf, "-t ", size);
+    StrnAppend(buf, tmp, size);
+    StrnAppend(buf, " ", size);
   }
   if (params->set_unique) {
     GuidToStr(&params->unique_guid, tmp, sizeof(tmp));
-    StrnAppend(buf, "-u ", sizeof(buf));
-    StrnAppend(buf, tmp, sizeof(buf));
-    StrnAppend(buf, " ", sizeof(buf));
+    StrnAppend(buf, "-u ", size);
+    StrnAppend(buf, tmp, size);
+    StrnAppend(buf, " ", size);
   }
   if (params->set_legacy_bootable) {
     snprintf(tmp, sizeof(tmp), "-B %d ", params->legacy_bootable);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
   if (params->set_successful) {
     snprintf(tmp, sizeof(tmp), "-S %d ", params->successful);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
   if (params->set_tries) {
     snprintf(tmp, sizeof(tmp), "-T %d ", params->tries);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
   if (params->set_priority) {
     snprintf(tmp, sizeof(tmp), "-P %d ", params->priority);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
   if (params->set_raw) {
     snprintf(tmp, sizeof(tmp), "-A 0x%" PRIx64 " ", params->raw_value);
-    StrnAppend(buf, tmp, sizeof(buf));
+    StrnAppend(buf, tmp, size);
   }
 
-  StrnAppend(buf, "\n", sizeof(buf));
+  StrnAppend(buf, "\n", size);
   return buf;
 }
 
@@ -108,6 +111,20 @@ static int GptSetEntryAttributes(struct drive *drive,
 static int SetEntryAttributes(struct drive *drive,
                               uint32_t index,
                               CgptAddParams *params) {
+  if ((params->set_legacy_bootable &&
+       (params->legacy_bootable < 0 || params->legacy_bootable > 1)) ||
+      (params->set_successful &&
+       (params->successful < 0 ||
+        params->successful > CGPT_ATTRIBUTE_MAX_SUCCESSFUL)) ||
+      (params->set_tries &&
+       (params->tries < 0 || params->tries > CGPT_ATTRIBUTE_MAX_TRIES)) ||
+      (params->set_priority &&
+       (params->priority < 0 ||
+        params->priority > CGPT_ATTRIBUTE_MAX_PRIORITY))) {
+    Error("attribute value out of range\n");
+    return -1;
+  }
+
   if (params->set_raw) {
     SetRaw(drive, PRIMARY, index, params->raw_value);
   } else {
@@ -121,10 +138,11 @@ static int SetEntryAttributes(struct drive *drive,
       SetPriority(drive, PRIMARY, index, params->priority);
   }
 
-  // New partitions must specify type, begin, and size.
+  // New partitions must specify type and size, PlacePartition picks the
+  // beginning if it is missing.
   if (IsUnused(drive, PRIMARY, index)) {
     if (!params->set_begin || !params->set_size || !params->set_type) {
-      Error("-t, -b, and -s options are required for new partitions\n");
+      Error("-t and -s options are required for new partitions\n");
       return -1;
     }
     if (GuidIsZero(&params->type_guid)) {
@@ -153,6 +171,119 @@ static int CgptCheckAddValidity(struct drive *drive) {
   return 0;
 }
 
+// Fills in the beginning of new partitions that lack one, and the size
+// when it was given as "rest" or a percentage, from the free space around
+// the entry at index.
+static int PlacePartition(struct drive *drive, const struct extent_map *map,
+                          uint32_t index, CgptAddParams *params) {
+  GptHeader *h = (GptHeader *)drive->gpt.primary_header;
+  GptEntry *entry = GetEntry(&drive->gpt, PRIMARY, index);
+  const struct extent *other;
+  uint64_t align, begin, size = params->size, end, last;
+  int is_new = IsUnused(drive, PRIMARY, index);
+
+  if (params->set_begin && !params->size_rest && !params->size_percent)
+    return 0;
+  if (!is_new && !params->size_rest && !params->size_percent)
+    return 0;
+  // Let SetEntryAttributes complain about what's missing.
+  if (is_new && !params->set_size)
+    return 0;
+
+  if (params->align_bytes) {
+    if (params->align_bytes % drive->gpt.sector_bytes) {
+      Error("Alignment %llu is not a multiple of the %u-byte sector size\n",
+            (unsigned long long)params->align_bytes, drive->gpt.sector_bytes);
+      return -1;
+    }
+    align = params->align_bytes / drive->gpt.sector_bytes;
+  } else {
+    align = GetDriveAlignment(drive);
+  }
+
+  if (params->size_percent) {
+    size = (h->last_usable_lba - h->first_usable_lba + 1) *
+           params->size_percent / 100 / align * align;
+    if (!size) {
+      Error("%u%% of the usable space is less than the %llu-sector "
+            "alignment\n", params->size_percent, (unsigned long long)align);
+      return -1;
+    }
+  } else if (params->size_rest) {
+    size = 0;
+  }
+
+  if (params->set_begin || !is_new) {
+    // The beginning is fixed, only the size is left to work out. The entry
+    // itself is still in the map with its old extent, so skip over it.
+    begin = params->set_begin ? params->begin : entry->starting_lba;
+    if (begin < h->first_usable_lba || begin > h->last_usable_lba ||
+        FindUsedOverlap(map, begin, begin, index)) {
+      Error("Sector %llu is not free\n", (unsigned long long)begin);
+      return -1;
+    }
+    if (!size) {
+      other = NextUsedExtent(map, begin, index);
+      last = other ? other->start - 1 : h->last_usable_lba;
+      end = (last + 1) / align * align;
+      size = end > begin ? end - begin : last - begin + 1;
+    }
+  } else if (CGPT_OK != FindFreeSpace(map, params->fit, align, size,
+                                      &begin, &size)) {
+    Error("No free space for %llu sectors aligned to %llu\n",
+          (unsigned long long)(size ? size : align),
+          (unsigned long long)align);
+    return -1;
+  }
+
+  params->begin = begin;
+  params->set_begin = 1;
+  params->size = size;
+  params->set_size = 1;
+  return 0;
+}
+
+// Checks the entry at index, already updated in memory, against the other
+// partitions so the error can say which one is in the way.
+static int CheckPartitionOverlap(struct drive *drive,
+                                 const struct extent_map *map,
+                                 uint32_t index) {
+  GptEntry *entry = GetEntry(&drive->gpt, PRIMARY, index);
+  const struct extent *other;
+
+  if (entry->ending_lba < entry->starting_lba)
+    return 0;   // CheckEntries reports this one
+
+  other = FindUsedOverlap(map, entry->starting_lba, entry->ending_lba, index);
+  if (other) {
+    Error("Partition %u (%llu-%llu) would overlap partition %u "
+          "(%llu-%llu)\n", index + 1,
+          (unsigned long long)entry->starting_lba,
+          (unsigned long long)entry->ending_lba, other->index + 1,
+          (unsigned long long)other->start, (unsigned long long)other->end);
+    return -1;
+  }
+  return 0;
+}
+
+// Unique GUIDs given with -u must not already belong to another partition.
+static int CheckUniqueGuid(struct drive *drive, uint32_t index,
+                           CgptAddParams *params) {
+  char buf[GUID_STRLEN];
+  int other;
+
+  if (!params->set_unique)
+    return 0;
+
+  other = FindUniqueGuid(drive, &params->unique_guid);
+  if (other >= 0 && (uint32_t)other != index) {
+    GuidToStr(&params->unique_guid, buf, sizeof(buf));
+    Error("Unique GUID %s is already used by partition %d\n", buf, other + 1);
+    return -1;
+  }
+  return 0;
+}
+
 static int CgptGetUnusedPartition(struct drive *drive, uint32_t *index,
                                   CgptAddParams *params) {
   uint32_t i;
@@ -197,7 +328,8 @@ int CgptSetAttributes(CgptAddParams *params) {
     goto bad;
   }
 
-  SetEntryAttributes(&drive, params->partition - 1, params);
+  if (SetEntryAttributes(&drive, params->partition - 1, params))
+    goto bad;
 
   UpdateAllEntries(&drive);
 
@@ -239,17 +371,12 @@ int CgptGetPartitionDetails(CgptAddParams *params) {
       Error("either partition or unique_id must be specified\n");
       goto bad;
     }
-    for (index = 0; index < max_part; index++) {
-      GptEntry *entry = GetEntry(&drive.gpt, PRIMARY, index);
-      if (GuidEqual(&entry->unique, &params->unique_guid)) {
-        params->partition = index + 1;
-        break;
-      }
-    }
-    if (index >= max_part) {
+    index = FindUniqueGuid(&drive, &params->unique_guid);
+    if (index < 0) {
       Error("no partitions with the given unique id available\n");
       goto bad;
     }
+    params->partition = index + 1;
   }
   index = params->partition - 1;
 
@@ -274,60 +401,80 @@ bad:
   return result;
 }
 
-int CgptAdd(CgptAddParams *params) {
-  struct drive drive;
+int AddEntry(struct drive *drive, CgptAddParams *params) {
+  const struct extent_map *map;
+  char dump[256];
 
   GptEntry *entry, backup;
   uint32_t index;
   int rv;
 
-  if (params == NULL)
-    return CGPT_FAILED;
-
-  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDWR))
+  if (CgptCheckAddValidity(drive)) {
     return CGPT_FAILED;
-
-  if (CGPT_OK != ReadPMBR(&drive)) {
-    Error("Unable to read PMBR\n");
-    goto bad;
   }
 
-  if (CgptCheckAddValidity(&drive)) {
-    goto bad;
+  if (CgptGetUnusedPartition(drive, &index, params)) {
+    return CGPT_FAILED;
   }
 
-  if (CgptGetUnusedPartition(&drive, &index, params)) {
-    goto bad;
-  }
+  // Built before the entry changes, it still holds the current table.
+  map = GetExtentMap(drive);
+  if (!map)
+    return CGPT_FAILED;
 
-  entry = GetEntry(&drive.gpt, PRIMARY, index);
+  entry = GetEntry(&drive->gpt, PRIMARY, index);
   memcpy(&backup, entry, sizeof(backup));
 
-  if (SetEntryAttributes(&drive, index, params) ||
-      GptSetEntryAttributes(&drive, index, params)) {
+  if (CheckUniqueGuid(drive, index, params) ||
+      PlacePartition(drive, map, index, params) ||
+      SetEntryAttributes(drive, index, params) ||
+      GptSetEntryAttributes(drive, index, params) ||
+      CheckPartitionOverlap(drive, map, index)) {
     memcpy(entry, &backup, sizeof(*entry));
-    goto bad;
+    return CGPT_FAILED;
   }
 
-  UpdateAllEntries(&drive);
+  UpdateEntryIndex(drive, index);
+  UpdateAllEntries(drive);
 
-  rv = CheckEntries((GptEntry*)drive.gpt.primary_entries,
-                    (GptHeader*)drive.gpt.primary_header);
+  rv = CheckEntries((GptEntry*)drive->gpt.primary_entries,
+                    (GptHeader*)drive->gpt.primary_header);
 
   if (0 != rv) {
     // If the modified entry is illegal, recover it and return error.
     memcpy(entry, &backup, sizeof(*entry));
+    UpdateEntryIndex(drive, index);
+    UpdateAllEntries(drive);
     Error("%s\n", GptErrorText(rv));
-    Error(DumpCgptAddParams(params));
-    goto bad;
+    Error("%s", DumpCgptAddParams(params, dump, sizeof(dump)));
+    return CGPT_FAILED;
   }
 
-  UpdatePMBR(&drive, PRIMARY);
-  if (WritePMBR(&drive) != CGPT_OK) {
-    Error("Failed to write legacy MBR.\n");
+  UpdatePMBR(drive, PRIMARY);
+  drive->pmbr_modified = 1;
+  return CGPT_OK;
+}
+
+int CgptAdd(CgptAddParams *params) {
+  struct drive drive;
+
+  if (params == NULL)
+    return CGPT_FAILED;
+
+  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDWR))
+    return CGPT_FAILED;
+  drive.uevent_timeout_ms = params->wait_seconds * 1000;
+  if (params->discard && CGPT_OK != TrackDiscards(&drive))
+    goto bad;
+
+  if (CGPT_OK != ReadPMBR(&drive)) {
+    Error("Unable to read PMBR\n");
     goto bad;
   }
 
+  if (CGPT_OK != AddEntry(&drive, params))
+    goto bad;
+
   // Write it all out.
   return DriveClose(&drive, 1);
 
@@ -0,0 +1,362 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "discard.h"
+#include "payload.h"
+#include "vboot_host.h"
+
+#define MAX_BATCH_ARGS 64
+
+enum batch_kind {
+  BATCH_CREATE,
+  BATCH_ADD,
+  BATCH_BOOT,
+  BATCH_PRIORITIZE,
+  BATCH_LEGACY,
+};
+
+static const struct {
+  const char *name;
+  enum batch_kind kind;
+} batch_cmds[] = {
+  {"create", BATCH_CREATE},
+  {"add", BATCH_ADD},
+  {"boot", BATCH_BOOT},
+  {"prioritize", BATCH_PRIORITIZE},
+  {"legacy", BATCH_LEGACY},
+};
+
+// One line of the script, parsed before the drive is opened. The params
+// point into text, which the op owns.
+struct batch_op {
+  enum batch_kind kind;
+  unsigned int line;
+  char *text;
+  union {
+    CgptCreateParams create;
+    CgptAddParams add;
+    CgptBootParams boot;
+    CgptPrioritizeParams prioritize;
+    CgptLegacyParams legacy;
+  } p;
+};
+
+// Splits a line into words in place. Single or double quotes keep spaces in
+// a word, and a word starting with '#' starts a comment. Returns the number
+// of words, or -1 if there are too many or a quote isn't closed.
+static int SplitWords(char *line, char **words, int max_words) {
+  char *in = line, *out = line;
+  int n = 0;
+
+  for (;;) {
+    char quote = 0;
+
+    while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+      in++;
+    if (!*in || *in == '#')
+      return n;
+    if (n == max_words)
+      return -1;
+
+    words[n++] = out;
+    while (*in && (quote || (*in != ' ' && *in != '\t' &&
+                             *in != '\n' && *in != '\r'))) {
+      if (quote && *in == quote)
+        quote = 0;
+      else if (!quote && (*in == '\'' || *in == '"'))
+        quote = *in;
+      else
+        *out++ = *in;
+      in++;
+    }
+    if (quote)
+      return -1;
+    if (*in)
+      in++;
+    *out++ = '\0';
+  }
+}
+
+static int ParseOp(struct batch_op *op, int argc, char *argv[]) {
+  int i, r;
+
+  for (i = 0; i < ARRAY_COUNT(batch_cmds); i++)
+    if (!strcmp(argv[0], batch_cmds[i].name))
+      break;
+  if (i == ARRAY_COUNT(batch_cmds)) {
+    Error("line %u: \"%s\" can't be batched\n", op->line, argv[0]);
+    return CGPT_FAILED;
+  }
+  op->kind = batch_cmds[i].kind;
+
+  optind = 0;                     // start getopt over on a new argv
+  switch (op->kind) {
+  case BATCH_CREATE:
+    r = ParseCreateArgs(argc, argv, &op->p.create);
+    break;
+  case BATCH_ADD:
+    r = ParseAddArgs(argc, argv, &op->p.add);
+    break;
+  case BATCH_BOOT:
+    r = ParseBootArgs(argc, argv, &op->p.boot);
+    break;
+  case BATCH_PRIORITIZE:
+    r = ParsePrioritizeArgs(argc, argv, &op->p.prioritize);
+    break;
+  case BATCH_LEGACY:
+    r = ParseLegacyArgs(argc, argv, &op->p.legacy);
+    break;
+  default:
+    r = CGPT_FAILED;
+    break;
+  }
+  if (r != CGPT_OK) {
+    Error("line %u: invalid %s operation\n", op->line, argv[0]);
+    return CGPT_FAILED;
+  }
+  if (optind < argc) {
+    Error("line %u: unexpected argument \"%s\", the drive is given to "
+          "batch itself\n", op->line, argv[optind]);
+    return CGPT_FAILED;
+  }
+  if (op->kind == BATCH_ADD && op->p.add.wait_seconds) {
+    Error("line %u: -w is an option of batch itself\n", op->line);
+    return CGPT_FAILED;
+  }
+  if ((op->kind == BATCH_ADD && op->p.add.discard) ||
+      (op->kind == BATCH_CREATE && op->p.create.discard)) {
+    Error("line %u: -D is an option of batch itself\n", op->line);
+    return CGPT_FAILED;
+  }
+  return CGPT_OK;
+}
+
+// Reads and parses the whole script. Returns the number of operations, or
+// -1 on error.
+static int ReadScript(FILE *fp, struct batch_op **ops_out) {
+  struct batch_op *ops = NULL, *op;
+  char *line = NULL, *argv[MAX_BATCH_ARGS];
+  size_t line_size = 0;
+  unsigned int line_no = 0;
+  int num_ops = 0, argc;
+
+  while (getline(&line, &line_size, fp) != -1) {
+    line_no++;
+    op = realloc(ops, (num_ops + 1) * sizeof(*ops));
+    if (!op) {
+      Error("Out of memory reading the script\n");
+      goto bad;
+    }
+    ops = op;
+    op = &ops[num_ops];
+    memset(op, 0, sizeof(*op));
+    op->line = line_no;
+    op->text = strdup(line);
+    if (!op->text) {
+      Error("Out of memory reading the script\n");
+      goto bad;
+    }
+
+    argc = SplitWords(op->text, argv, MAX_BATCH_ARGS);
+    if (argc < 0) {
+      Error("line %u: unbalanced quotes or too many words\n", line_no);
+      free(op->text);
+      goto bad;
+    }
+    if (argc == 0) {
+      free(op->text);
+      continue;
+    }
+    num_ops++;
+    if (CGPT_OK != ParseOp(op, argc, argv))
+      goto bad;
+
+    // Only the first operation can say how to open the drive.
+    if (op->kind == BATCH_CREATE && num_ops > 1 &&
+        (op->p.create.create || op->p.create.min_size ||
+         op->p.create.sector_bytes)) {
+      Error("line %u: only a create at the start may use -c, -s or "
+            "--sector-size\n", line_no);
+      goto bad;
+    }
+  }
+  if (ferror(fp)) {
+    Error("Can't read the script: %s\n", strerror(errno));
+    goto bad;
+  }
+
+  free(line);
+  *ops_out = ops;
+  return num_ops;
+
+bad:
+  free(line);
+  while (num_ops--)
+    free(ops[num_ops].text);
+  free(ops);
+  return -1;
+}
+
+static int OpenForBatch(const char *drive_name, struct batch_op *first,
+                        struct drive *drive) {
+  int mode = O_RDWR;
+
+  if (first && first->kind == BATCH_CREATE) {
+    if (first->p.create.create)
+      mode |= O_CREAT;
+    return DriveOpenWithSectorSize(drive_name, drive,
+                                   first->p.create.min_size, mode,
+                                   first->p.create.sector_bytes);
+  }
+  return DriveOpen(drive_name, drive, 0, mode);
+}
+
+static int RunOp(struct drive *drive, struct batch_op *op) {
+  int gpt_retval;
+
+  switch (op->kind) {
+  case BATCH_CREATE:
+    return CreateTable(drive, &op->p.create);
+  case BATCH_ADD:
+    return AddEntry(drive, &op->p.add);
+  case BATCH_BOOT:
+    return SetBootPMBR(drive, &op->p.boot);
+  case BATCH_PRIORITIZE:
+    if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive->gpt))) {
+      Error("GptSanityCheck() returned %d: %s\n",
+            gpt_retval, GptError(gpt_retval));
+      return CGPT_FAILED;
+    }
+    if (CGPT_OK != PrioritizeRoots(drive, &op->p.prioritize))
+      return CGPT_FAILED;
+    UpdateAllEntries(drive);
+    return CGPT_OK;
+  case BATCH_LEGACY:
+    SetLegacySignature(drive, &op->p.legacy);
+    return CGPT_OK;
+  }
+  return CGPT_FAILED;
+}
+
+// Copies the payloads into their partitions of the final table.
+static int WritePayloads(struct drive *drive, CgptBatchParams *params) {
+  struct payload_stats stats;
+  GptEntry *entry;
+  uint64_t bytes = drive->gpt.sector_bytes;
+  int i;
+
+  for (i = 0; i < params->num_payloads; i++) {
+    CgptPayload *p = &params->payloads[i];
+
+    if (p->partition < 1 || p->partition > GetNumberOfEntries(drive) ||
+        IsUnused(drive, PRIMARY, p->partition - 1)) {
+      Error("no partition %u for %s\n", p->partition, p->file);
+      return CGPT_FAILED;
+    }
+    entry = GetEntry(&drive->gpt, PRIMARY, p->partition - 1);
+    if (CGPT_OK != WritePayload(drive->fd, entry->starting_lba * bytes,
+                                (entry->ending_lba - entry->starting_lba + 1) *
+                                bytes, p->file, &stats))
+      return CGPT_FAILED;
+    if (params->verbose)
+      printf("partition %u: %s, %llu bytes: %llu reflinked, %llu copied "
+             "by the kernel, %llu copied, %llu zeros not written\n",
+             p->partition, p->file,
+             (unsigned long long)stats.size,
+             (unsigned long long)stats.cloned,
+             (unsigned long long)stats.kernel_copied,
+             (unsigned long long)stats.written,
+             (unsigned long long)stats.zeroed);
+  }
+  return CGPT_OK;
+}
+
+// Applies every operation of the script to one in-memory copy of the table
+// and writes the result out with a single DriveClose. Nothing is written if
+// the script doesn't parse, an operation fails or the final table is broken.
+// Payloads go in right before the table, so a failed copy leaves the old
+// table in place, but not the old contents of the partitions.
+int CgptBatch(CgptBatchParams *params) {
+  struct drive drive;
+  struct batch_op *ops = NULL;
+  FILE *fp;
+  int num_ops, i, gpt_retval;
+  int zapped = 0;
+  int r = CGPT_FAILED;
+
+  if (params == NULL)
+    return CGPT_FAILED;
+
+  if (params->script) {
+    fp = fopen(params->script, "r");
+    if (!fp) {
+      Error("Can't open %s: %s\n", params->script, strerror(errno));
+      return CGPT_FAILED;
+    }
+  } else {
+    fp = stdin;
+  }
+  num_ops = ReadScript(fp, &ops);
+  if (fp != stdin)
+    fclose(fp);
+  if (num_ops < 0)
+    return CGPT_FAILED;
+
+  if (CGPT_OK != OpenForBatch(params->drive_name,
+                              num_ops ? &ops[0] : NULL, &drive))
+    goto out;
+  drive.uevent_timeout_ms = params->wait_seconds * 1000;
+  if (params->discard && CGPT_OK != TrackDiscards(&drive))
+    goto bad;
+
+  if (CGPT_OK != ReadPMBR(&drive)) {
+    Error("Unable to read PMBR\n");
+    goto bad;
+  }
+
+  for (i = 0; i < num_ops; i++) {
+    if (CGPT_OK != RunOp(&drive, &ops[i])) {
+      Error("line %u: operation failed, nothing was written\n", ops[i].line);
+      goto bad;
+    }
+    if (ops[i].kind == BATCH_CREATE)
+      zapped = ops[i].p.create.zap;
+  }
+
+  // A zapped table is meant to be invalid, anything else has to pass the
+  // same check every command starts with.
+  if (!zapped && (num_ops || params->num_payloads) &&
+      GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
+    Error("GptSanityCheck() returned %d: %s, nothing was written\n",
+          gpt_retval, GptError(gpt_retval));
+    goto bad;
+  }
+  if (params->num_payloads && zapped) {
+    Error("the table was zapped, there are no partitions for the "
+          "payloads\n");
+    goto bad;
+  }
+  if (CGPT_OK != WritePayloads(&drive, params)) {
+    Error("copying the payloads failed, the table was not written\n");
+    goto bad;
+  }
+
+  r = DriveClose(&drive, 1);
+  goto out;
+
+bad:
+  (void) DriveClose(&drive, 0);
+out:
+  for (i = 0; i < num_ops; i++)
+    free(ops[i].text);
+  free(ops);
+  return r;
+}
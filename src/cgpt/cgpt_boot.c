@@ -11,6 +11,7 @@
 #include "cgpt_params.h"
 #include "cgptlib_internal.h"
 #include "endian.h"
+#include "entry_index.h"
 #include "vboot_host.h"
 
 int CgptGetBootPartitionNumber(CgptBootParams *params) {
@@ -37,19 +38,11 @@ int CgptGetBootPartitionNumber(CgptBootParams *params) {
     goto done;
   }
 
-  char buf[GUID_STRLEN];
-  GuidToStr(&drive.pmbr.syslinux3.boot_guid, buf, sizeof(buf));
-
-  int numEntries = GetNumberOfEntries(&drive);
-  int i;
-  for(i = 0; i < numEntries; i++) {
-      GptEntry *entry = GetEntry(&drive.gpt, ANY_VALID, i);
-
-      if (GuidEqual(&entry->unique, &drive.pmbr.syslinux3.boot_guid)) {
-        params->partition = i + 1;
-        retval = CGPT_OK;
-        goto done;
-      }
+  int index = FindUniqueGuid(&drive, &drive.pmbr.syslinux3.boot_guid);
+  if (index >= 0) {
+    params->partition = index + 1;
+    retval = CGPT_OK;
+    goto done;
   }
 
   Error("Didn't find any boot partition\n");
@@ -62,77 +55,88 @@ done:
 }
 
 
-int CgptBoot(CgptBootParams *params) {
-  struct drive drive;
-  int retval = 1;
-  int gpt_retval= 0;
-  int mode = O_RDONLY;
-
-  if (params == NULL)
-    return CGPT_FAILED;
-
-  if (params->create_pmbr || params->partition || params->bootfile)
-    mode = O_RDWR;
-
-  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, mode)) {
-    return CGPT_FAILED;
-  }
-
-  if (CGPT_OK != ReadPMBR(&drive)) {
-    Error("Unable to read PMBR\n");
-    goto done;
-  }
+int SetBootPMBR(struct drive *drive, CgptBootParams *params) {
+  int gpt_retval;
 
   if (params->create_pmbr) {
-    InitPMBR(&drive, ANY_VALID);
-    drive.pmbr.magic[0] = 0x1d;
-    drive.pmbr.magic[1] = 0x9a;
+    InitPMBR(drive, ANY_VALID);
+    drive->pmbr.magic[0] = 0x1d;
+    drive->pmbr.magic[1] = 0x9a;
   }
 
   if (params->partition) {
-    if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
+    if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive->gpt))) {
       Error("GptSanityCheck() returned %d: %s\n",
             gpt_retval, GptError(gpt_retval));
-      goto done;
+      return CGPT_FAILED;
     }
 
-    if (params->partition > GetNumberOfEntries(&drive)) {
+    if (params->partition > GetNumberOfEntries(drive)) {
       Error("invalid partition number: %d\n", params->partition);
-      goto done;
+      return CGPT_FAILED;
     }
 
     uint32_t index = params->partition - 1;
-    GptEntry *entry = GetEntry(&drive.gpt, ANY_VALID, index);
-    memcpy(&drive.pmbr.syslinux3.boot_guid, &entry->unique, sizeof(Guid));
+    GptEntry *entry = GetEntry(&drive->gpt, ANY_VALID, index);
+    memcpy(&drive->pmbr.syslinux3.boot_guid, &entry->unique, sizeof(Guid));
   }
 
   if (params->bootfile) {
     int fd = open(params->bootfile, O_RDONLY);
     if (fd < 0) {
       Error("Can't read %s: %s\n", params->bootfile, strerror(errno));
-      goto done;
+      return CGPT_FAILED;
     }
 
-    int n = read(fd, drive.pmbr.syslinux3.bootcode,
-                 sizeof(drive.pmbr.syslinux3.bootcode));
+    int n = read(fd, drive->pmbr.syslinux3.bootcode,
+                 sizeof(drive->pmbr.syslinux3.bootcode));
     if (n < 1) {
       Error("problem reading %s: %s\n", params->bootfile, strerror(errno));
       close(fd);
-      goto done;
+      return CGPT_FAILED;
     }
 
     close(fd);
   }
 
+  if (params->create_pmbr || params->partition || params->bootfile)
+    drive->pmbr_modified = 1;
+  return CGPT_OK;
+}
+
+int CgptBoot(CgptBootParams *params) {
+  struct drive drive;
+  int retval = 1;
+  int mode = O_RDONLY;
+
+  if (params == NULL)
+    return CGPT_FAILED;
+
+  if (params->create_pmbr || params->partition || params->bootfile)
+    mode = O_RDWR;
+
+  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, mode)) {
+    return CGPT_FAILED;
+  }
+
+  if (CGPT_OK != ReadPMBR(&drive)) {
+    Error("Unable to read PMBR\n");
+    goto done;
+  }
+
+  if (CGPT_OK != SetBootPMBR(&drive, params))
+    goto done;
+
   char buf[GUID_STRLEN];
   GuidToStr(&drive.pmbr.syslinux3.boot_guid, buf, sizeof(buf));
   printf("%s\n", buf);
 
   // Write it all out, if needed.
-  if (mode == O_RDONLY || CGPT_OK == WritePMBR(&drive))
+  if (CGPT_OK == DriveClose(&drive, 1))
     retval = 0;
+  return retval;
 
 done:
-  (void) DriveClose(&drive, 1);
+  (void) DriveClose(&drive, 0);
   return retval;
 }
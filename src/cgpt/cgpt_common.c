@@ -9,22 +9,39 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "cgpt.h"
 #include "cgptlib_internal.h"
 #include "crc32.h"
+#include "entry_class.h"
+#include "entry_index.h"
+#include "extent_map.h"
 #include "vboot_host.h"
 
+// Block device topology, from linux/fs.h which conflicts with sys/mount.h.
+#ifndef BLKIOMIN
+#define BLKIOMIN _IO(0x12, 120)
+#endif
+#ifndef BLKIOOPT
+#define BLKIOOPT _IO(0x12, 121)
+#endif
+#ifndef BLKPBSZGET
+#define BLKPBSZGET _IO(0x12, 123)
+#endif
+
 void Error(const char *format, ...) {
   va_list ap;
   va_start(ap, format);
@@ -54,7 +71,7 @@ int CheckValid(const struct drive *drive) {
  *   sector_bytes -- bytes per sector
  *   sector_count -- number of sectors to load
  *
- * Returns CGPT_OK for successful. Aborts if any error occurs.
+ * Returns CGPT_OK for successful, CGPT_FAILED for failed.
  */
 static int Load(const int fd, uint8_t **buf,
                 const uint64_t sector,
@@ -63,7 +80,6 @@ static int Load(const int fd, uint8_t **buf,
   int count;  /* byte count to read */
   int nread;
 
-  require(buf);
   if (!sector_count || !sector_bytes) {
     Error("%s() failed at line %d: sector_count=%d, sector_bytes=%d\n",
           __FUNCTION__, __LINE__, sector_count, sector_bytes);
@@ -77,7 +93,10 @@ static int Load(const int fd, uint8_t **buf,
   }
   count = sector_bytes * sector_count;
   *buf = malloc(count);
-  require(*buf);
+  if (!*buf) {
+    Error("Can't allocate %d bytes\n", count);
+    return CGPT_FAILED;
+  }
 
   if (-1 == lseek(fd, sector * sector_bytes, SEEK_SET)) {
     Error("Can't lseek: %s\n", strerror(errno));
@@ -110,48 +129,65 @@ int ReadPMBR(struct drive *drive) {
   return CGPT_OK;
 }
 
-int WritePMBR(struct drive *drive) {
-  if (-1 == lseek(drive->fd, 0, SEEK_SET))
-    return CGPT_FAILED;
+void GetEntriesLocation(GptData *gpt, int secondary,
+                        uint64_t *entries_lba, uint32_t *entries_sectors) {
+  GptHeader *h = (GptHeader *)(secondary ? gpt->secondary_header
+                                         : gpt->primary_header);
+  GptHeader *other = (GptHeader *)(secondary ? gpt->primary_header
+                                             : gpt->secondary_header);
 
-  int nwrote = write(drive->fd, &drive->pmbr, sizeof(struct pmbr));
-  if (nwrote != sizeof(struct pmbr))
-    return CGPT_FAILED;
+  if (0 == CheckHeader(h, secondary, gpt->drive_sectors, gpt->sector_bytes)) {
+    *entries_lba = h->entries_lba;
+    *entries_sectors = CalculateEntriesSectors(h, gpt->sector_bytes);
+    return;
+  }
 
-  return CGPT_OK;
+  if (0 == CheckHeader(other, !secondary, gpt->drive_sectors,
+                       gpt->sector_bytes))
+    *entries_sectors = CalculateEntriesSectors(other, gpt->sector_bytes);
+  else
+    *entries_sectors = GPT_ENTRIES_SECTORS(gpt->sector_bytes);
+  if (secondary)
+    *entries_lba = gpt->drive_sectors - GPT_HEADER_SECTOR - *entries_sectors;
+  else
+    *entries_lba = GPT_PMBR_SECTOR + GPT_HEADER_SECTOR;
 }
 
-/* Saves sectors to 'fd'.
- *
- *   fd -- file descriptot.
- *   buf -- pointer to buffer
- *   sector -- starting sector offset
- *   sector_bytes -- bytes per sector
- *   sector_count -- number of sector to save
+/* Loads one entries array into a MAX_ENTRIES_SIZE buffer, so that it can
+ * hold either array whatever their headers declare.
  *
- * Returns CGPT_OK for successful, CGPT_FAILED for failed.
- */
-static int Save(const int fd, const uint8_t *buf,
-                const uint64_t sector,
-                const uint64_t sector_bytes,
-                const uint64_t sector_count) {
-  int count;  /* byte count to write */
-  int nwrote;
-
-  require(buf);
-  count = sector_bytes * sector_count;
+ * Returns CGPT_OK for successful, CGPT_FAILED for failed. */
+static int LoadEntries(struct drive *drive, int secondary) {
+  GptData *gpt = &drive->gpt;
+  uint8_t **buf = secondary ? &gpt->secondary_entries : &gpt->primary_entries;
+  uint64_t entries_lba;
+  uint32_t entries_sectors;
+  ssize_t count, nread;
+
+  GetEntriesLocation(gpt, secondary, &entries_lba, &entries_sectors);
+  if (gpt->drive_sectors < GPT_PMBR_SECTOR +
+                           2 * (GPT_HEADER_SECTOR + entries_sectors)) {
+    Error("Drive is too small for a GPT: %llu sectors\n",
+          (unsigned long long)gpt->drive_sectors);
+    return CGPT_FAILED;
+  }
 
-  if (-1 == lseek(fd, sector * sector_bytes, SEEK_SET))
+  *buf = calloc(1, MAX_ENTRIES_SIZE);
+  if (!*buf) {
+    Error("Can't allocate %d bytes\n", MAX_ENTRIES_SIZE);
     return CGPT_FAILED;
+  }
 
-  nwrote = write(fd, buf, count);
-  if (nwrote < count)
+  count = (ssize_t)entries_sectors * gpt->sector_bytes;
+  nread = pread(drive->fd, *buf, count, entries_lba * gpt->sector_bytes);
+  if (nread < count) {
+    Error("Can't read enough: %d, not %d\n", (int)nread, (int)count);
     return CGPT_FAILED;
+  }
 
   return CGPT_OK;
 }
 
-
 // Opens a block device or file, loads raw GPT data from it.
 // If the drive is a file or doesn't exist and min_size is not zero then
 // it will be extended to the requested size if necessary.
@@ -159,18 +195,81 @@ static int Save(const int fd, const uint8_t *buf,
 // min_size is specified in sectors
 // mode should be O_RDONLY or O_RDWR
 // min_size is required if mode includes O_CREAT
+// The drive is locked against other cgpt and udev style users until
+// DriveClose, waiting up to DRIVE_LOCK_TIMEOUT_MS for them to finish.
 //
 // Returns CGPT_FAILED if any error happens.
 // Returns CGPT_OK if success and information are stored in 'drive'. */
 int DriveOpen(const char *drive_path, struct drive *drive,
               off_t min_size, int mode) {
+  return DriveOpenWithSectorSize(drive_path, drive, min_size, mode, 0);
+}
+
+static int HasHeaderSignature(int fd, off_t offset) {
+  char sig[GPT_HEADER_SIGNATURE_SIZE];
+
+  if (pread(fd, sig, sizeof(sig), offset) != sizeof(sig))
+    return 0;
+  return !memcmp(sig, GPT_HEADER_SIGNATURE, GPT_HEADER_SIGNATURE_SIZE) ||
+         !memcmp(sig, GPT_HEADER_SIGNATURE2, GPT_HEADER_SIGNATURE_SIZE);
+}
+
+/* Image files don't know their logical sector size, so guess it from where
+ * the primary GPT header is: always in the second sector. If the primary is
+ * damaged look for the backup in the last sector instead, so it can still
+ * be repaired. Falls back to 512-byte sectors for files without a GPT. */
+static uint32_t DetectSectorSize(int fd, off_t size) {
+  uint32_t sector_bytes;
+
+  for (sector_bytes = MIN_SECTOR_BYTES; sector_bytes <= MAX_SECTOR_BYTES;
+       sector_bytes *= 2) {
+    if (HasHeaderSignature(fd, sector_bytes))
+      return sector_bytes;
+  }
+  for (sector_bytes = MIN_SECTOR_BYTES; sector_bytes <= MAX_SECTOR_BYTES;
+       sector_bytes *= 2) {
+    if (size >= 2 * sector_bytes && size % sector_bytes == 0 &&
+        HasHeaderSignature(fd, size - sector_bytes))
+      return sector_bytes;
+  }
+  return MIN_SECTOR_BYTES;
+}
+
+/* Takes a BSD lock on the whole drive, the convention udev and the util-linux
+ * tools follow for block devices: shared to read the table, exclusive to
+ * change it. Gives up after DRIVE_LOCK_TIMEOUT_MS so a stuck holder can't
+ * hang us forever. The lock goes away when the fd is closed. */
+int LockDrive(int fd, const char *drive_path, int mode) {
+  int op = (mode & O_RDWR) ? LOCK_EX : LOCK_SH;
+  int waited_ms = 0;
+
+  while (flock(fd, op | LOCK_NB) < 0) {
+    if (errno == EINTR)
+      continue;
+    if (errno != EWOULDBLOCK) {
+      Error("Can't lock %s: %s\n", drive_path, strerror(errno));
+      return CGPT_FAILED;
+    }
+    if (waited_ms >= DRIVE_LOCK_TIMEOUT_MS) {
+      Error("Timed out waiting for %s, another program is using it\n",
+            drive_path);
+      return CGPT_FAILED;
+    }
+    usleep(DRIVE_LOCK_POLL_MS * 1000);
+    waited_ms += DRIVE_LOCK_POLL_MS;
+  }
+  return CGPT_OK;
+}
+
+int DriveOpenWithSectorSize(const char *drive_path, struct drive *drive,
+                            off_t min_size, int mode, uint32_t sector_bytes) {
   struct stat stat;
 
-  require(drive_path);
-  require(drive);
-  if (mode & O_CREAT) {
-    require(min_size);
-    require(mode & O_RDWR);
+  if (!drive_path || !drive)
+    return CGPT_FAILED;
+  if ((mode & O_CREAT) && (!min_size || !(mode & O_RDWR))) {
+    Error("Creating %s needs a size and write access\n", drive_path);
+    return CGPT_FAILED;
   }
 
   // Clear struct for proper error handling.
@@ -182,6 +281,9 @@ int DriveOpen(const char *drive_path, struct drive *drive,
     return CGPT_FAILED;
   }
 
+  if (CGPT_OK != LockDrive(drive->fd, drive_path, mode))
+    goto error_close;
+
   if (fstat(drive->fd, &stat) == -1) {
     Error("Can't fstat %s: %s\n", drive_path, strerror(errno));
     goto error_close;
@@ -196,11 +298,18 @@ int DriveOpen(const char *drive_path, struct drive *drive,
             drive_path, strerror(errno));
       goto error_close;
     }
+    if (sector_bytes && sector_bytes != drive->gpt.sector_bytes) {
+      Error("%s has %d-byte sectors, not %d\n", drive_path,
+            drive->gpt.sector_bytes, sector_bytes);
+      goto error_close;
+    }
   } else {
-    drive->gpt.sector_bytes = 512;  /* bytes */
+    if (!sector_bytes)
+      sector_bytes = DetectSectorSize(drive->fd, stat.st_size);
+    drive->gpt.sector_bytes = sector_bytes;
     drive->size = stat.st_size;
-    if ((drive->size < (min_size * 512)) && (mode & O_RDWR)) {
-      drive->size = (min_size * 512);
+    if ((drive->size < (min_size * sector_bytes)) && (mode & O_RDWR)) {
+      drive->size = (min_size * sector_bytes);
       if (ftruncate(drive->fd, drive->size) < 0) {
         Error("Can't extend %s: %s\n", drive_path, strerror(errno));
         goto error_close;
@@ -229,15 +338,8 @@ int DriveOpen(const char *drive_path, struct drive *drive,
                       drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
     goto error_close;
   }
-  if (CGPT_OK != Load(drive->fd, &drive->gpt.primary_entries,
-                      GPT_PMBR_SECTOR + GPT_HEADER_SECTOR,
-                      drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
-        goto error_close;
-  }
-  if (CGPT_OK != Load(drive->fd, &drive->gpt.secondary_entries,
-                      drive->gpt.drive_sectors - GPT_HEADER_SECTOR
-                      - GPT_ENTRIES_SECTORS,
-                      drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
+  if (CGPT_OK != LoadEntries(drive, PRIMARY) ||
+      CGPT_OK != LoadEntries(drive, SECONDARY)) {
     goto error_close;
   }
 
@@ -245,58 +347,18 @@ int DriveOpen(const char *drive_path, struct drive *drive,
   return CGPT_OK;
 
 error_close:
-  (void) DriveClose(drive, 0);
+  DriveRelease(drive);
   return CGPT_FAILED;
 }
 
 
-int DriveClose(struct drive *drive, int update_as_needed) {
-  int errors = 0;
-
-  if (update_as_needed) {
-    if (drive->gpt.modified & GPT_MODIFIED_HEADER1) {
-      if (CGPT_OK != Save(drive->fd, drive->gpt.primary_header,
-                          GPT_PMBR_SECTOR,
-                          drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
-        errors++;
-        Error("Cannot write primary header: %s\n", strerror(errno));
-      }
-    }
-
-    if (drive->gpt.modified & GPT_MODIFIED_HEADER2) {
-      if(CGPT_OK != Save(drive->fd, drive->gpt.secondary_header,
-                         drive->gpt.drive_sectors - GPT_PMBR_SECTOR,
-                         drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
-        errors++;
-        Error("Cannot write secondary header: %s\n", strerror(errno));
-      }
-    }
-    if (drive->gpt.modified & GPT_MODIFIED_ENTRIES1) {
-      if (CGPT_OK != Save(drive->fd, drive->gpt.primary_entries,
-                          GPT_PMBR_SECTOR + GPT_HEADER_SECTOR,
-                          drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
-        errors++;
-        Error("Cannot write primary entries: %s\n", strerror(errno));
-      }
-    }
-    if (drive->gpt.modified & GPT_MODIFIED_ENTRIES2) {
-      if (CGPT_OK != Save(drive->fd, drive->gpt.secondary_entries,
-                          drive->gpt.drive_sectors - GPT_HEADER_SECTOR
-                          - GPT_ENTRIES_SECTORS,
-                          drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
-        errors++;
-        Error("Cannot write secondary entries: %s\n", strerror(errno));
-      }
-    }
-  }
-
-  // Sync early! Only sync file descriptor here, and leave the whole system sync
-  // outside cgpt because whole system sync would trigger tons of disk accesses
-  // and timeout tests.
-  fsync(drive->fd);
-
+void DriveRelease(struct drive *drive) {
   close(drive->fd);
 
+  DropExtentMap(drive);
+  DropEntryIndex(drive);
+  free(drive->discard_before);
+  drive->discard_before = NULL;
   if (drive->gpt.primary_header)
     free(drive->gpt.primary_header);
   drive->gpt.primary_header = 0;
@@ -309,10 +371,79 @@ int DriveClose(struct drive *drive, int update_as_needed) {
   if (drive->gpt.secondary_entries)
     free(drive->gpt.secondary_entries);
   drive->gpt.secondary_entries = 0;
+}
 
-  return errors ? CGPT_FAILED : CGPT_OK;
+
+/* Reads one number from the queue directory of a block device in sysfs.
+ * Partitions don't have their own, so try the parent disk's too. */
+static uint64_t ReadQueueAttr(dev_t rdev, const char *attr) {
+  char path[PATH_MAX];
+  unsigned long long value = 0;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+           major(rdev), minor(rdev), attr);
+  f = fopen(path, "r");
+  if (!f) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s",
+             major(rdev), minor(rdev), attr);
+    f = fopen(path, "r");
+  }
+  if (!f)
+    return 0;
+  if (fscanf(f, "%llu", &value) != 1)
+    value = 0;
+  fclose(f);
+  return value;
 }
 
+static uint64_t Gcd(uint64_t a, uint64_t b) {
+  while (b) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* Largest alignment we'll derive from the topology; anything beyond this is
+ * probably a bogus optimal I/O size. */
+#define MAX_ALIGNMENT_BYTES (16 * 1024 * 1024)
+
+uint64_t GetDriveAlignment(const struct drive *drive) {
+  uint64_t sizes[4] = {0, 0, 0, 0};
+  uint64_t align = 1, sectors;
+  unsigned int value;
+  struct stat stat;
+  int i;
+
+  if (fstat(drive->fd, &stat) == -1 || !S_ISBLK(stat.st_mode))
+    return 1;
+
+  if (ioctl(drive->fd, BLKPBSZGET, &value) == 0)
+    sizes[0] = value;
+  if (ioctl(drive->fd, BLKIOMIN, &value) == 0)
+    sizes[1] = value;
+  if (ioctl(drive->fd, BLKIOOPT, &value) == 0)
+    sizes[2] = value;
+  sizes[3] = ReadQueueAttr(stat.st_rdev, "discard_granularity");
+
+  // Striped devices may report sizes that aren't powers of two, so use
+  // the least common multiple rather than the largest.
+  for (i = 0; i < ARRAY_COUNT(sizes); i++) {
+    if (sizes[i] < drive->gpt.sector_bytes ||
+        sizes[i] % drive->gpt.sector_bytes ||
+        sizes[i] > MAX_ALIGNMENT_BYTES)
+      continue;
+    sectors = sizes[i] / drive->gpt.sector_bytes;
+    if (align / Gcd(align, sectors) * sectors * drive->gpt.sector_bytes >
+        MAX_ALIGNMENT_BYTES)
+      continue;
+    align = align / Gcd(align, sectors) * sectors;
+  }
+
+  return align;
+}
 
 /* GUID conversion functions. Accepted format:
  *
@@ -365,7 +496,11 @@ int StrToGuid(const char *str, Guid *guid) {
 }
 static void GuidToStrGeneric(const char *fmt, const Guid *guid,
                              char *str, unsigned int buflen) {
-  require(buflen >= GUID_STRLEN);
+  if (buflen < GUID_STRLEN) {
+    if (buflen)
+      str[0] = '\0';
+    return;
+  }
   require(snprintf(str, buflen, fmt,
                   le32toh(guid->u.Uuid.time_low),
                   le16toh(guid->u.Uuid.time_mid),
@@ -796,6 +931,7 @@ void SetRaw(struct drive *drive, int secondary, uint32_t entry_index,
 }
 
 void UpdateAllEntries(struct drive *drive) {
+  DropExtentMap(drive);
   RepairEntries(&drive->gpt, MASK_PRIMARY);
   RepairHeader(&drive->gpt, MASK_PRIMARY);
 
@@ -822,6 +958,99 @@ int IsRoot(struct drive *drive, int secondary, uint32_t index) {
   return GuidEqual(&entry->type, &guid_coreos_rootfs);
 }
 
+int ParsePartitionSelector(const char *str, struct partition_selector *sel) {
+  char *e = 0;
+
+  memset(sel, 0, sizeof(*sel));
+
+  if (!strncmp(str, "PARTLABEL=", 10)) {
+    sel->kind = SELECT_LABEL;
+    sel->label = str + 10;
+    return CGPT_OK;
+  }
+
+  if (!strncmp(str, "PARTTYPE=", 9)) {
+    sel->kind = SELECT_TYPE;
+    if (CGPT_OK != SupportedType(str + 9, &sel->guid) &&
+        CGPT_OK != StrToGuid(str + 9, &sel->guid)) {
+      Error("Unknown partition type: %s\n", str + 9);
+      return CGPT_FAILED;
+    }
+    return CGPT_OK;
+  }
+
+  if (!strncmp(str, "PARTUUID=", 9)) {
+    sel->kind = SELECT_UNIQUE;
+    if (CGPT_OK != StrToGuid(str + 9, &sel->guid)) {
+      Error("Invalid partition GUID: %s\n", str + 9);
+      return CGPT_FAILED;
+    }
+    return CGPT_OK;
+  }
+
+  sel->kind = SELECT_NUMBER;
+  errno = 0;
+  sel->number = (uint32_t)strtoul(str, &e, 0);
+  if (errno || !*str || (e && *e) || !sel->number) {
+    Error("Invalid partition selector: %s\n", str);
+    return CGPT_FAILED;
+  }
+  return CGPT_OK;
+}
+
+int SelectPartition(struct drive *drive, const struct partition_selector *sel,
+                    uint32_t *index) {
+  struct entry_cursor cursor = { 0 };
+  entry_bitmap of_type;
+  uint32_t max_part = GetNumberOfEntries(drive);
+  uint32_t found = max_part;
+  int match;
+
+  switch (sel->kind) {
+    case SELECT_NUMBER:
+      if (sel->number > max_part ||
+          IsUnused(drive, ANY_VALID, sel->number - 1)) {
+        Error("Partition %u does not exist\n", sel->number);
+        return CGPT_FAILED;
+      }
+      *index = sel->number - 1;
+      return CGPT_OK;
+
+    // Labels and unique GUIDs come straight from the entry index.
+    case SELECT_LABEL:
+    case SELECT_UNIQUE:
+      while ((match = sel->kind == SELECT_LABEL ?
+              NextLabelMatch(drive, sel->label, &cursor) :
+              NextUniqueMatch(drive, &sel->guid, &cursor)) >= 0) {
+        if (found != max_part) {
+          Error("More than one partition matches, use a partition number\n");
+          return CGPT_FAILED;
+        }
+        found = match;
+      }
+      break;
+
+    case SELECT_TYPE:
+      if (GuidIsZero(&sel->guid))
+        break;
+      if (MatchEntryType(drive, ANY_VALID, &sel->guid, of_type) > 1) {
+        Error("More than one partition matches, use a partition number\n");
+        return CGPT_FAILED;
+      }
+      match = NextEntry(of_type, max_part, -1);
+      if (match >= 0)
+        found = match;
+      break;
+  }
+
+  if (found == max_part) {
+    Error("No partition matches\n");
+    return CGPT_FAILED;
+  }
+  *index = found;
+  return CGPT_OK;
+}
+
 
 #define TOSTRING(A) #A
 const char *GptError(int errnum) {
@@ -839,6 +1068,13 @@ const char *GptError(int errnum) {
   return error_string[errnum];
 }
 
+/* Bytes of the entries array a header declares, limited to the buffer. */
+static uint32_t EntriesSize(const GptHeader *h) {
+  uint64_t size = (uint64_t)h->number_of_entries * h->size_of_entry;
+
+  return size > MAX_ENTRIES_SIZE ? MAX_ENTRIES_SIZE : size;
+}
+
 /*  Update CRC value if necessary.  */
 void UpdateCrc(GptData *gpt) {
   GptHeader *primary_header, *secondary_header;
@@ -850,11 +1086,11 @@ void UpdateCrc(GptData *gpt) {
       memcmp(primary_header, GPT_HEADER_SIGNATURE2,
              GPT_HEADER_SIGNATURE_SIZE)) {
     primary_header->entries_crc32 =
-        Crc32(gpt->primary_entries, TOTAL_ENTRIES_SIZE);
+        Crc32(gpt->primary_entries, EntriesSize(primary_header));
   }
   if (gpt->modified & GPT_MODIFIED_ENTRIES2) {
     secondary_header->entries_crc32 =
-        Crc32(gpt->secondary_entries, TOTAL_ENTRIES_SIZE);
+        Crc32(gpt->secondary_entries, EntriesSize(secondary_header));
   }
   if (gpt->modified & GPT_MODIFIED_HEADER1) {
     primary_header->header_crc32 = 0;
@@ -910,15 +1146,15 @@ uint8_t RepairEntries(GptData *gpt, const uint32_t valid_entries) {
 
   if (valid_entries == MASK_BOTH) {
     if (memcmp(gpt->primary_entries, gpt->secondary_entries,
-               TOTAL_ENTRIES_SIZE)) {
-      memcpy(gpt->secondary_entries, gpt->primary_entries, TOTAL_ENTRIES_SIZE);
+               MAX_ENTRIES_SIZE)) {
+      memcpy(gpt->secondary_entries, gpt->primary_entries, MAX_ENTRIES_SIZE);
       return GPT_MODIFIED_ENTRIES2;
     }
   } else if (valid_entries == MASK_PRIMARY) {
-    memcpy(gpt->secondary_entries, gpt->primary_entries, TOTAL_ENTRIES_SIZE);
+    memcpy(gpt->secondary_entries, gpt->primary_entries, MAX_ENTRIES_SIZE);
     return GPT_MODIFIED_ENTRIES2;
   } else if (valid_entries == MASK_SECONDARY) {
-    memcpy(gpt->primary_entries, gpt->secondary_entries, TOTAL_ENTRIES_SIZE);
+    memcpy(gpt->primary_entries, gpt->secondary_entries, MAX_ENTRIES_SIZE);
     return GPT_MODIFIED_ENTRIES1;
   }
 
@@ -963,7 +1199,7 @@ uint8_t RepairHeader(GptData *gpt, const uint32_t valid_headers) {
     secondary_header->my_lba = gpt->drive_sectors - 1;  /* the last sector */
     secondary_header->alternate_lba = primary_header->my_lba;
     secondary_header->entries_lba = secondary_header->my_lba -
-        GPT_ENTRIES_SECTORS;
+        CalculateEntriesSectors(primary_header, gpt->sector_bytes);
     return GPT_MODIFIED_HEADER2;
   } else if (valid_headers == MASK_SECONDARY) {
     memcpy(primary_header, secondary_header, sizeof(GptHeader));
@@ -1084,11 +1320,14 @@ void UpdatePMBR(struct drive *drive, int secondary) {
 
   // Search for any partitions with the Legacy BIOS Bootable flag,
   // if found then create a hybrid MBR with the partition.
-  uint32_t index;
-  for (index = 0; index < GetNumberOfEntries(drive); index++) {
+  struct entry_classes cls;
+  int index;
+  ClassifyEntries(drive, secondary, &cls);
+  for (index = NextEntry(cls.used, cls.num_entries, -1); index >= 0;
+       index = NextEntry(cls.used, cls.num_entries, index)) {
     GptEntry *entry = GetEntry(&drive->gpt, secondary, index);
 
-    if (GuidIsZero(&entry->type) || !GetEntryLegacyBootable(entry))
+    if (!GetEntryLegacyBootable(entry))
       continue;
 
     // Only create a hybrid table if the partition fits
@@ -1140,16 +1379,15 @@ static const char *devdirs[] = { "/dev", "/devices", "/devfs", 0 };
 // Given basename "foo", see if we can find a whole, real device by that name.
 // This is copied from the logic in the linux utility 'findfs', although that
 // does more exhaustive searching.
-char *IsWholeDev(const char *basename) {
+char *IsWholeDev(const char *basename, char *pathname, size_t size) {
   int i,j,len;
   struct stat statbuf;
-  static char pathname[BUFSIZE];        // we'll return this.
   char tmpname[BUFSIZE + 18];           // add sizeof(SYS_BLOCK_DIR"//device")
   char tbasename[BUFSIZE];
 
   // It should be a block device under /dev/,
   for (i = 0; devdirs[i]; i++) {
-    snprintf(pathname, BUFSIZE, "%s/%s", devdirs[i], basename);
+    snprintf(pathname, size, "%s/%s", devdirs[i], basename);
 
     if (0 != stat(pathname, &statbuf))
       continue;
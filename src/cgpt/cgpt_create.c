@@ -7,17 +7,36 @@
 
 #include "cgpt.h"
 #include "cgptlib_internal.h"
+#include "discard.h"
+#include "entry_index.h"
+#include "extent_map.h"
 #include "vboot_host.h"
 
-static int initialize_gpt(struct drive *drive, const char *guid) {
+// Partitions are easiest to align if the usable region starts and ends on
+// an alignment boundary, given in sectors.
+static int initialize_gpt(struct drive *drive, const char *guid,
+                          uint64_t align) {
   GptHeader *h = (GptHeader *)drive->gpt.primary_header;
+  uint32_t entries_sectors;
+  uint64_t first, end;
   memcpy(h->signature, GPT_HEADER_SIGNATURE, GPT_HEADER_SIGNATURE_SIZE);
   h->revision = GPT_HEADER_REVISION;
   h->size = sizeof(GptHeader);
   h->my_lba = 1;
   h->alternate_lba = drive->gpt.drive_sectors - 1;
-  h->first_usable_lba = 1 + 1 + GPT_ENTRIES_SECTORS;
-  h->last_usable_lba = drive->gpt.drive_sectors - 1 - GPT_ENTRIES_SECTORS - 1;
+  h->entries_lba = 2;
+  h->number_of_entries = 128;
+  h->size_of_entry = sizeof(GptEntry);
+  entries_sectors = CalculateEntriesSectors(h, drive->gpt.sector_bytes);
+  first = (1 + 1 + entries_sectors + align - 1) / align * align;
+  end = (drive->gpt.drive_sectors - 1 - entries_sectors) / align * align;
+  if (first >= end) {
+    Error("Drive is too small for %llu-sector alignment\n",
+          (unsigned long long)align);
+    return CGPT_FAILED;
+  }
+  h->first_usable_lba = first;
+  h->last_usable_lba = end - 1;
   if (guid) {
     if (StrToGuid(guid, &h->disk_uuid) != CGPT_OK) {
       Error("Provided GUID is invalid: \"%s\"\n", guid);
@@ -30,9 +49,6 @@ static int initialize_gpt(struct drive *drive, const char *guid) {
     }
     (*uuid_generator)((uint8_t *)&h->disk_uuid);
   }
-  h->entries_lba = 2;
-  h->number_of_entries = 128;
-  h->size_of_entry = sizeof(GptEntry);
 
   // Copy to secondary
   RepairHeader(&drive->gpt, MASK_PRIMARY);
@@ -42,6 +58,47 @@ static int initialize_gpt(struct drive *drive, const char *guid) {
   return CGPT_OK;
 }
 
+int CreateTable(struct drive *drive, CgptCreateParams *params) {
+  uint64_t align;
+
+  if (params->align_bytes) {
+    if (params->align_bytes % drive->gpt.sector_bytes) {
+      Error("Alignment %llu is not a multiple of the %u-byte sector size\n",
+            (unsigned long long)params->align_bytes, drive->gpt.sector_bytes);
+      return CGPT_FAILED;
+    }
+    align = params->align_bytes / drive->gpt.sector_bytes;
+  } else {
+    align = GetDriveAlignment(drive);
+  }
+
+  // Erase the data
+  DropExtentMap(drive);
+  DropEntryIndex(drive);
+  memset(drive->gpt.primary_header, 0,
+         drive->gpt.sector_bytes * GPT_HEADER_SECTOR);
+  memset(drive->gpt.secondary_header, 0,
+         drive->gpt.sector_bytes * GPT_HEADER_SECTOR);
+  memset(drive->gpt.primary_entries, 0, MAX_ENTRIES_SIZE);
+  memset(drive->gpt.secondary_entries, 0, MAX_ENTRIES_SIZE);
+  memset(&drive->pmbr, 0, sizeof(drive->pmbr));
+
+  drive->gpt.modified |= (GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1 |
+                          GPT_MODIFIED_HEADER2 | GPT_MODIFIED_ENTRIES2);
+  drive->pmbr_modified = 1;
+
+  // Initialize a blank set
+  if (!params->zap)
+  {
+    if (CGPT_OK != initialize_gpt(drive, params->drive_guid, align))
+      return CGPT_FAILED;
+
+    InitPMBR(drive, PRIMARY);
+  }
+
+  return CGPT_OK;
+}
+
 int CgptCreate(CgptCreateParams *params) {
   struct drive drive;
   int mode = O_RDWR;
@@ -52,40 +109,17 @@ int CgptCreate(CgptCreateParams *params) {
   if (params->create)
     mode |= O_CREAT;
 
-  if (CGPT_OK != DriveOpen(params->drive_name, &drive, params->min_size, mode))
+  if (CGPT_OK != DriveOpenWithSectorSize(params->drive_name, &drive,
+                                         params->min_size, mode,
+                                         params->sector_bytes))
     return CGPT_FAILED;
 
-  // Erase the data
-  memset(drive.gpt.primary_header, 0,
-         drive.gpt.sector_bytes * GPT_HEADER_SECTOR);
-  memset(drive.gpt.secondary_header, 0,
-         drive.gpt.sector_bytes * GPT_HEADER_SECTOR);
-  memset(drive.gpt.primary_entries, 0,
-         drive.gpt.sector_bytes * GPT_ENTRIES_SECTORS);
-  memset(drive.gpt.secondary_entries, 0,
-         drive.gpt.sector_bytes * GPT_ENTRIES_SECTORS);
-  memset(&drive.pmbr, 0, sizeof(drive.pmbr));
-
-  drive.gpt.modified |= (GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1 |
-                         GPT_MODIFIED_HEADER2 | GPT_MODIFIED_ENTRIES2);
-
-  // Initialize a blank set
-  if (!params->zap)
-  {
-    if (CGPT_OK != initialize_gpt(&drive, params->drive_guid))
-      goto bad;
-
-    InitPMBR(&drive, PRIMARY);
+  if ((params->discard && CGPT_OK != TrackDiscards(&drive)) ||
+      CGPT_OK != CreateTable(&drive, params)) {
+    DriveClose(&drive, 0);
+    return CGPT_FAILED;
   }
 
-  if (CGPT_OK != WritePMBR(&drive))
-    goto bad;
-
   // Write it all out
   return DriveClose(&drive, 1);
-
-bad:
-
-  DriveClose(&drive, 0);
-  return CGPT_FAILED;
 }
@@ -0,0 +1,63 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "discard.h"
+#include "extent_map.h"
+#include "vboot_host.h"
+
+// Discards the unallocated sectors of the usable space, the same extents
+// show --free lists. The table itself is left alone.
+int CgptDiscardFree(CgptDiscardFreeParams *params) {
+  struct drive drive;
+  const struct extent_map *map;
+  uint64_t sector_bytes;
+  uint32_t i;
+  int gpt_retval, errors = 0;
+
+  if (params == NULL)
+    return CGPT_FAILED;
+
+  // Exclusive, so nobody adds a partition in the space being discarded.
+  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDWR))
+    return CGPT_FAILED;
+
+  if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
+    Error("GptSanityCheck() returned %d: %s\n",
+          gpt_retval, GptError(gpt_retval));
+    goto bad;
+  }
+  if (!(drive.gpt.valid_headers & MASK_PRIMARY) ||
+      !(drive.gpt.valid_entries & MASK_PRIMARY)) {
+    Error("the primary GPT is invalid, please run 'cgpt repair'\n");
+    goto bad;
+  }
+  if (!(map = GetExtentMap(&drive)))
+    goto bad;
+
+  sector_bytes = drive.gpt.sector_bytes;
+  for (i = 0; i < map->num_free; i++) {
+    const struct extent *f = &map->free[i];
+
+    if (params->verbose)
+      printf("%" PRIu64 " %" PRIu64 "\n", f->start, f->end - f->start + 1);
+    if (CGPT_OK != DiscardRange(drive.fd, f->start * sector_bytes,
+                                (f->end - f->start + 1) * sector_bytes))
+      errors++;
+  }
+
+  if (CGPT_OK != DriveClose(&drive, 0) || errors)
+    return CGPT_FAILED;
+  return CGPT_OK;
+
+bad:
+  DriveClose(&drive, 0);
+  return CGPT_FAILED;
+}
@@ -9,11 +9,11 @@
 
 #include "cgpt.h"
 #include "cgptlib_internal.h"
+#include "entry_class.h"
+#include "entry_index.h"
 #include "vboot_host.h"
 
 #define BUFSIZE 1024
-// FIXME: currently we only support 512-byte sectors.
-#define LBA_SIZE 512
 
 
 // fill comparebuf with the data to be examined, returning true on success.
@@ -46,7 +46,8 @@ static int match_content(CgptFindParams *params, struct drive *drive,
     return 1;
 
   // Ensure that the region we want to match against is inside the partition.
-  part_size = LBA_SIZE * (entry->ending_lba - entry->starting_lba + 1);
+  part_size = drive->gpt.sector_bytes *
+              (entry->ending_lba - entry->starting_lba + 1);
   if (params->matchoffset + params->matchlen > part_size) {
     return 0;
   }
@@ -54,7 +55,8 @@ static int match_content(CgptFindParams *params, struct drive *drive,
   // Read the partition data.
   if (!FillBuffer(params,
                   drive->fd,
-                  (LBA_SIZE * entry->starting_lba) + params->matchoffset,
+                  (drive->gpt.sector_bytes * entry->starting_lba) +
+                  params->matchoffset,
                   params->matchlen)) {
     Error("unable to read partition data\n");
     return 0;
@@ -91,8 +93,9 @@ static int do_search(CgptFindParams *params, char *fileName) {
   int retval = 0;
   int i;
   struct drive drive;
+  struct entry_cursor cursor;
   GptEntry *entry;
-  char partlabel[GPT_PARTNAME_LEN];
+  entry_bitmap found, of_type;
 
   if (CGPT_OK != DriveOpen(fileName, &drive, 0, O_RDONLY))
     return 0;
@@ -102,27 +105,31 @@ static int do_search(CgptFindParams *params, char *fileName) {
     return 0;
   }
 
-  for (i = 0; i < GetNumberOfEntries(&drive); ++i) {
-    entry = GetEntry(&drive.gpt, ANY_VALID, i);
+  // Unique GUIDs and labels are looked up in the entry index and types are
+  // matched in one sweep of the table. Matches are still reported in
+  // partition order.
+  memset(found, 0, sizeof(found));
+  if (params->set_unique) {
+    memset(&cursor, 0, sizeof(cursor));
+    while ((i = NextUniqueMatch(&drive, &params->unique_guid, &cursor)) >= 0)
+      found[i / 64] |= 1ULL << (i % 64);
+  }
+  if (params->set_label) {
+    memset(&cursor, 0, sizeof(cursor));
+    while ((i = NextLabelMatch(&drive, params->label, &cursor)) >= 0)
+      found[i / 64] |= 1ULL << (i % 64);
+  }
+  if (params->set_type && !GuidIsZero(&params->type_guid)) {
+    MatchEntryType(&drive, ANY_VALID, &params->type_guid, of_type);
+    for (i = 0; i < ENTRY_BITMAP_WORDS; i++)
+      found[i] |= of_type[i];
+  }
 
-    if (GuidIsZero(&entry->type))
-      continue;
+  for (i = NextEntry(found, GetNumberOfEntries(&drive), -1); i >= 0;
+       i = NextEntry(found, GetNumberOfEntries(&drive), i)) {
+    entry = GetEntry(&drive.gpt, ANY_VALID, i);
 
-    int found = 0;
-    if ((params->set_unique && GuidEqual(&params->unique_guid, &entry->unique))
-        || (params->set_type && GuidEqual(&params->type_guid, &entry->type))) {
-      found = 1;
-    } else if (params->set_label) {
-      if (CGPT_OK != UTF16ToUTF8(entry->name,
-                                 sizeof(entry->name) / sizeof(entry->name[0]),
-                                 (uint8_t *)partlabel, sizeof(partlabel))) {
-        Error("The label cannot be converted from UTF16, so abort.\n");
-        return 0;
-      }
-      if (!strncmp(params->label, partlabel, sizeof(partlabel)))
-        found = 1;
-    }
-    if (found && match_content(params, &drive, entry)) {
+    if (match_content(params, &drive, entry)) {
       params->hits++;
       retval++;
       showmatch(params, fileName, i+1, entry);
@@ -145,8 +152,8 @@ static int scan_real_devs(CgptFindParams *params) {
   int found = 0;
   char line[BUFSIZE];
   char partname[128];                   // max size for /proc/partition lines?
+  char pathname[BUFSIZE];
   FILE *fp;
-  char *pathname;
 
   fp = fopen(PROC_PARTITIONS, "r");
   if (!fp) {
@@ -161,7 +168,7 @@ static int scan_real_devs(CgptFindParams *params) {
     if (sscanf(line, " %d %d %llu %127[^\n ]", &ma, &mi, &sz, partname) != 4)
       continue;
 
-    if ((pathname = IsWholeDev(partname))) {
+    if (IsWholeDev(partname, pathname, sizeof(pathname))) {
       if (do_search(params, pathname)) {
         found++;
       }
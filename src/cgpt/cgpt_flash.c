@@ -0,0 +1,640 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "crc32.h"
+#include "discard.h"
+#include "kernel_sync.h"
+#include "vboot_host.h"
+
+// O_DIRECT wants buffers, offsets and lengths on logical block boundaries,
+// which are never larger than a page.
+#define FLASH_ALIGN 4096
+#define FLASH_DEFAULT_JOBS 4
+#define FLASH_DEFAULT_CHUNK (1024 * 1024)
+#define FLASH_MAX_JOBS 64
+// How much gets written between checkpoints, and the most zeros that are
+// handed to one ZeroRange.
+#define FLASH_CHECKPOINT_BYTES (256ULL * 1024 * 1024)
+#define FLASH_MAX_ZERO_RUN (1024ULL * 1024 * 1024)
+#define CHECKPOINT_NAME "cgpt-flash"
+#define CHECKPOINT_VERSION 1
+
+enum slot_state {
+  SLOT_FREE,
+  SLOT_FILLING,     // the reader has it
+  SLOT_QUEUED,
+  SLOT_WRITING,
+};
+
+// One write in flight, or waiting to be.
+struct slot {
+  enum slot_state state;
+  uint64_t offset;
+  uint64_t len;
+  int zero;         // ZeroRange instead of writing buf
+  char *buf;
+};
+
+struct flash {
+  CgptFlashParams *params;
+  int in;
+  int out;
+  int direct;               // out is open with O_DIRECT
+  uint64_t in_size;         // 0 for pipes
+  uint64_t start;           // where this run started, after a checkpoint
+  int copied;               // the checkpoint is from after the last chunk
+  uint64_t end;             // of the image, once it has all been read
+  uint64_t zeroed;
+  uint32_t *crcs;           // of each chunk from start on, for -V
+  uint64_t num_crcs;
+  struct slot *slots;
+  int num_slots;
+  struct slot *tail;        // an unaligned last chunk, written at the end
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int done;                 // nothing more will be queued
+  int failed;               // a write failed, stop
+};
+
+static long long NowMs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int IsZero(const char *buf, size_t len) {
+  return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
+
+static int WriteAll(int fd, const char *buf, uint64_t len, uint64_t offset) {
+  ssize_t n;
+
+  while (len) {
+    n = pwrite(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      Error("Can't write at byte %llu: %s\n", (unsigned long long)offset,
+            n < 0 ? strerror(errno) : "the drive is full");
+      return CGPT_FAILED;
+    }
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+  return CGPT_OK;
+}
+
+// Reads len bytes unless the input ends first. Returns how many, or -1.
+static ssize_t ReadFull(int fd, char *buf, size_t len) {
+  size_t got = 0;
+  ssize_t n;
+
+  while (got < len) {
+    n = read(fd, buf + got, len - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    got += n;
+  }
+  return got;
+}
+
+static void *Writer(void *arg) {
+  struct flash *f = arg;
+  struct slot *s;
+  int i, r;
+
+  pthread_mutex_lock(&f->lock);
+  while (!f->failed) {
+    for (s = NULL, i = 0; i < f->num_slots && !s; i++)
+      if (f->slots[i].state == SLOT_QUEUED)
+        s = &f->slots[i];
+    if (!s) {
+      if (f->done)
+        break;
+      pthread_cond_wait(&f->cond, &f->lock);
+      continue;
+    }
+
+    s->state = SLOT_WRITING;
+    pthread_mutex_unlock(&f->lock);
+    r = s->zero ? ZeroRange(f->out, s->offset, s->len)
+                : WriteAll(f->out, s->buf, s->len, s->offset);
+    pthread_mutex_lock(&f->lock);
+    if (r != CGPT_OK)
+      f->failed = 1;
+    s->state = SLOT_FREE;
+    pthread_cond_broadcast(&f->cond);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return NULL;
+}
+
+// Waits for a free slot for the reader. Returns NULL once a write failed.
+static struct slot *GetSlot(struct flash *f) {
+  struct slot *s = NULL;
+  int i;
+
+  pthread_mutex_lock(&f->lock);
+  while (!f->failed && !s) {
+    for (i = 0; i < f->num_slots && !s; i++)
+      if (f->slots[i].state == SLOT_FREE)
+        s = &f->slots[i];
+    if (!s)
+      pthread_cond_wait(&f->cond, &f->lock);
+  }
+  if (s)
+    s->state = SLOT_FILLING;
+  pthread_mutex_unlock(&f->lock);
+  return s;
+}
+
+static void PutSlot(struct flash *f, struct slot *s, enum slot_state state) {
+  pthread_mutex_lock(&f->lock);
+  s->state = state;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+// Finds how much is on the drive: everything before the lowest write still
+// queued or in flight, or before pos if there is none. Fails once a write
+// has failed, since its slot is free again and what it didn't write could
+// be anywhere below that.
+static int WrittenUpTo(struct flash *f, uint64_t pos, uint64_t *written) {
+  int i, r = CGPT_OK;
+
+  pthread_mutex_lock(&f->lock);
+  if (f->failed)
+    r = CGPT_FAILED;
+  for (i = 0; i < f->num_slots; i++)
+    if ((f->slots[i].state == SLOT_QUEUED ||
+         f->slots[i].state == SLOT_WRITING) && f->slots[i].offset < pos)
+      pos = f->slots[i].offset;
+  pthread_mutex_unlock(&f->lock);
+  *written = pos;
+  return r;
+}
+
+static int QueueZeros(struct flash *f, uint64_t offset, uint64_t len) {
+  struct slot *s;
+
+  if (!len)
+    return CGPT_OK;
+  if (!(s = GetSlot(f)))
+    return CGPT_FAILED;
+  s->offset = offset;
+  s->len = len;
+  s->zero = 1;
+  f->zeroed += len;
+  PutSlot(f, s, SLOT_QUEUED);
+  return CGPT_OK;
+}
+
+// Records that everything before offset is safely on the drive.
+static int WriteCheckpoint(struct flash *f, uint64_t offset) {
+  char tmp[PATH_MAX];
+  FILE *fp;
+
+  if (fdatasync(f->out) < 0) {
+    Error("Can't flush the drive: %s\n", strerror(errno));
+    return CGPT_FAILED;
+  }
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", f->params->checkpoint) >=
+      sizeof(tmp)) {
+    Error("Checkpoint file name too long\n");
+    return CGPT_FAILED;
+  }
+  if (!(fp = fopen(tmp, "w"))) {
+    Error("Can't write %s: %s\n", tmp, strerror(errno));
+    return CGPT_FAILED;
+  }
+  fprintf(fp, "%s %d\n%llu %llu %llu\n", CHECKPOINT_NAME, CHECKPOINT_VERSION,
+          (unsigned long long)f->in_size,
+          (unsigned long long)f->params->chunk_bytes,
+          (unsigned long long)offset);
+  if (fflush(fp) || fsync(fileno(fp)) || ferror(fp)) {
+    Error("Can't write %s: %s\n", tmp, strerror(errno));
+    fclose(fp);
+    return CGPT_FAILED;
+  }
+  fclose(fp);
+  if (rename(tmp, f->params->checkpoint) < 0) {
+    Error("Can't write %s: %s\n", f->params->checkpoint, strerror(errno));
+    return CGPT_FAILED;
+  }
+  return CGPT_OK;
+}
+
+// Picks up where an earlier run left off, if its checkpoint is there.
+static int ReadCheckpoint(struct flash *f) {
+  unsigned long long in_size, chunk, offset;
+  char magic[32];
+  FILE *fp;
+  int n, version;
+
+  f->start = 0;
+  if (!f->params->checkpoint)
+    return CGPT_OK;
+  if (!(fp = fopen(f->params->checkpoint, "r")))
+    return errno == ENOENT ? CGPT_OK : CGPT_FAILED;
+  n = fscanf(fp, "%31s %d %llu %llu %llu", magic, &version, &in_size, &chunk,
+             &offset);
+  fclose(fp);
+  if (n != 5 || strcmp(magic, CHECKPOINT_NAME) ||
+      version != CHECKPOINT_VERSION) {
+    Error("%s is not a flash checkpoint\n", f->params->checkpoint);
+    return CGPT_FAILED;
+  }
+  // Only the checkpoint written once all is copied can end between chunks,
+  // and the image on a pipe has no size to check that against.
+  if (in_size != f->in_size || chunk != f->params->chunk_bytes ||
+      (offset % chunk && in_size && offset != in_size) ||
+      (in_size && offset > in_size)) {
+    Error("%s was written for another image or chunk size\n",
+          f->params->checkpoint);
+    return CGPT_FAILED;
+  }
+  f->start = offset;
+  f->copied = offset % chunk || (in_size && offset == in_size);
+  return CGPT_OK;
+}
+
+// Moves the input to where the checkpoint says to continue from.
+static int SkipInput(struct flash *f, char *buf) {
+  uint64_t left = f->start;
+  ssize_t n;
+
+  if (!left || f->copied || lseek(f->in, left, SEEK_SET) == left)
+    return CGPT_OK;
+  while (left) {
+    n = ReadFull(f->in, buf, left < f->params->chunk_bytes
+                                 ? left : f->params->chunk_bytes);
+    if (n <= 0) {
+      Error("Can't skip to byte %llu of the image: %s\n",
+            (unsigned long long)f->start,
+            n < 0 ? strerror(errno) : "it is shorter");
+      return CGPT_FAILED;
+    }
+    left -= n;
+  }
+  return CGPT_OK;
+}
+
+// Reads the image and queues its chunks for the writers, zeros as ranges to
+// zero rather than buffers to write.
+static int ReadImage(struct flash *f) {
+  uint64_t chunk = f->params->chunk_bytes, pos = f->start;
+  uint64_t zero_start = 0, zero_len = 0, next_checkpoint, written;
+  uint32_t *crcs;
+  struct slot *s;
+  ssize_t n;
+
+  // Only the table is left to fix.
+  if (f->copied) {
+    f->end = pos;
+    return CGPT_OK;
+  }
+
+  next_checkpoint = pos + FLASH_CHECKPOINT_BYTES;
+  for (;;) {
+    if (!(s = GetSlot(f)))
+      return CGPT_FAILED;
+    n = ReadFull(f->in, s->buf, chunk);
+    if (n < 0) {
+      Error("Can't read the image: %s\n", strerror(errno));
+      PutSlot(f, s, SLOT_FREE);
+      return CGPT_FAILED;
+    }
+    if (n == 0) {
+      PutSlot(f, s, SLOT_FREE);
+      break;
+    }
+
+    if (f->params->verify) {
+      crcs = realloc(f->crcs, (f->num_crcs + 1) * sizeof(*crcs));
+      if (!crcs) {
+        Error("Out of memory\n");
+        PutSlot(f, s, SLOT_FREE);
+        return CGPT_FAILED;
+      }
+      f->crcs = crcs;
+      f->crcs[f->num_crcs++] = Crc32(s->buf, n);
+    }
+
+    if (IsZero(s->buf, n)) {
+      PutSlot(f, s, SLOT_FREE);
+      if (!zero_len)
+        zero_start = pos;
+      zero_len += n;
+      if (zero_len >= FLASH_MAX_ZERO_RUN) {
+        if (CGPT_OK != QueueZeros(f, zero_start, zero_len))
+          return CGPT_FAILED;
+        zero_len = 0;
+      }
+    } else {
+      if (CGPT_OK != QueueZeros(f, zero_start, zero_len)) {
+        PutSlot(f, s, SLOT_FREE);
+        return CGPT_FAILED;
+      }
+      zero_len = 0;
+      s->offset = pos;
+      s->len = n;
+      s->zero = 0;
+      if (f->direct && n % FLASH_ALIGN)
+        f->tail = s;      // stays SLOT_FILLING
+      else
+        PutSlot(f, s, SLOT_QUEUED);
+    }
+    pos += n;
+    if (n < chunk)
+      break;
+
+    if (f->params->checkpoint && pos >= next_checkpoint) {
+      if (CGPT_OK != WrittenUpTo(f, zero_len ? zero_start : pos, &written) ||
+          CGPT_OK != WriteCheckpoint(f, written))
+        return CGPT_FAILED;
+      next_checkpoint = pos + FLASH_CHECKPOINT_BYTES;
+    }
+  }
+
+  f->end = pos;
+  return QueueZeros(f, zero_start, zero_len);
+}
+
+// Reads back what this run wrote and compares the CRCs.
+static int Verify(struct flash *f, char *buf) {
+  uint64_t chunk = f->params->chunk_bytes, pos, i;
+  ssize_t n;
+
+  // Make sure the reads come from the drive.
+  (void) posix_fadvise(f->out, f->start, f->end - f->start,
+                       POSIX_FADV_DONTNEED);
+  for (i = 0, pos = f->start; pos < f->end; i++, pos += chunk) {
+    n = pread(f->out, buf, f->end - pos < chunk ? f->end - pos : chunk, pos);
+    if (n < 0) {
+      Error("Can't read back byte %llu: %s\n", (unsigned long long)pos,
+            strerror(errno));
+      return CGPT_FAILED;
+    }
+    if (i >= f->num_crcs || Crc32(buf, n) != f->crcs[i]) {
+      Error("Verification failed in bytes %llu-%llu\n",
+            (unsigned long long)pos, (unsigned long long)(pos + n - 1));
+      return CGPT_FAILED;
+    }
+  }
+  return CGPT_OK;
+}
+
+// Points the backup GPT of the image at the end of the real drive and
+// tells the kernel about the partitions.
+static int FixTable(CgptFlashParams *params) {
+  struct drive drive;
+  GptHeader *h;
+  uint64_t bytes;
+  int gpt_retval;
+
+  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDWR))
+    return CGPT_FAILED;
+
+  if (CGPT_OK != ReadPMBR(&drive)) {
+    Error("Unable to read PMBR\n");
+    goto bad;
+  }
+  if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
+    Error("The image was written but its GPT is not valid: %s\n",
+          GptError(gpt_retval));
+    goto bad;
+  }
+
+  // The image's own backup GPT ends up in what becomes free space.
+  h = (GptHeader *)drive.gpt.primary_header;
+  bytes = drive.gpt.sector_bytes;
+  if ((drive.gpt.valid_headers & MASK_PRIMARY) &&
+      h->alternate_lba < drive.gpt.drive_sectors - 1) {
+    if (h->alternate_lba > h->last_usable_lba &&
+        CGPT_OK != ZeroRange(drive.fd, (h->last_usable_lba + 1) * bytes,
+                             (h->alternate_lba - h->last_usable_lba) * bytes))
+      goto bad;
+    // A backup an earlier image left at the end of the drive would pass
+    // for a valid one once the primary points at it, and make GptRepair
+    // give up. It gets rewritten from the primary anyway.
+    memset(drive.gpt.secondary_header, 0, bytes);
+    drive.gpt.valid_headers &= ~MASK_SECONDARY;
+    drive.gpt.valid_entries &= ~MASK_SECONDARY;
+  }
+
+  if (GPT_SUCCESS != (gpt_retval = GptRepair(&drive.gpt))) {
+    Error("GptRepair() returned %d: %s\n",
+          gpt_retval, GptError(gpt_retval));
+    goto bad;
+  }
+  UpdatePMBR(&drive, PRIMARY);
+  drive.pmbr_modified = 1;
+
+  // DriveClose only updates the kernel when the table changed.
+  if (!drive.gpt.modified && CGPT_OK != SyncKernelPartitions(&drive, NULL))
+    goto bad;
+  return DriveClose(&drive, 1);
+
+bad:
+  DriveClose(&drive, 0);
+  return CGPT_FAILED;
+}
+
+static int OpenDrive(struct flash *f) {
+  struct stat st;
+  uint64_t size;
+  int flags = O_RDWR | O_CLOEXEC;
+
+  if (stat(f->params->drive_name, &st) < 0) {
+    Error("Can't open %s: %s\n", f->params->drive_name, strerror(errno));
+    return CGPT_FAILED;
+  }
+  // Refuse drives with mounted partitions.
+  if (S_ISBLK(st.st_mode))
+    flags |= O_EXCL;
+
+  f->direct = 1;
+  f->out = open(f->params->drive_name, flags | O_DIRECT);
+  if (f->out < 0 && errno == EINVAL) {
+    f->direct = 0;
+    f->out = open(f->params->drive_name, flags);
+  }
+  if (f->out < 0) {
+    Error("Can't open %s: %s\n", f->params->drive_name,
+          errno == EBUSY ? "it is in use" : strerror(errno));
+    return CGPT_FAILED;
+  }
+  if (CGPT_OK != LockDrive(f->out, f->params->drive_name, O_RDWR))
+    return CGPT_FAILED;
+
+  if (S_ISBLK(st.st_mode) && f->in_size &&
+      ioctl(f->out, BLKGETSIZE64, &size) == 0 && size < f->in_size) {
+    Error("The image is %llu bytes, %s only %llu\n",
+          (unsigned long long)f->in_size, f->params->drive_name,
+          (unsigned long long)size);
+    return CGPT_FAILED;
+  }
+  return CGPT_OK;
+}
+
+// Streams the image onto the drive with several aligned writes in flight,
+// then moves the backup GPT to the end of the drive. Runs of zeros are
+// zeroed with BLKZEROOUT, which unmaps them where the drive can promise
+// they'll read as zeros, instead of being written.
+int CgptFlash(CgptFlashParams *params) {
+  struct flash f;
+  struct stat st;
+  pthread_t threads[FLASH_MAX_JOBS];
+  char *buf = NULL;
+  long long start_ms = NowMs();
+  int i, started = 0, r = CGPT_FAILED;
+
+  if (params == NULL || !params->image || !params->drive_name)
+    return CGPT_FAILED;
+  if (!params->jobs)
+    params->jobs = FLASH_DEFAULT_JOBS;
+  if (!params->chunk_bytes)
+    params->chunk_bytes = FLASH_DEFAULT_CHUNK;
+  if (params->jobs < 1 || params->jobs > FLASH_MAX_JOBS ||
+      params->chunk_bytes % FLASH_ALIGN) {
+    Error("invalid number of writes or chunk size\n");
+    return CGPT_FAILED;
+  }
+
+  memset(&f, 0, sizeof(f));
+  f.params = params;
+  f.in = f.out = -1;
+  pthread_mutex_init(&f.lock, NULL);
+  pthread_cond_init(&f.cond, NULL);
+
+  if (!strcmp(params->image, "-")) {
+    f.in = STDIN_FILENO;
+  } else if ((f.in = open(params->image, O_RDONLY | O_CLOEXEC)) < 0) {
+    Error("Can't open %s: %s\n", params->image, strerror(errno));
+    goto out;
+  }
+  if (fstat(f.in, &st) == 0 && S_ISREG(st.st_mode)) {
+    f.in_size = st.st_size;
+    (void) posix_fadvise(f.in, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  if (CGPT_OK != ReadCheckpoint(&f) || CGPT_OK != OpenDrive(&f))
+    goto out;
+
+  f.num_slots = params->jobs * 2;
+  if (!(f.slots = calloc(f.num_slots, sizeof(*f.slots))) ||
+      posix_memalign((void **)&buf, FLASH_ALIGN, params->chunk_bytes)) {
+    Error("Out of memory\n");
+    goto out;
+  }
+  for (i = 0; i < f.num_slots; i++) {
+    if (posix_memalign((void **)&f.slots[i].buf, FLASH_ALIGN,
+                       params->chunk_bytes)) {
+      Error("Out of memory\n");
+      goto out;
+    }
+  }
+  if (CGPT_OK != SkipInput(&f, buf))
+    goto out;
+
+  for (started = 0; started < params->jobs; started++) {
+    if (pthread_create(&threads[started], NULL, Writer, &f)) {
+      Error("Can't start a writer thread\n");
+      break;
+    }
+  }
+  r = started ? ReadImage(&f) : CGPT_FAILED;
+  pthread_mutex_lock(&f.lock);
+  f.done = 1;
+  if (r != CGPT_OK)
+    f.failed = 1;
+  pthread_cond_broadcast(&f.cond);
+  pthread_mutex_unlock(&f.lock);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  if (r != CGPT_OK || f.failed) {
+    r = CGPT_FAILED;
+    goto out;
+  }
+  r = CGPT_FAILED;
+
+  // O_DIRECT can't do the last few bytes if they don't fill a block, nor
+  // read them back.
+  if (f.direct && fcntl(f.out, F_SETFL, fcntl(f.out, F_GETFL) & ~O_DIRECT)) {
+    Error("Can't stop direct I/O to %s: %s\n", params->drive_name,
+          strerror(errno));
+    goto out;
+  }
+  if (f.tail &&
+      CGPT_OK != WriteAll(f.out, f.tail->buf, f.tail->len, f.tail->offset))
+    goto out;
+  // Zeros at the end of an image file are punched holes past its end.
+  if (fstat(f.out, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < f.end &&
+      ftruncate(f.out, f.end) < 0) {
+    Error("Can't extend %s: %s\n", params->drive_name, strerror(errno));
+    goto out;
+  }
+  if (fdatasync(f.out) < 0) {
+    Error("Can't flush %s: %s\n", params->drive_name, strerror(errno));
+    goto out;
+  }
+  if (params->verbose)
+    printf("Wrote bytes %llu-%llu, %llu of them as zeros, in %lld ms\n",
+           (unsigned long long)f.start, (unsigned long long)f.end,
+           (unsigned long long)f.zeroed, NowMs() - start_ms);
+
+  if (params->verify) {
+    start_ms = NowMs();
+    if (CGPT_OK != Verify(&f, buf))
+      goto out;
+    if (params->verbose)
+      printf("Verified in %lld ms\n", NowMs() - start_ms);
+  }
+  if (params->checkpoint && CGPT_OK != WriteCheckpoint(&f, f.end))
+    goto out;
+
+  // FixTable opens the drive again and wants the lock.
+  close(f.out);
+  f.out = -1;
+  if (CGPT_OK != FixTable(params))
+    goto out;
+  if (params->checkpoint)
+    (void) unlink(params->checkpoint);
+  r = CGPT_OK;
+
+out:
+  if (f.out >= 0)
+    close(f.out);
+  if (f.in > STDIN_FILENO)
+    close(f.in);
+  for (i = 0; f.slots && i < f.num_slots; i++)
+    free(f.slots[i].buf);
+  free(f.slots);
+  free(f.crcs);
+  free(buf);
+  pthread_mutex_destroy(&f.lock);
+  pthread_cond_destroy(&f.cond);
+  return r;
+}
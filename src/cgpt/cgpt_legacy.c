@@ -6,35 +6,46 @@
 
 #include "cgpt.h"
 #include "cgptlib_internal.h"
+#include "entry_index.h"
+#include "extent_map.h"
 #include "vboot_host.h"
 
-int CgptLegacy(CgptLegacyParams *params) {
-  struct drive drive;
+void SetLegacySignature(struct drive *drive, CgptLegacyParams *params) {
   GptHeader *h1, *h2;
 
-  if (params == NULL)
-    return CGPT_FAILED;
+  // The valid copy may change, so the cached views go stale.
+  DropExtentMap(drive);
+  DropEntryIndex(drive);
 
-  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDWR))
-    return CGPT_FAILED;
-
-  h1 = (GptHeader *)drive.gpt.primary_header;
-  h2 = (GptHeader *)drive.gpt.secondary_header;
+  h1 = (GptHeader *)drive->gpt.primary_header;
+  h2 = (GptHeader *)drive->gpt.secondary_header;
   if (params->efipart) {
     memcpy(h1->signature, GPT_HEADER_SIGNATURE, GPT_HEADER_SIGNATURE_SIZE);
     memcpy(h2->signature, GPT_HEADER_SIGNATURE, GPT_HEADER_SIGNATURE_SIZE);
-    RepairEntries(&drive.gpt, MASK_SECONDARY);
-    drive.gpt.modified |= (GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1 |
-                           GPT_MODIFIED_HEADER2);
+    RepairEntries(&drive->gpt, MASK_SECONDARY);
+    drive->gpt.modified |= (GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1 |
+                            GPT_MODIFIED_HEADER2);
   } else {
     memcpy(h1->signature, GPT_HEADER_SIGNATURE2, GPT_HEADER_SIGNATURE_SIZE);
     memcpy(h2->signature, GPT_HEADER_SIGNATURE2, GPT_HEADER_SIGNATURE_SIZE);
-    memset(drive.gpt.primary_entries, 0, drive.gpt.sector_bytes);
-    drive.gpt.modified |= (GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1 |
-                           GPT_MODIFIED_HEADER2);
+    memset(drive->gpt.primary_entries, 0, drive->gpt.sector_bytes);
+    drive->gpt.modified |= (GPT_MODIFIED_HEADER1 | GPT_MODIFIED_ENTRIES1 |
+                            GPT_MODIFIED_HEADER2);
   }
 
-  UpdateCrc(&drive.gpt);
+  UpdateCrc(&drive->gpt);
+}
+
+int CgptLegacy(CgptLegacyParams *params) {
+  struct drive drive;
+
+  if (params == NULL)
+    return CGPT_FAILED;
+
+  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDWR))
+    return CGPT_FAILED;
+
+  SetLegacySignature(&drive, params);
 
   // Write it all out
   return DriveClose(&drive, 1);
@@ -7,51 +7,63 @@
 
 #include "cgpt.h"
 #include "cgptlib_internal.h"
+#include "entry_class.h"
 #include "vboot_host.h"
 
 #define BUFSIZE 1024
 
-char next_file_name[BUFSIZE];
-int next_priority, next_index;
+// The best root found so far, over all the drives searched.
+struct next_root {
+  char file_name[BUFSIZE];
+  int priority;
+  int index;                    // -1 until one is found
+};
+
+static void select_partition(const char *drive_name, struct drive *drive,
+                             uint32_t index, struct next_root *next) {
+  strncpy(next->file_name, drive_name, BUFSIZE);
+  next->file_name[BUFSIZE - 1] = '\0';
+  if (GetSuccessful(drive, PRIMARY, index) || GetTries(drive, PRIMARY, index))
+    next->priority = GetPriority(drive, PRIMARY, index);
+  else
+    next->priority = -1;
+  next->index = index;
+}
 
-static int do_search(CgptNextParams *params) {
+static int do_search(const char *drive_name, struct next_root *next) {
   struct drive drive;
-  uint32_t max_part;
+  struct entry_classes cls;
+  GptPriorityBuckets bootable;
   int gpt_retval;
-  int priority, tries, successful;
   int i;
 
-  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDONLY))
+  if (CGPT_OK != DriveOpen(drive_name, &drive, 0, O_RDONLY))
     return CGPT_FAILED;
 
   if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
     Error("GptSanityCheck() returned %d: %s\n",
           gpt_retval, GptError(gpt_retval));
+    (void) DriveClose(&drive, 0);
     return CGPT_FAILED;
   }
 
-  max_part = GetNumberOfEntries(&drive);
-
-  for (i = 0; i < max_part; i++) {
-    if (!IsRoot(&drive, PRIMARY, i))
-      continue;
-
-    priority = GetPriority(&drive, PRIMARY, i);
-    tries = GetTries(&drive, PRIMARY, i);
-    successful = GetSuccessful(&drive, PRIMARY, i);
-
-    if (next_index == -1 || ((priority > next_priority) && (successful || tries))) {
-      strncpy(next_file_name, params->drive_name, BUFSIZE);
-      next_file_name[BUFSIZE - 1] = '\0';
-      if (successful || tries) {
-        next_priority = priority;
-      } else {
-        next_priority = -1;
-      }
-      next_index = i;
-    }
+  // Fall back to the first root found if nothing is bootable.
+  if (next->index == -1) {
+    ClassifyEntries(&drive, PRIMARY, &cls);
+    i = NextEntry(cls.root, cls.num_entries, -1);
+    if (i >= 0)
+      select_partition(drive_name, &drive, i, next);
   }
 
+  // The first of the highest priority bootable roots beats anything with a
+  // lower priority found so far.
+  BucketEntriesByPriority((GptHeader *)drive.gpt.primary_header,
+                          (GptEntry *)drive.gpt.primary_entries,
+                          &guid_coreos_rootfs, 1, &bootable);
+  if (bootable.total &&
+      GetPriority(&drive, PRIMARY, bootable.order[0]) > next->priority)
+    select_partition(drive_name, &drive, bootable.order[0], next);
+
   return DriveClose(&drive, 0);
 }
 
@@ -59,12 +71,12 @@ static int do_search(CgptNextParams *params) {
 
 // This scans all the physical devices it can find, looking for a match. It
 // returns true if any matches were found, false otherwise.
-static int scan_real_devs(CgptNextParams *params) {
+static int scan_real_devs(struct next_root *next) {
   int found = 0;
   char line[BUFSIZE];
   char partname[128];                   // max size for /proc/partition lines?
+  char pathname[BUFSIZE];
   FILE *fp;
-  char *pathname;
 
   fp = fopen(PROC_PARTITIONS, "r");
   if (!fp) {
@@ -79,10 +91,8 @@ static int scan_real_devs(CgptNextParams *params) {
     if (sscanf(line, " %d %d %llu %127[^\n ]", &ma, &mi, &sz, partname) != 4)
       continue;
 
-    if ((pathname = IsWholeDev(partname))) {
-      params->drive_name = pathname;
-      do_search(params);
-    }
+    if (IsWholeDev(partname, pathname, sizeof(pathname)))
+      do_search(pathname, next);
   }
 
   fclose(fp);
@@ -91,41 +101,44 @@ static int scan_real_devs(CgptNextParams *params) {
 
 int CgptNext(CgptNextParams *params) {
   struct drive drive;
+  struct next_root next;
   GptEntry *entry;
   char tmp[64];
   int tries;
-  next_index = -1;
   int gpt_retval;
 
   if (params == NULL)
     return CGPT_FAILED;
 
+  memset(&next, 0, sizeof(next));
+  next.index = -1;
   if (params->drive_name) {
-    do_search(params);
+    do_search(params->drive_name, &next);
   } else {
-    scan_real_devs(params);
+    scan_real_devs(&next);
   }
 
-  if (strlen(next_file_name) == 0) {
+  if (next.index == -1) {
     return CGPT_FAILED;
   }
 
-  if (DriveOpen(next_file_name, &drive, 0, O_RDWR) == CGPT_OK) {
+  if (DriveOpen(next.file_name, &drive, 0, O_RDWR) == CGPT_OK) {
     if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
       Error("GptSanityCheck() returned %d: %s\n",
             gpt_retval, GptError(gpt_retval));
+      (void) DriveClose(&drive, 0);
       return CGPT_FAILED;
     }
 
     // Decrement tries if we selected on that criteria
-    tries = GetTries(&drive, PRIMARY, next_index);
+    tries = GetTries(&drive, PRIMARY, next.index);
     if (tries > 0) {
       tries--;
     }
-    SetTries(&drive, PRIMARY, next_index, tries);
+    SetTries(&drive, PRIMARY, next.index, tries);
 
     // Print out the next disk to go!
-    entry = GetEntry(&drive.gpt, ANY_VALID, next_index);
+    entry = GetEntry(&drive.gpt, ANY_VALID, next.index);
     GuidToStrLower(&entry->unique, tmp, sizeof(tmp));
     printf("%s\n", tmp);
 
@@ -8,100 +8,97 @@
 #include "cgptlib_internal.h"
 #include "vboot_host.h"
 
-//////////////////////////////////////////////////////////////////////////////
-// We need a sorted list of priority groups, where each element in the list
-// contains an unordered list of GPT partition numbers.
-
-#define MAX_GROUPS 17                   // 0-15, plus one "higher"
-
-typedef struct {
-  int priority;                         // priority of this group
-  int num_parts;                        // number of partitions in this group
-  uint32_t *part;                       // array of partitions in this group
-} group_t;
-
-typedef struct {
-  int max_parts;                       // max number of partitions in any group
-  int num_groups;                      // number of non-empty groups
-  group_t group[MAX_GROUPS];           // array of groups
-} group_list_t;
-
-
-static group_list_t *NewGroupList(int max_p) {
-  int i;
-  group_list_t *gl = (group_list_t *)malloc(sizeof(group_list_t));
-  require(gl);
-  gl->max_parts = max_p;
-  gl->num_groups = 0;
-  // reserve space for the maximum number of partitions in every group
-  for (i=0; i<MAX_GROUPS; i++) {
-    gl->group[i].priority = -1;
-    gl->group[i].num_parts = 0;
-    gl->group[i].part = (uint32_t *)malloc(sizeof(uint32_t) * max_p);
-    require(gl->group[i].part);
+// Marks the group of the partition being set when it moves without its
+// friends.
+#define LONE_PARTITION -1
+
+int PrioritizeRoots(struct drive *drive, CgptPrioritizeParams *params) {
+  int priority;
+  uint32_t index = 0;
+  uint32_t max_part;
+  int i, j;
+  // Partitions by their current priority, and the groups in their new order
+  // given as the priority they come from. At most one lone partition plus
+  // the 15 nonzero priorities.
+  GptPriorityBuckets buckets;
+  int groups[GPT_NUM_PRIORITIES];
+  int num_groups = 0;
+
+  max_part = GetNumberOfEntries(drive);
+
+  if (params->max_priority < 0 ||
+      params->max_priority > CGPT_ATTRIBUTE_MAX_PRIORITY) {
+    Error("invalid priority: %d (must be between 0 and %d)\n",
+          params->max_priority, CGPT_ATTRIBUTE_MAX_PRIORITY);
+    return CGPT_FAILED;
   }
 
-  return gl;
-}
+  if (params->set_partition) {
+    if (params->set_partition < 1 || params->set_partition > max_part) {
+      Error("invalid partition number: %d (must be between 1 and %d\n",
+            params->set_partition, max_part);
+      return CGPT_FAILED;
+    }
+    index = params->set_partition - 1;
+    // it must be a kernel
+    if (!IsRoot(drive, PRIMARY, index)) {
+      Error("partition %d is not a CoreOS root\n", params->set_partition);
+      return CGPT_FAILED;
+    }
+  }
 
-static void FreeGroups(group_list_t *gl) {
-  int i;
-  for (i=0; i<MAX_GROUPS; i++)
-    free(gl->group[i].part);
-  free(gl);
-}
+  // Determine the current priority groups
+  BucketEntriesByPriority((GptHeader *)drive->gpt.primary_header,
+                          (GptEntry *)drive->gpt.primary_entries,
+                          &guid_coreos_rootfs, 0, &buckets);
 
-static void AddToGroup(group_list_t *gl, int priority, int partition) {
-  int i;
-  // See if I've already got a group with this priority
-  for (i=0; i<gl->num_groups; i++)
-    if (gl->group[i].priority == priority)
-      break;
-  if (i == gl->num_groups) {
-    // no, add a group
-    require(i < MAX_GROUPS);
-    gl->num_groups++;
-    gl->group[i].priority = priority;
+  // The special partition goes first, taking its friends along if asked.
+  if (params->set_partition) {
+    params->orig_priority = GetPriority(drive, PRIMARY, index);
+    groups[num_groups++] = params->set_friends ? params->orig_priority
+                                               : LONE_PARTITION;
   }
-  // add the partition to it
-  int j = gl->group[i].num_parts;
-  gl->group[i].part[j] = partition;
-  gl->group[i].num_parts++;
-}
 
-static void ChangeGroup(group_list_t *gl, int old_priority, int new_priority) {
-  int i;
-  for (i=0; i<gl->num_groups; i++)
-    if (gl->group[i].priority == old_priority) {
-      gl->group[i].priority = new_priority;
-      break;
-    }
-}
+  // The rest keep their order. We'll never lower anything to zero, so the
+  // priority zero group is left alone.
+  for (i = CGPT_ATTRIBUTE_MAX_PRIORITY; i > 0; i--) {
+    int count = buckets.count[i];
 
-static void SortGroups(group_list_t *gl) {
-  int i, j;
-  group_t tmp;
-
-  // straight insertion sort is fast enough
-  for (i=1; i<gl->num_groups; i++) {
-    tmp = gl->group[i];
-    for (j=i; j && (gl->group[j-1].priority < tmp.priority); j--)
-      gl->group[j] = gl->group[j-1];
-    gl->group[j] = tmp;
+    if (params->set_partition && i == params->orig_priority)
+      count = params->set_friends ? 0 : count - 1;
+    if (count)
+      groups[num_groups++] = i;
   }
+
+  // Where do we start?
+  if (params->max_priority)
+    priority = params->max_priority;
+  else
+    priority = num_groups > 15 ? 15 : num_groups;
+
+  // Now apply the ranking to the GPT
+  for (i = 0; i < num_groups; i++) {
+    if (groups[i] == LONE_PARTITION) {
+      SetPriority(drive, PRIMARY, index, priority);
+    } else {
+      for (j = 0; j < buckets.count[groups[i]]; j++) {
+        uint32_t part = buckets.order[buckets.start[groups[i]] + j];
+
+        if (params->set_partition && !params->set_friends && part == index)
+          continue;
+        SetPriority(drive, PRIMARY, part, priority);
+      }
+    }
+    if (priority > 1)
+      priority--;
+  }
+
+  return CGPT_OK;
 }
 
 int CgptPrioritize(CgptPrioritizeParams *params) {
   struct drive drive;
-
-  int priority;
-
   int gpt_retval;
-  uint32_t index;
-  uint32_t max_part;
-  int num_root;
-  int i,j;
-  group_list_t *groups;
 
   if (params == NULL)
     return CGPT_FAILED;
@@ -112,96 +109,17 @@ int CgptPrioritize(CgptPrioritizeParams *params) {
   if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
     Error("GptSanityCheck() returned %d: %s\n",
           gpt_retval, GptError(gpt_retval));
+    (void) DriveClose(&drive, 0);
     return CGPT_FAILED;
   }
 
-  max_part = GetNumberOfEntries(&drive);
-
-  if (params->set_partition) {
-    if (params->set_partition < 1 || params->set_partition > max_part) {
-      Error("invalid partition number: %d (must be between 1 and %d\n",
-            params->set_partition, max_part);
-      goto bad;
-    }
-    index = params->set_partition - 1;
-    // it must be a kernel
-    if (!IsRoot(&drive, PRIMARY, index)) {
-      Error("partition %d is not a CoreOS root\n", params->set_partition);
-      goto bad;
-    }
-  }
-
-  // How many kernel partitions do I have?
-  num_root = 0;
-  for (i = 0; i < max_part; i++) {
-    if (IsRoot(&drive, PRIMARY, i))
-      num_root++;
-  }
-
-  if (num_root) {
-    // Determine the current priority groups
-    groups = NewGroupList(num_root);
-    for (i = 0; i < max_part; i++) {
-      if (!IsRoot(&drive, PRIMARY, i))
-        continue;
-
-      priority = GetPriority(&drive, PRIMARY, i);
-
-      // Is this partition special?
-      if (params->set_partition && (i+1 == params->set_partition)) {
-        params->orig_priority = priority;  // remember the original priority
-        if (params->set_friends)
-          AddToGroup(groups, priority, i); // we'll move them all later
-        else
-          AddToGroup(groups, 99, i);       // move only this one
-      } else {
-        AddToGroup(groups, priority, i);   // just remember
-      }
-    }
-
-    // If we're including friends, then change the original group priority
-    if (params->set_partition && params->set_friends) {
-      ChangeGroup(groups, params->orig_priority, 99);
-    }
-
-    // Sorting gives the new order. Now we just need to reassign the
-    // priorities.
-    SortGroups(groups);
-
-    // We'll never lower anything to zero, so if the last group is priority zero
-    // we can ignore it.
-    i = groups->num_groups;
-    if (groups->group[i-1].priority == 0)
-      groups->num_groups--;
-
-    // Where do we start?
-    if (params->max_priority)
-      priority = params->max_priority;
-    else
-      priority = groups->num_groups > 15 ? 15 : groups->num_groups;
-
-    // Figure out what the new values should be
-    for (i=0; i<groups->num_groups; i++) {
-      groups->group[i].priority = priority;
-      if (priority > 1)
-        priority--;
-    }
-
-    // Now apply the ranking to the GPT
-    for (i=0; i<groups->num_groups; i++)
-      for (j=0; j<groups->group[i].num_parts; j++)
-        SetPriority(&drive, PRIMARY,
-                    groups->group[i].part[j], groups->group[i].priority);
-
-    FreeGroups(groups);
+  if (CGPT_OK != PrioritizeRoots(&drive, params)) {
+    (void) DriveClose(&drive, 0);
+    return CGPT_FAILED;
   }
 
   // Write it all out
   UpdateAllEntries(&drive);
 
   return DriveClose(&drive, 1);
-
-bad:
-  (void) DriveClose(&drive, 0);
-  return CGPT_FAILED;
 }
@@ -30,6 +30,7 @@ int CgptRepair(CgptRepairParams *params) {
   if (GPT_SUCCESS != (gpt_retval = GptRepair(&drive.gpt))) {
     Error("GptRepair() returned %d: %s\n",
           gpt_retval, GptError(gpt_retval));
+    (void) DriveClose(&drive, 0);
     return CGPT_FAILED;
   }
 
@@ -2,74 +2,155 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
-#include <blkid/blkid.h>
-#include <linux/blkpg.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "blkid_utils.h"
 #include "cgpt.h"
 #include "cgptlib_internal.h"
+#include "extent_map.h"
+#include "fs_grow.h"
+#include "kernel_sync.h"
 #include "vboot_host.h"
 
-/* For building with linux headers < 3.6 */
-#ifndef BLKPG_RESIZE_PARTITION
-# define BLKPG_RESIZE_PARTITION 3
-#endif
+// A partition to grow, or a drive to grow all coreos-resize partitions of.
+struct resize_target {
+  const char *name;             // as given
+  char disk[PATH_MAX];          // the drive to open
+  dev_t disk_devno;             // 0 for image files
+  uint32_t partno;              // 0 for every coreos-resize partition
+  int done;                     // its disk has been handled
+};
 
-/* Call the BLKPG ioctl to notify the kernel of the change.
- * start and size are in bytes
- */
-static int blkpg_resize_partition(int fd, int partno,
-                                  uint64_t start, uint64_t size) {
-  struct blkpg_ioctl_arg arg;
-  struct blkpg_partition part;
-
-  part.pno = partno;
-  part.start = start;
-  part.length = size;
-  part.devname[0] = '\0';
-  part.volname[0] = '\0';
-  arg.op = BLKPG_RESIZE_PARTITION;
-  arg.flags = 0;
-  arg.datalen = sizeof(part);
-  arg.data = &part;
-
-  return ioctl(fd, BLKPG, &arg);
+static long long NowMs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Finds the whole disk and partition number of a partition device through
+ * /sys/dev/block, without probing anything else. */
+static int resolve_partition(struct resize_target *t) {
+  char sysdir[PATH_MAX], disk_sysdir[PATH_MAX], path[PATH_MAX];
+  char line[256];
+  unsigned int maj, min;
+  uint64_t partno;
+  struct stat st;
+  char *slash;
+  FILE *f;
+  int found = 0;
+
+  if (stat(t->name, &st) < 0) {
+    Error("unable to access device %s: %s\n", t->name, strerror(errno));
+    return CGPT_FAILED;
+  }
+  if (!S_ISBLK(st.st_mode)) {
+    Error("%s is not a block device\n", t->name);
+    return CGPT_FAILED;
+  }
+
+  snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u",
+           major(st.st_rdev), minor(st.st_rdev));
+  if (ReadSysfsNumber(sysdir, "partition", &partno) < 0 || !partno) {
+    Error("%s is not a partition\n", t->name);
+    return CGPT_FAILED;
+  }
+  t->partno = partno;
+
+  // The partition's directory is inside the disk's.
+  if (!realpath(sysdir, disk_sysdir) ||
+      !(slash = strrchr(disk_sysdir, '/'))) {
+    Error("Failed to find whole disk device for %s\n", t->name);
+    return CGPT_FAILED;
+  }
+  *slash = '\0';
+
+  if (snprintf(path, sizeof(path), "%s/dev", disk_sysdir) >= sizeof(path) ||
+      !(f = fopen(path, "r")))
+    goto bad;
+  found = fscanf(f, "%u:%u", &maj, &min) == 2;
+  fclose(f);
+  if (!found)
+    goto bad;
+  t->disk_devno = makedev(maj, min);
+
+  found = 0;
+  if (snprintf(path, sizeof(path), "%s/uevent", disk_sysdir) >=
+      sizeof(path) || !(f = fopen(path, "r")))
+    goto bad;
+  while (!found && fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "DEVNAME=", 8))
+      continue;
+    line[strcspn(line, "\n")] = '\0';
+    found = snprintf(t->disk, sizeof(t->disk), "/dev/%s", line + 8) <
+            sizeof(t->disk);
+  }
+  fclose(f);
+  if (found)
+    return CGPT_OK;
+
+bad:
+  Error("Failed to find whole disk device for %s\n", t->name);
+  return CGPT_FAILED;
 }
 
-/* Resize the partition and notify the kernel.
+static int resolve_drive(struct resize_target *t) {
+  struct stat st;
+
+  if (stat(t->name, &st) < 0) {
+    Error("unable to access device %s: %s\n", t->name, strerror(errno));
+    return CGPT_FAILED;
+  }
+  snprintf(t->disk, sizeof(t->disk), "%s", t->name);
+  t->disk_devno = S_ISBLK(st.st_mode) ? st.st_rdev : 0;
+  t->partno = 0;
+  return CGPT_OK;
+}
+
+static int same_disk(const struct resize_target *a,
+                     const struct resize_target *b) {
+  if (a->disk_devno || b->disk_devno)
+    return a->disk_devno == b->disk_devno;
+  return !strcmp(a->disk, b->disk);
+}
+
+/* Grows every partition the targets from first on pick on its disk, in
+ * one open and one write. The kernel is told first, and if it refuses any
+ * of them the ones it already took are shrunk back and nothing is written.
+ * With grow_fs the filesystems of the grown partitions are grown next.
  * returns:
  *   CGPT_OK for resize successful or nothing to do
  *   CGPT_FAILED on error
  */
-static int resize_partition(CgptResizeParams *params, blkid_dev dev) {
-  char *disk_devname;
+static int resize_disk(CgptResizeParams *params,
+                       struct resize_target *targets, int num_targets,
+                       int first) {
   struct drive drive;
+  struct stat st;
   GptHeader *header;
   GptEntry *entry;
-  int gpt_retval, entry_index, entry_count;
-  uint64_t free_bytes, last_free_lba, entry_size_lba;
+  const struct extent_map *map;
+  const struct extent *next;
+  struct grown_fs fs;
+  uint64_t *old_end = NULL, *new_bytes = NULL;
+  uint8_t *want = NULL;
+  uint64_t free_bytes, last_free_lba;
+  uint32_t entry_count, i, j;
+  int gpt_retval, num_grown = 0, is_blk, r;
+  long long start_ms = NowMs();
 
-  if ((disk_devname = dev_to_wholedevname(dev)) == NULL) {
-    Error("Failed to find whole disk device for %s\n", blkid_dev_devname(dev));
+  if (DriveOpen(targets[first].disk, &drive, 0, O_RDWR) != CGPT_OK)
     return CGPT_FAILED;
-  }
-
-  if (DriveOpen(disk_devname, &drive, 0, O_RDWR) != CGPT_OK) {
-    free(disk_devname);
-    return CGPT_FAILED;
-  }
-
-  free(disk_devname);
 
   if (CGPT_OK != ReadPMBR(&drive)) {
     Error("Unable to read PMBR\n");
@@ -90,41 +171,72 @@ static int resize_partition(CgptResizeParams *params, blkid_dev dev) {
   }
 
   header = (GptHeader*)drive.gpt.primary_header;
-  last_free_lba = header->last_usable_lba;
   entry_count = GetNumberOfEntries(&drive);
-  entry_index = dev_to_partno(dev) - 1;
-  if (entry_index < 0 || entry_index >= entry_count) {
-    Error("Kernel and GPT disagree on the number of partitions!\n");
+  want = calloc(entry_count, sizeof(*want));
+  old_end = calloc(entry_count, sizeof(*old_end));
+  new_bytes = calloc(entry_count, sizeof(*new_bytes));
+  if (!want || !old_end || !new_bytes) {
+    Error("Out of memory\n");
     goto nope;
   }
-  entry = GetEntry(&drive.gpt, PRIMARY, entry_index);
 
-  // Scan entire table to determine if entry can grow.
-  for (int i = 0; i < entry_count; i++) {
-    GptEntry *other = GetEntry(&drive.gpt, PRIMARY, i);
+  // Pick up every target on this disk.
+  for (i = first; i < num_targets; i++) {
+    struct resize_target *t = &targets[i];
 
-    if (GuidIsZero(&other->type))
+    if (!same_disk(t, &targets[first]))
+      continue;
+    if (!t->partno) {
+      for (j = 0; j < entry_count; j++)
+        if (GuidEqual(&guid_coreos_resize,
+                      &GetEntry(&drive.gpt, PRIMARY, j)->type))
+          want[j] = 1;
       continue;
+    }
+    if (t->partno > entry_count || IsUnused(&drive, PRIMARY, t->partno - 1)) {
+      Error("Kernel and GPT disagree on the number of partitions!\n");
+      goto nope;
+    }
+    want[t->partno - 1] = 1;
+  }
 
-    if (other->starting_lba > entry->ending_lba &&
-        other->starting_lba - 1 < last_free_lba) {
-      last_free_lba = other->starting_lba - 1;
+  for (i = 0; i < entry_count; i++) {
+    if (!want[i])
+      continue;
+    entry = GetEntry(&drive.gpt, PRIMARY, i);
+
+    // The entry can grow up to the next partition or the end of the disk.
+    if ((map = GetExtentMap(&drive)) == NULL)
+      goto nope;
+    last_free_lba = header->last_usable_lba;
+    next = NextUsedExtent(map, entry->ending_lba, i);
+    if (next && next->start - 1 < last_free_lba)
+      last_free_lba = next->start - 1;
+
+    // Leave it alone if the size is too small
+    free_bytes = (last_free_lba - entry->ending_lba) * drive.gpt.sector_bytes;
+    if (entry->ending_lba >= last_free_lba ||
+        free_bytes < params->min_resize_bytes) {
+      want[i] = 0;
+      continue;
     }
+
+    old_end[i] = entry->ending_lba;
+    entry->ending_lba = last_free_lba;
+    new_bytes[i] = (entry->ending_lba - entry->starting_lba + 1) *
+                   drive.gpt.sector_bytes;
+    DropExtentMap(&drive);
+    num_grown++;
   }
 
-  // Exit without doing anything if the size is too small
-  free_bytes = (last_free_lba - entry->ending_lba) * drive.gpt.sector_bytes;
-  if (entry->ending_lba >= last_free_lba ||
-      free_bytes < params->min_resize_bytes) {
-    if (DriveClose(&drive, 0) != CGPT_OK)
-      return CGPT_FAILED;
-    else
-      return CGPT_OK;
+  if (!num_grown) {
+    free(want);
+    free(old_end);
+    free(new_bytes);
+    return DriveClose(&drive, 0);
   }
 
   // Update and test partition table in memory
-  entry->ending_lba = last_free_lba;
-  entry_size_lba = entry->ending_lba - entry->starting_lba + 1;
   UpdateAllEntries(&drive);
   gpt_retval = CheckEntries((GptEntry*)drive.gpt.primary_entries,
                             (GptHeader*)drive.gpt.primary_header);
@@ -134,53 +246,131 @@ static int resize_partition(CgptResizeParams *params, blkid_dev dev) {
     goto nope;
   }
 
-  // Notify kernel of new partition size via an ioctl.
-  if (blkpg_resize_partition(drive.fd, dev_to_partno(dev),
-                             entry->starting_lba * drive.gpt.sector_bytes,
-                             entry_size_lba * drive.gpt.sector_bytes) < 0) {
-    Error("Failed to notify kernel of new partition size: %s\n"
-          "Leaving existing partition table in place.\n", strerror(errno));
-    goto nope;
+  // Notify kernel of new partition sizes via an ioctl.
+  is_blk = fstat(drive.fd, &st) == 0 && S_ISBLK(st.st_mode);
+  for (i = 0; is_blk && i < entry_count; i++) {
+    if (!want[i])
+      continue;
+    entry = GetEntry(&drive.gpt, PRIMARY, i);
+    if (BlkpgPartition(drive.fd, BLKPG_RESIZE_PARTITION, i + 1,
+                       entry->starting_lba * drive.gpt.sector_bytes,
+                       new_bytes[i]) < 0) {
+      Error("Failed to notify kernel of new size of partition %u: %s\n"
+            "Leaving existing partition table in place.\n",
+            i + 1, strerror(errno));
+      while (i-- > 0) {
+        if (!want[i])
+          continue;
+        entry = GetEntry(&drive.gpt, PRIMARY, i);
+        (void) BlkpgPartition(drive.fd, BLKPG_RESIZE_PARTITION, i + 1,
+                              entry->starting_lba * drive.gpt.sector_bytes,
+                              (old_end[i] - entry->starting_lba + 1) *
+                              drive.gpt.sector_bytes);
+      }
+      goto nope;
+    }
   }
 
   UpdatePMBR(&drive, PRIMARY);
-  if (WritePMBR(&drive) != CGPT_OK) {
-    Error("Failed to write legacy MBR.\n");
-    goto nope;
-  }
+  drive.pmbr_modified = 1;
 
   // Whew! we made it! Flush to disk.
-  return DriveClose(&drive, 1);
+  free(want);
+  free(old_end);
+  if (CGPT_OK != DriveClose(&drive, 1)) {
+    free(new_bytes);
+    return CGPT_FAILED;
+  }
+  if (params->grow_fs)
+    printf("%s: grew %d partition%s in %lld ms\n", targets[first].disk,
+           num_grown, num_grown == 1 ? "" : "s", NowMs() - start_ms);
+
+  r = CGPT_OK;
+  for (i = 0; params->grow_fs && i < entry_count; i++) {
+    if (!new_bytes[i])
+      continue;
+    start_ms = NowMs();
+    switch (GrowFilesystem(targets[first].disk_devno, i + 1, new_bytes[i],
+                           &fs)) {
+    case CGPT_OK:
+      printf("%s: grew %s on %s to %llu blocks in %lld ms\n", fs.node,
+             fs.type, fs.mountpoint, (unsigned long long)fs.blocks,
+             NowMs() - start_ms);
+      break;
+    case CGPT_NOOP:
+      printf("%s: %s on %s already fills the partition\n", fs.node,
+             fs.type, fs.mountpoint);
+      break;
+    default:
+      r = CGPT_FAILED;
+    }
+  }
+  free(new_bytes);
+  return r;
 
 nope:
+  free(want);
+  free(old_end);
+  free(new_bytes);
   DriveClose(&drive, 0);
   return CGPT_FAILED;
 }
 
-/* Search for a partition to resize and expand it if possible.
- * Both the partition table and the filesytem will be updated.
+/* Grow the given partitions, or all coreos-resize partitions of the given
+ * drives, as far as the free space after them allows. Each disk is opened
+ * and written once however many of its partitions are named.
  */
 int CgptResize(CgptResizeParams *params) {
-  blkid_cache cache = NULL;
-  blkid_dev found_dev = NULL;
-  int err = CGPT_FAILED;
+  struct resize_target *targets;
+  int num_targets, i, n = 0;
+  int err = CGPT_OK;
+  long long start_ms = NowMs();
 
-  if (params == NULL || params->partition_desc == NULL)
+  if (params == NULL)
     return CGPT_FAILED;
 
-  if (blkid_get_cache(&cache, NULL) < 0)
-    goto exit;
-
-  found_dev = blkid_get_dev(cache, params->partition_desc, BLKID_DEV_NORMAL);
+  num_targets = params->num_targets + (params->partition_desc ? 1 : 0);
+  if (!num_targets) {
+    Error("nothing to resize\n");
+    return CGPT_FAILED;
+  }
+  if (!(targets = calloc(num_targets, sizeof(*targets)))) {
+    Error("Out of memory\n");
+    return CGPT_FAILED;
+  }
+  if (params->partition_desc)
+    targets[n++].name = params->partition_desc;
+  for (i = 0; i < params->num_targets; i++)
+    targets[n++].name = params->targets[i];
 
-  if (!found_dev) {
-    Error("device not found %s\n", params->partition_desc);
-    goto exit;
+  for (i = 0; i < num_targets; i++) {
+    if (CGPT_OK != (params->all_resize ? resolve_drive(&targets[i])
+                                       : resolve_partition(&targets[i]))) {
+      free(targets);
+      return CGPT_FAILED;
+    }
+    // Only the kernel can tell a mounted filesystem to grow.
+    if (params->grow_fs && !targets[i].disk_devno) {
+      Error("%s is not a block device, can't grow its filesystems\n",
+            targets[i].name);
+      free(targets);
+      return CGPT_FAILED;
+    }
   }
+  if (params->grow_fs)
+    printf("Found the disks of %d target%s in %lld ms\n", num_targets,
+           num_targets == 1 ? "" : "s", NowMs() - start_ms);
 
-  err = resize_partition(params, found_dev);
+  for (i = 0; i < num_targets; i++) {
+    if (targets[i].done)
+      continue;
+    if (CGPT_OK != resize_disk(params, targets, num_targets, i))
+      err = CGPT_FAILED;
+    for (n = i; n < num_targets; n++)
+      if (same_disk(&targets[n], &targets[i]))
+        targets[n].done = 1;
+  }
 
-exit:
-  blkid_put_cache(cache);
+  free(targets);
   return err;
 }
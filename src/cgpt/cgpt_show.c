@@ -10,6 +10,8 @@
 #include "cgpt.h"
 #include "cgptlib_internal.h"
 #include "crc32.h"
+#include "entry_class.h"
+#include "extent_map.h"
 #include "vboot_host.h"
 
 /* Generate output like:
@@ -155,17 +157,13 @@ void EntryDetails(GptEntry *entry, uint32_t index, int raw) {
 
 
 void EntriesDetails(struct drive *drive, const int secondary, int raw) {
-  uint32_t i;
-
-  for (i = 0; i < GetNumberOfEntries(drive); ++i) {
-    GptEntry *entry;
-    entry = GetEntry(&drive->gpt, secondary, i);
-
-    if (GuidIsZero(&entry->type))
-      continue;
+  struct entry_classes cls;
+  int i;
 
-    EntryDetails(entry, i, raw);
-  }
+  ClassifyEntries(drive, secondary, &cls);
+  for (i = NextEntry(cls.used, cls.num_entries, -1); i >= 0;
+       i = NextEntry(cls.used, cls.num_entries, i))
+    EntryDetails(GetEntry(&drive->gpt, secondary, i), i, raw);
 }
 
 int CgptGetNumNonEmptyPartitions(CgptShowParams *params) {
@@ -186,16 +184,9 @@ int CgptGetNumNonEmptyPartitions(CgptShowParams *params) {
     goto done;
   }
 
-  params->num_partitions = 0;
-  int numEntries = GetNumberOfEntries(&drive);
-  int i;
-  for(i = 0; i < numEntries; i++) {
-      GptEntry *entry = GetEntry(&drive.gpt, ANY_VALID, i);
-      if (GuidIsZero(&entry->type))
-        continue;
-
-      params->num_partitions++;
-  }
+  struct entry_classes cls;
+  ClassifyEntries(&drive, ANY_VALID, &cls);
+  params->num_partitions = CountEntries(cls.used);
 
   retval = CGPT_OK;
 
@@ -217,13 +208,41 @@ int CgptShow(CgptShowParams *params) {
   if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
     Error("GptSanityCheck() returned %d: %s\n",
           gpt_retval, GptError(gpt_retval));
+    DriveClose(&drive, 0);
     return CGPT_FAILED;
   }
 
-  if (params->partition) {                      // show single partition
+  if (params->free_space) {                     // show free space
+    const struct extent_map *map;
+    uint32_t i;
+
+    if (!(drive.gpt.valid_headers & MASK_PRIMARY) ||
+        !(drive.gpt.valid_entries & MASK_PRIMARY)) {
+      Error("the primary GPT is invalid, please run 'cgpt repair'\n");
+      DriveClose(&drive, 0);
+      return CGPT_FAILED;
+    }
+    if (!(map = GetExtentMap(&drive))) {
+      DriveClose(&drive, 0);
+      return CGPT_FAILED;
+    }
+
+    if (!params->quick)
+      printf(TITLE_FMT, "start", "size", "", "contents");
+    for (i = 0; i < map->num_free; i++) {
+      const struct extent *f = &map->free[i];
+
+      if (params->quick)
+        printf("%" PRIu64 " %" PRIu64 "\n", f->start, f->end - f->start + 1);
+      else
+        printf(GPT_FMT, f->start, f->end - f->start + 1, "", "Free space");
+    }
+
+  } else if (params->partition) {               // show single partition
 
     if (params->partition > GetNumberOfEntries(&drive)) {
       Error("invalid partition number: %d\n", params->partition);
+      DriveClose(&drive, 0);
       return CGPT_FAILED;
     }
 
@@ -271,16 +290,16 @@ int CgptShow(CgptShowParams *params) {
     }
 
   } else if (params->quick) {                   // show all partitions, quickly
-    uint32_t i;
+    struct entry_classes cls;
+    int i;
     GptEntry *entry;
     char type[GUID_STRLEN];
 
-    for (i = 0; i < GetNumberOfEntries(&drive); ++i) {
+    ClassifyEntries(&drive, ANY_VALID, &cls);
+    for (i = NextEntry(cls.used, cls.num_entries, -1); i >= 0;
+         i = NextEntry(cls.used, cls.num_entries, i)) {
       entry = GetEntry(&drive.gpt, ANY_VALID, i);
 
-      if (GuidIsZero(&entry->type))
-        continue;
-
       if (!params->numeric && CGPT_OK == ResolveType(&entry->type, type, GUID_STRLEN)) {
       } else {
         GuidToStr(&entry->type, type, GUID_STRLEN);
@@ -291,9 +310,12 @@ int CgptShow(CgptShowParams *params) {
     }
   } else {                              // show all partitions
     GptEntry *entries;
+    uint64_t entries_lba;
+    uint32_t entries_sectors;
 
     if (CGPT_OK != ReadPMBR(&drive)) {
       Error("Unable to read PMBR\n");
+      DriveClose(&drive, 0);
       return CGPT_FAILED;
     }
 
@@ -321,8 +343,8 @@ int CgptShow(CgptShowParams *params) {
       HeaderDetails(header, entries, indent, params->numeric);
     }
 
-    printf(GPT_FMT, (uint64_t)(GPT_PMBR_SECTOR + GPT_HEADER_SECTOR),
-           (uint64_t)GPT_ENTRIES_SECTORS,
+    GetEntriesLocation(&drive.gpt, PRIMARY, &entries_lba, &entries_sectors);
+    printf(GPT_FMT, entries_lba, (uint64_t)entries_sectors,
            drive.gpt.valid_entries & MASK_PRIMARY ? "" : "INVALID",
            "Pri GPT table");
 
@@ -331,9 +353,8 @@ int CgptShow(CgptShowParams *params) {
       EntriesDetails(&drive, PRIMARY, params->numeric);
 
     /****************************** Secondary *************************/
-    printf(GPT_FMT, (drive.gpt.drive_sectors - GPT_HEADER_SECTOR -
-                          GPT_ENTRIES_SECTORS),
-           (uint64_t)GPT_ENTRIES_SECTORS,
+    GetEntriesLocation(&drive.gpt, SECONDARY, &entries_lba, &entries_sectors);
+    printf(GPT_FMT, entries_lba, (uint64_t)entries_sectors,
            drive.gpt.valid_entries & MASK_SECONDARY ? "" : "INVALID",
            "Sec GPT table");
     /* We show secondary table details if any of following is true.
@@ -345,7 +366,7 @@ int CgptShow(CgptShowParams *params) {
         ((drive.gpt.valid_entries & MASK_SECONDARY) &&
          (!(drive.gpt.valid_entries & MASK_PRIMARY) ||
           memcmp(drive.gpt.primary_entries, drive.gpt.secondary_entries,
-                 TOTAL_ENTRIES_SIZE)))) {
+                 MAX_ENTRIES_SIZE)))) {
       EntriesDetails(&drive, SECONDARY, params->numeric);
     }
 
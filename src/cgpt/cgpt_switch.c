@@ -0,0 +1,82 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "vboot_host.h"
+
+// Flips the A/B roots in one go: the attributes of the target and the
+// ranking of every other root change in memory, the result is checked, and
+// only then does DriveClose write both tables and fsync once. A failure at
+// any step leaves the disk as it was.
+int CgptSwitch(CgptSwitchParams *params) {
+  struct drive drive;
+  CgptPrioritizeParams prio;
+  uint32_t index;
+  int gpt_retval;
+
+  if (params == NULL)
+    return CGPT_FAILED;
+
+  if (!params->partition) {
+    Error("no partition to switch to\n");
+    return CGPT_FAILED;
+  }
+
+  if ((params->set_tries &&
+       (params->tries < 0 || params->tries > CGPT_ATTRIBUTE_MAX_TRIES)) ||
+      (params->set_successful &&
+       (params->successful < 0 ||
+        params->successful > CGPT_ATTRIBUTE_MAX_SUCCESSFUL))) {
+    Error("attribute value out of range\n");
+    return CGPT_FAILED;
+  }
+
+  if (CGPT_OK != DriveOpen(params->drive_name, &drive, 0, O_RDWR))
+    return CGPT_FAILED;
+
+  if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
+    Error("GptSanityCheck() returned %d: %s\n",
+          gpt_retval, GptError(gpt_retval));
+    goto bad;
+  }
+
+  memset(&prio, 0, sizeof(prio));
+  prio.set_partition = params->partition;
+  prio.max_priority = params->priority;
+  if (CGPT_OK != PrioritizeRoots(&drive, &prio))
+    goto bad;
+
+  index = params->partition - 1;
+  if (params->set_tries)
+    SetTries(&drive, PRIMARY, index, params->tries);
+  if (params->set_successful)
+    SetSuccessful(&drive, PRIMARY, index, params->successful);
+  if (!GetSuccessful(&drive, PRIMARY, index) &&
+      !GetTries(&drive, PRIMARY, index)) {
+    Error("partition %d has neither tries left nor the successful flag, "
+          "it would never boot\n", params->partition);
+    goto bad;
+  }
+
+  UpdateAllEntries(&drive);
+
+  // Both copies were just rebuilt from the primary; make sure what we are
+  // about to write is a table the firmware will accept.
+  gpt_retval = GptSanityCheck(&drive.gpt);
+  if (GPT_SUCCESS != gpt_retval || MASK_BOTH != drive.gpt.valid_headers ||
+      MASK_BOTH != drive.gpt.valid_entries) {
+    Error("switched table failed validation, nothing written: %s\n",
+          GptError(gpt_retval));
+    goto bad;
+  }
+
+  return DriveClose(&drive, 1);
+
+bad:
+  (void) DriveClose(&drive, 0);
+  return CGPT_FAILED;
+}
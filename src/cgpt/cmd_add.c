@@ -15,8 +15,13 @@ static void Usage(void)
          "Add, edit, or remove a partition entry.\n\n"
          "Options:\n"
          "  -i NUM       Specify partition (default is next available)\n"
-         "  -b NUM       Beginning sector\n"
-         "  -s NUM       Size in sectors\n"
+         "  -b NUM       Beginning sector (default is free space picked\n"
+         "               by -f, aligned to the device's I/O size)\n"
+         "  -s NUM       Size in sectors, N%% of the usable space, or\n"
+         "               \"rest\" for all of the free space found\n"
+         "  -f POLICY    Free space to use without -b: first (default),\n"
+         "               best (smallest that fits) or largest\n"
+         "  -a BYTES     Alignment for -f and for -s N%% and rest\n"
          "  -t GUID      Partition Type GUID\n"
          "  -u GUID      Partition Unique ID\n"
          "  -l LABEL     Label\n"
@@ -25,30 +30,31 @@ static void Usage(void)
          "  -T NUM       set Tries flag (0-15)\n"
          "  -P NUM       set Priority flag (0-15)\n"
          "  -A NUM       set raw 64-bit attribute value\n"
+         "  -w SECS      Wait up to SECS for a new partition's device node\n"
+         "               to be set up by udev, or the kernel without it\n"
+         "  -D           Discard the sectors the partition gives up or\n"
+         "               takes over, e.g. all of a new or removed one;\n"
+         "               image files get holes punched instead\n"
          "\n"
          "Use the -i option to modify an existing partition.\n"
-         "The -b, -s, and -t options must be given for new partitions.\n"
+         "The -s and -t options must be given for new partitions.\n"
          "\n", progname);
   PrintTypes();
 }
 
-int cmd_add(int argc, char *argv[]) {
-
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
+int ParseAddArgs(int argc, char *argv[], CgptAddParams *params) {
   int c;
   int errorcnt = 0;
-  int r = CGPT_FAILED;
   char *e = 0;
 
+  memset(params, 0, sizeof(*params));
   opterr = 0;                     // quiet, you
-  while ((c=getopt(argc, argv, ":hi:b:s:t:u:l:B:S:T:P:A:")) != -1)
+  while ((c=getopt(argc, argv, ":hi:b:s:t:u:l:B:S:T:P:A:f:a:w:D")) != -1)
   {
     switch (c)
     {
     case 'i':
-      params.partition = (uint32_t)strtoul(optarg, &e, 0);
+      params->partition = (uint32_t)strtoul(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
@@ -56,8 +62,8 @@ int cmd_add(int argc, char *argv[]) {
       }
       break;
     case 'b':
-      params.set_begin = 1;
-      params.begin = strtoull(optarg, &e, 0);
+      params->set_begin = 1;
+      params->begin = strtoull(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
@@ -65,88 +71,132 @@ int cmd_add(int argc, char *argv[]) {
       }
       break;
     case 's':
-      params.set_size = 1;
-      params.size = strtoull(optarg, &e, 0);
+      params->set_size = 1;
+      if (!strcmp(optarg, "rest")) {
+        params->size_rest = 1;
+        break;
+      }
+      params->size = strtoull(optarg, &e, 0);
+      if (*optarg && e && !strcmp(e, "%")) {
+        params->size_percent = params->size;
+        params->size = 0;
+        if (params->size_percent < 1 || params->size_percent > 100) {
+          Error("value for -%c must be between 1%% and 100%%\n", c);
+          errorcnt++;
+        }
+        break;
+      }
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
         errorcnt++;
       }
       break;
+    case 'f':
+      if (!strcmp(optarg, "first")) {
+        params->fit = FIT_FIRST;
+      } else if (!strcmp(optarg, "best")) {
+        params->fit = FIT_BEST;
+      } else if (!strcmp(optarg, "largest")) {
+        params->fit = FIT_LARGEST;
+      } else {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+    case 'a':
+      params->align_bytes = strtoull(optarg, &e, 0);
+      if (!*optarg || (e && *e) || !params->align_bytes)
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
     case 't':
-      params.set_type = 1;
-      if (CGPT_OK != SupportedType(optarg, &params.type_guid) &&
-          CGPT_OK != StrToGuid(optarg, &params.type_guid)) {
+      params->set_type = 1;
+      if (CGPT_OK != SupportedType(optarg, &params->type_guid) &&
+          CGPT_OK != StrToGuid(optarg, &params->type_guid)) {
         Error("invalid argument to -%c: %s\n", c, optarg);
         errorcnt++;
       }
       break;
     case 'u':
-      params.set_unique = 1;
-      if (CGPT_OK != StrToGuid(optarg, &params.unique_guid)) {
+      params->set_unique = 1;
+      if (CGPT_OK != StrToGuid(optarg, &params->unique_guid)) {
         Error("invalid argument to -%c: %s\n", c, optarg);
         errorcnt++;
       }
       break;
     case 'l':
-      params.label = optarg;
+      params->label = optarg;
+      break;
+    case 'w':
+      params->wait_seconds = (int)strtol(optarg, &e, 0);
+      if (!*optarg || (e && *e) || params->wait_seconds < 1)
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+    case 'D':
+      params->discard = 1;
       break;
     case 'B':
-      params.set_legacy_bootable = 1;
-      params.legacy_bootable = strtoul(optarg, &e, 0);
+      params->set_legacy_bootable = 1;
+      params->legacy_bootable = strtoul(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
         errorcnt++;
       }
-      if (params.legacy_bootable < 0 || params.legacy_bootable > 1) {
+      if (params->legacy_bootable < 0 || params->legacy_bootable > 1) {
         Error("value for -%c must be between 0 and 1", c);
         errorcnt++;
       }
       break;
     case 'S':
-      params.set_successful = 1;
-      params.successful = (uint32_t)strtoul(optarg, &e, 0);
+      params->set_successful = 1;
+      params->successful = (uint32_t)strtoul(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
         errorcnt++;
       }
-      if (params.successful < 0 || params.successful > 1) {
+      if (params->successful < 0 || params->successful > 1) {
         Error("value for -%c must be between 0 and 1", c);
         errorcnt++;
       }
       break;
     case 'T':
-      params.set_tries = 1;
-      params.tries = (uint32_t)strtoul(optarg, &e, 0);
+      params->set_tries = 1;
+      params->tries = (uint32_t)strtoul(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         fprintf(stderr, "%s: invalid argument to -%c: \"%s\"\n",
                 progname, c, optarg);
         errorcnt++;
       }
-      if (params.tries < 0 || params.tries > 15) {
+      if (params->tries < 0 || params->tries > 15) {
         Error("value for -%c must be between 0 and 15", c);
         errorcnt++;
       }
       break;
     case 'P':
-      params.set_priority = 1;
-      params.priority = (uint32_t)strtoul(optarg, &e, 0);
+      params->set_priority = 1;
+      params->priority = (uint32_t)strtoul(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
         errorcnt++;
       }
-      if (params.priority < 0 || params.priority > 15) {
+      if (params->priority < 0 || params->priority > 15) {
         Error("value for -%c must be between 0 and 15", c);
         errorcnt++;
       }
       break;
     case 'A':
-      params.set_raw = 1;
-      params.raw_value = strtoull(optarg, &e, 0);
+      params->set_raw = 1;
+      params->raw_value = strtoull(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
@@ -156,7 +206,7 @@ int cmd_add(int argc, char *argv[]) {
 
     case 'h':
       Usage();
-      return CGPT_OK;
+      return CGPT_NOOP;
     case '?':
       Error("unrecognized option: -%c\n", optopt);
       errorcnt++;
@@ -176,6 +226,17 @@ int cmd_add(int argc, char *argv[]) {
     return CGPT_FAILED;
   }
 
+  return CGPT_OK;
+}
+
+int cmd_add(int argc, char *argv[]) {
+  CgptAddParams params;
+  int r;
+
+  r = ParseAddArgs(argc, argv, &params);
+  if (r != CGPT_OK)
+    return r == CGPT_NOOP ? CGPT_OK : r;
+
   if (optind >= argc)
   {
     Error("missing drive argument\n");
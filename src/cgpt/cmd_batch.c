@@ -0,0 +1,95 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "vboot_host.h"
+
+static void Usage(void)
+{
+  printf("\nUsage: %s batch [OPTIONS] DRIVE\n\n"
+         "Apply a script of create, add, boot, prioritize and legacy\n"
+         "operations to DRIVE, opening it once and writing the table once.\n"
+         "Each line is one operation with the options of that command and\n"
+         "no drive argument, for example:\n\n"
+         "    create -c -s 8388608\n"
+         "    add -t efi -b 4096 -s 262144 -l EFI-SYSTEM -B 1\n"
+         "    add -t coreos-usr -s 2097152 -l \"USR-A\" -P 1 -S 1\n"
+         "    boot -p -i 1\n\n"
+         "Only a create on the first line may use -c, -s or --sector-size.\n"
+         "Blank lines and lines starting with # are skipped. If any line\n"
+         "fails, or the final table isn't valid, nothing is written.\n\n"
+         "Options:\n"
+         "  -f FILE      Read the script from FILE instead of stdin\n"
+         "  -w SECS      Wait up to SECS for the device nodes of new\n"
+         "               partitions, as with add -w\n"
+         "  -D           Discard the sectors that change partition between\n"
+         "               the old and the final table, as with add -D\n"
+         "\n", progname);
+}
+
+int cmd_batch(int argc, char *argv[]) {
+  CgptBatchParams params;
+  memset(&params, 0, sizeof(params));
+
+  int c;
+  int errorcnt = 0;
+  char *e = 0;
+
+  opterr = 0;                     // quiet, you
+  while ((c=getopt(argc, argv, ":hf:w:D")) != -1)
+  {
+    switch (c)
+    {
+    case 'f':
+      params.script = optarg;
+      break;
+    case 'w':
+      params.wait_seconds = (int)strtol(optarg, &e, 0);
+      if (!*optarg || (e && *e) || params.wait_seconds < 1)
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+
+    case 'D':
+      params.discard = 1;
+      break;
+
+    case 'h':
+      Usage();
+      return CGPT_OK;
+    case '?':
+      Error("unrecognized option: -%c\n", optopt);
+      errorcnt++;
+      break;
+    case ':':
+      Error("missing argument to -%c\n", optopt);
+      errorcnt++;
+      break;
+    default:
+      errorcnt++;
+      break;
+    }
+  }
+  if (errorcnt)
+  {
+    Usage();
+    return CGPT_FAILED;
+  }
+
+  if (optind >= argc) {
+    Error("missing drive argument\n");
+    return CGPT_FAILED;
+  }
+
+  params.drive_name = argv[optind];
+
+  return CgptBatch(&params);
+}
@@ -23,22 +23,19 @@ static void Usage(void)
 }
 
 
-int cmd_boot(int argc, char *argv[]) {
-  CgptBootParams params;
-  memset(&params, 0, sizeof(params));
-
-
+int ParseBootArgs(int argc, char *argv[], CgptBootParams *params) {
   int c;
   int errorcnt = 0;
   char *e = 0;
 
+  memset(params, 0, sizeof(*params));
   opterr = 0;                     // quiet, you
   while ((c=getopt(argc, argv, ":hi:b:p")) != -1)
   {
     switch (c)
     {
     case 'i':
-      params.partition = (uint32_t)strtoul(optarg, &e, 0);
+      params->partition = (uint32_t)strtoul(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
@@ -46,15 +43,15 @@ int cmd_boot(int argc, char *argv[]) {
       }
       break;
     case 'b':
-      params.bootfile = optarg;
+      params->bootfile = optarg;
       break;
     case 'p':
-      params.create_pmbr = 1;
+      params->create_pmbr = 1;
       break;
 
     case 'h':
       Usage();
-      return CGPT_OK;
+      return CGPT_NOOP;
     case '?':
       Error("unrecognized option: -%c\n", optopt);
       errorcnt++;
@@ -74,6 +71,17 @@ int cmd_boot(int argc, char *argv[]) {
     return CGPT_FAILED;
   }
 
+  return CGPT_OK;
+}
+
+int cmd_boot(int argc, char *argv[]) {
+  CgptBootParams params;
+  int r;
+
+  r = ParseBootArgs(argc, argv, &params);
+  if (r != CGPT_OK)
+    return r == CGPT_NOOP ? CGPT_OK : r;
+
   if (optind >= argc) {
     Error("missing drive argument\n");
     return CGPT_FAILED;
@@ -0,0 +1,116 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "vboot_host.h"
+
+static void Usage(void)
+{
+  printf("\nUsage: %s compose [OPTIONS] IMAGE\n\n"
+         "Build a disk image from a layout and a file for each partition\n"
+         "in one go. The layout is a batch script, for example:\n\n"
+         "    create -c -s 8388608\n"
+         "    add -t efi -b 4096 -s 262144 -l EFI-SYSTEM -B 1\n"
+         "    add -t coreos-usr -s 2097152 -l USR-A\n\n"
+         "The files are copied in once the table is final and before it\n"
+         "is written. Where the image and a file share a filesystem that\n"
+         "supports reflinks, their data is shared instead of copied, and\n"
+         "the kernel copies what it can for image files. Holes are never\n"
+         "written, so a sparse image stays sparse.\n\n"
+         "Options:\n"
+         "  -f FILE      Read the layout from FILE instead of stdin\n"
+         "  -p NUM=FILE  Copy FILE into partition NUM, may be repeated\n"
+         "  -v           Report how much of each file was reflinked,\n"
+         "               copied or left as zeros\n"
+         "\n", progname);
+}
+
+// Parses NUM=FILE into the next payload.
+static int ParsePayload(char *arg, CgptBatchParams *params) {
+  CgptPayload *p;
+  char *e;
+  unsigned long partition = strtoul(arg, &e, 10);
+
+  if (e == arg || *e != '=' || !e[1] || !partition)
+    return CGPT_FAILED;
+
+  p = realloc(params->payloads,
+              (params->num_payloads + 1) * sizeof(*params->payloads));
+  if (!p)
+    return CGPT_FAILED;
+  params->payloads = p;
+  p = &params->payloads[params->num_payloads++];
+  p->partition = partition;
+  p->file = e + 1;
+  return CGPT_OK;
+}
+
+int cmd_compose(int argc, char *argv[]) {
+  CgptBatchParams params;
+  memset(&params, 0, sizeof(params));
+
+  int c;
+  int r;
+  int errorcnt = 0;
+
+  opterr = 0;                     // quiet, you
+  while ((c=getopt(argc, argv, ":hf:p:v")) != -1)
+  {
+    switch (c)
+    {
+    case 'f':
+      params.script = optarg;
+      break;
+    case 'p':
+      if (CGPT_OK != ParsePayload(optarg, &params))
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+    case 'v':
+      params.verbose = 1;
+      break;
+
+    case 'h':
+      Usage();
+      free(params.payloads);
+      return CGPT_OK;
+    case '?':
+      Error("unrecognized option: -%c\n", optopt);
+      errorcnt++;
+      break;
+    case ':':
+      Error("missing argument to -%c\n", optopt);
+      errorcnt++;
+      break;
+    default:
+      errorcnt++;
+      break;
+    }
+  }
+  if (errorcnt)
+  {
+    Usage();
+    free(params.payloads);
+    return CGPT_FAILED;
+  }
+
+  if (optind >= argc) {
+    Error("missing image argument\n");
+    free(params.payloads);
+    return CGPT_FAILED;
+  }
+
+  params.drive_name = argv[optind];
+
+  r = CgptBatch(&params);
+  free(params.payloads);
+  return r;
+}
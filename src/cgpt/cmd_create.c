@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "cgpt.h"
+#include "cgptlib_internal.h"
 #include "vboot_host.h"
 
 static void Usage(void)
@@ -16,43 +17,78 @@ static void Usage(void)
          "  -c           Create disk image file if needed. Requires -s\n"
          "  -s NUM       Minimum disk sectors, extends image files\n"
          "  -z           Zero the sectors of the GPT table and entries\n"
+         "  -D           Discard the partitions of the old table; image\n"
+         "               files get holes punched instead\n"
          "  -g GUID      The desired disk GUID\n"
+         "  -a, --align BYTES\n"
+         "               Start and end the usable space on multiples of\n"
+         "               BYTES (default: the device's physical block, I/O\n"
+         "               and discard sizes; none for image files)\n"
+         "  --sector-size BYTES\n"
+         "               Logical sector size of an image file, one of\n"
+         "               512, 1024, 2048 or 4096 (default: 512, or the\n"
+         "               size an existing GPT was written with)\n"
          "\n", progname);
 }
 
-int cmd_create(int argc, char *argv[]) {
-  CgptCreateParams params;
-  memset(&params, 0, sizeof(params));
+static const struct option long_options[] = {
+  {"align", required_argument, NULL, 'a'},
+  {"sector-size", required_argument, NULL, 'S'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
 
+int ParseCreateArgs(int argc, char *argv[], CgptCreateParams *params) {
   int c;
   int errorcnt = 0;
   char *e = 0;
 
+  memset(params, 0, sizeof(*params));
   opterr = 0;                     // quiet, you
-  while ((c=getopt(argc, argv, ":hcs:zg:")) != -1)
+  while ((c=getopt_long(argc, argv, ":hcs:zg:a:D", long_options, NULL)) != -1)
   {
     switch (c)
     {
     case 'z':
-      params.zap = 1;
+      params->zap = 1;
+      break;
+    case 'D':
+      params->discard = 1;
       break;
     case 'c':
-      params.create = 1;
+      params->create = 1;
       break;
     case 's':
-      params.min_size = strtoull(optarg, &e, 0);
+      params->min_size = strtoull(optarg, &e, 0);
       if (!*optarg || (e && *e)) {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
         errorcnt++;
       }
       break;
     case 'g':
-      params.drive_guid = optarg;
+      params->drive_guid = optarg;
+      break;
+    case 'a':
+      params->align_bytes = strtoull(optarg, &e, 0);
+      if (!*optarg || (e && *e) || !params->align_bytes) {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+    case 'S':
+      params->sector_bytes = (uint32_t)strtoul(optarg, &e, 0);
+      if (!*optarg || (e && *e) ||
+          params->sector_bytes < MIN_SECTOR_BYTES ||
+          params->sector_bytes > MAX_SECTOR_BYTES ||
+          (params->sector_bytes & (params->sector_bytes - 1))) {
+        Error("invalid argument to --sector-size: \"%s\"\n", optarg);
+        errorcnt++;
+      }
       break;
 
     case 'h':
       Usage();
-      return CGPT_OK;
+      return CGPT_NOOP;
     case '?':
       Error("unrecognized option: -%c\n", optopt);
       errorcnt++;
@@ -66,7 +102,7 @@ int cmd_create(int argc, char *argv[]) {
       break;
     }
   }
-  if (params.create && !params.min_size) {
+  if (params->create && !params->min_size) {
     Error("minimum size (-s) is required with create (-c)\n");
     errorcnt++;
   }
@@ -76,6 +112,17 @@ int cmd_create(int argc, char *argv[]) {
     return CGPT_FAILED;
   }
 
+  return CGPT_OK;
+}
+
+int cmd_create(int argc, char *argv[]) {
+  CgptCreateParams params;
+  int r;
+
+  r = ParseCreateArgs(argc, argv, &params);
+  if (r != CGPT_OK)
+    return r == CGPT_NOOP ? CGPT_OK : r;
+
   if (optind >= argc) {
     Usage();
     return CGPT_FAILED;
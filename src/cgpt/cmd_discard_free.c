@@ -0,0 +1,69 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <getopt.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "vboot_host.h"
+
+static void Usage(void)
+{
+  printf("\nUsage: %s discard-free [OPTIONS] DRIVE\n\n"
+         "Discard every unallocated extent of the usable space, with\n"
+         "BLKDISCARD or BLKZEROOUT on block devices and by punching holes\n"
+         "in image files.\n\n"
+         "Options:\n"
+         "  -v           List the extents as \"START SIZE\" lines\n"
+         "\n", progname);
+}
+
+int cmd_discard_free(int argc, char *argv[]) {
+  CgptDiscardFreeParams params;
+  memset(&params, 0, sizeof(params));
+
+  int c;
+  int errorcnt = 0;
+
+  opterr = 0;                     // quiet, you
+  while ((c=getopt(argc, argv, ":hv")) != -1)
+  {
+    switch (c)
+    {
+    case 'v':
+      params.verbose = 1;
+      break;
+
+    case 'h':
+      Usage();
+      return CGPT_OK;
+    case '?':
+      Error("unrecognized option: -%c\n", optopt);
+      errorcnt++;
+      break;
+    case ':':
+      Error("missing argument to -%c\n", optopt);
+      errorcnt++;
+      break;
+    default:
+      errorcnt++;
+      break;
+    }
+  }
+  if (errorcnt)
+  {
+    Usage();
+    return CGPT_FAILED;
+  }
+
+  if (optind >= argc)
+  {
+    Error("missing drive argument\n");
+    return CGPT_FAILED;
+  }
+
+  params.drive_name = argv[optind];
+
+  return CgptDiscardFree(&params);
+}
@@ -0,0 +1,103 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "vboot_host.h"
+
+static void Usage(void)
+{
+  printf("\nUsage: %s flash [OPTIONS] IMAGE DRIVE\n\n"
+         "Write a disk image to a drive with direct I/O and several writes\n"
+         "in flight, then move the backup GPT to the end of the drive and\n"
+         "update the kernel's partitions. Runs of zeros are zeroed by the\n"
+         "drive instead of written. IMAGE may be - for stdin, for example:\n\n"
+         "    gunzip -c disk.img.gz | %s flash - /dev/sdb\n\n"
+         "Options:\n"
+         "  -j NUM       Number of writes in flight [default 4]\n"
+         "  -b BYTES     Size of each write, a multiple of 4096\n"
+         "               [default 1048576]\n"
+         "  -V           Read back what was written and compare CRCs\n"
+         "  -c FILE      Record progress in FILE, and resume from it if\n"
+         "               it is there; it is removed once all is done\n"
+         "  -v           Report how much was written and how long it took\n"
+         "\n", progname, progname);
+}
+
+int cmd_flash(int argc, char *argv[]) {
+  CgptFlashParams params;
+  memset(&params, 0, sizeof(params));
+
+  int c;
+  int errorcnt = 0;
+  char *e = 0;
+
+  opterr = 0;                     // quiet, you
+  while ((c=getopt(argc, argv, ":hj:b:Vc:v")) != -1)
+  {
+    switch (c)
+    {
+    case 'j':
+      params.jobs = (int)strtol(optarg, &e, 0);
+      if (!*optarg || (e && *e) || params.jobs < 1)
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+    case 'b':
+      params.chunk_bytes = strtoull(optarg, &e, 0);
+      if (!*optarg || (e && *e) || !params.chunk_bytes)
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+    case 'V':
+      params.verify = 1;
+      break;
+    case 'c':
+      params.checkpoint = optarg;
+      break;
+    case 'v':
+      params.verbose = 1;
+      break;
+
+    case 'h':
+      Usage();
+      return CGPT_OK;
+    case '?':
+      Error("unrecognized option: -%c\n", optopt);
+      errorcnt++;
+      break;
+    case ':':
+      Error("missing argument to -%c\n", optopt);
+      errorcnt++;
+      break;
+    default:
+      errorcnt++;
+      break;
+    }
+  }
+  if (errorcnt)
+  {
+    Usage();
+    return CGPT_FAILED;
+  }
+
+  if (optind + 2 != argc)
+  {
+    Error("need an image and a drive argument\n");
+    return CGPT_FAILED;
+  }
+
+  params.image = argv[optind];
+  params.drive_name = argv[optind + 1];
+
+  return CgptFlash(&params);
+}
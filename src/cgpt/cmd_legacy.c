@@ -17,25 +17,23 @@ static void Usage(void)
          "\n", progname);
 }
 
-int cmd_legacy(int argc, char *argv[]) {
-  CgptLegacyParams params;
-  memset(&params, 0, sizeof(params));
-
+int ParseLegacyArgs(int argc, char *argv[], CgptLegacyParams *params) {
   int c;
   int errorcnt = 0;
 
+  memset(params, 0, sizeof(*params));
   opterr = 0;                     // quiet, you
   while ((c=getopt(argc, argv, ":he")) != -1)
   {
     switch (c)
     {
     case 'e':
-      params.efipart = 1;
+      params->efipart = 1;
       break;
 
     case 'h':
       Usage();
-      return CGPT_OK;
+      return CGPT_NOOP;
     case '?':
       Error("unrecognized option: -%c\n", optopt);
       errorcnt++;
@@ -55,6 +53,17 @@ int cmd_legacy(int argc, char *argv[]) {
     return CGPT_FAILED;
   }
 
+  return CGPT_OK;
+}
+
+int cmd_legacy(int argc, char *argv[]) {
+  CgptLegacyParams params;
+  int r;
+
+  r = ParseLegacyArgs(argc, argv, &params);
+  if (r != CGPT_OK)
+    return r == CGPT_NOOP ? CGPT_OK : r;
+
   if (optind >= argc) {
     Usage();
     return CGPT_FAILED;
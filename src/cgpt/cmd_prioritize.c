@@ -33,22 +33,19 @@ static void Usage(void)
          "\n", progname);
 }
 
-int cmd_prioritize(int argc, char *argv[]) {
-  CgptPrioritizeParams params;
-  memset(&params, 0, sizeof(params));
-
+int ParsePrioritizeArgs(int argc, char *argv[], CgptPrioritizeParams *params) {
   int c;
   int errorcnt = 0;
-  int r = CGPT_FAILED;
   char *e = 0;
 
+  memset(params, 0, sizeof(*params));
   opterr = 0;                     // quiet, you
   while ((c=getopt(argc, argv, ":hi:fP:")) != -1)
   {
     switch (c)
     {
     case 'i':
-      params.set_partition = (uint32_t)strtoul(optarg, &e, 0);
+      params->set_partition = (uint32_t)strtoul(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
@@ -56,16 +53,16 @@ int cmd_prioritize(int argc, char *argv[]) {
       }
       break;
     case 'f':
-      params.set_friends = 1;
+      params->set_friends = 1;
       break;
     case 'P':
-      params.max_priority = (int)strtol(optarg, &e, 0);
+      params->max_priority = (int)strtol(optarg, &e, 0);
       if (!*optarg || (e && *e))
       {
         Error("invalid argument to -%c: \"%s\"\n", c, optarg);
         errorcnt++;
       }
-      if (params.max_priority < 1 || params.max_priority > 15) {
+      if (params->max_priority < 1 || params->max_priority > 15) {
         Error("value for -%c must be between 1 and 15\n", c);
         errorcnt++;
       }
@@ -73,7 +70,7 @@ int cmd_prioritize(int argc, char *argv[]) {
 
     case 'h':
       Usage();
-      return CGPT_OK;
+      return CGPT_NOOP;
     case '?':
       Error("unrecognized option: -%c\n", optopt);
       errorcnt++;
@@ -93,12 +90,23 @@ int cmd_prioritize(int argc, char *argv[]) {
     return CGPT_FAILED;
   }
 
-  if (params.set_friends && !params.set_partition) {
+  if (params->set_friends && !params->set_partition) {
     Error("the -f option is only useful with the -i option\n");
     Usage();
     return CGPT_FAILED;
   }
 
+  return CGPT_OK;
+}
+
+int cmd_prioritize(int argc, char *argv[]) {
+  CgptPrioritizeParams params;
+  int r;
+
+  r = ParsePrioritizeArgs(argc, argv, &params);
+  if (r != CGPT_OK)
+    return r == CGPT_NOOP ? CGPT_OK : r;
+
   if (optind >= argc) {
     Error("missing drive argument\n");
     return CGPT_FAILED;
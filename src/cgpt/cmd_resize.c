@@ -12,14 +12,26 @@
 
 static void Usage(void)
 {
-  printf("\nUsage: %s rezise /dev/blk1\n\n"
-	 "Resize the given partition if it has free space to grow into.\n"
+  printf("\nUsage: %s resize [OPTIONS] PARTITION...\n"
+         "       %s resize [OPTIONS] -a DRIVE...\n\n"
+         "Resize the given partitions if they have free space to grow into.\n"
+         "Partitions on the same disk are grown in a single update.\n"
          "The default minimum size to grow by is 2MB.\n\n"
          "Options:\n"
          "  -m NUM       Do nothing unless partition can grow by NUM bytes\n"
-         "\n", progname);
+         "  -a           Grow every coreos-resize partition of the DRIVEs\n"
+         "  --grow-fs    Then grow the mounted ext2/3/4 or xfs filesystems\n"
+         "               of the grown partitions, and report the time\n"
+         "               each step took\n"
+         "\n", progname, progname);
 }
 
+static const struct option long_options[] = {
+  {"grow-fs", no_argument, NULL, 'G'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
 int cmd_resize(int argc, char *argv[]) {
   CgptResizeParams params;
   memset(&params, 0, sizeof(params));
@@ -32,7 +44,7 @@ int cmd_resize(int argc, char *argv[]) {
   char *e = 0;
 
   opterr = 0;                     // quiet, you
-  while ((c=getopt(argc, argv, ":d:m:h")) != -1)
+  while ((c=getopt_long(argc, argv, ":ad:m:h", long_options, NULL)) != -1)
   {
     switch (c)
     {
@@ -45,6 +57,14 @@ int cmd_resize(int argc, char *argv[]) {
       }
       break;
 
+    case 'a':
+      params.all_resize = 1;
+      break;
+
+    case 'G':
+      params.grow_fs = 1;
+      break;
+
     case 'h':
       Usage();
       return CGPT_OK;
@@ -69,11 +89,12 @@ int cmd_resize(int argc, char *argv[]) {
 
   if (optind >= argc)
   {
-    Error("missing partition argument\n");
+    Error("missing %s argument\n", params.all_resize ? "drive" : "partition");
     return CGPT_FAILED;
   }
 
-  params.partition_desc = strdup(argv[optind]);
+  params.targets = &argv[optind];
+  params.num_targets = argc - optind;
 
   return CgptResize(&params);
 }
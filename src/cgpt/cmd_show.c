@@ -30,9 +30,17 @@ static void Usage(void)
          "               -P  Priority flag\n"
          "               -A  raw 64-bit attribute value\n"
          "  -d           Debug output (including invalid headers)\n"
+         "  --free       List the unallocated sectors of the usable space,\n"
+         "               as \"START SIZE\" lines with -q\n"
          "\n", progname);
 }
 
+static const struct option long_options[] = {
+  {"free", no_argument, NULL, 'F'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
 int cmd_show(int argc, char *argv[]) {
   CgptShowParams params;
   memset(&params, 0, sizeof(params));
@@ -43,7 +51,8 @@ int cmd_show(int argc, char *argv[]) {
   char *e = 0;
 
   opterr = 0;                     // quiet, you
-  while ((c=getopt(argc, argv, ":hnvqi:bstulSTPAd")) != -1)
+  while ((c=getopt_long(argc, argv, ":hnvqi:bstulSTPAd", long_options,
+                        NULL)) != -1)
   {
     switch (c)
     {
@@ -79,6 +88,9 @@ int cmd_show(int argc, char *argv[]) {
     case 'd':
       params.debug = 1;
       break;
+    case 'F':
+      params.free_space = 1;
+      break;
 
     case 'h':
       Usage();
@@ -96,6 +108,10 @@ int cmd_show(int argc, char *argv[]) {
       break;
     }
   }
+  if (params.free_space && params.partition) {
+    Error("--free can't be combined with -i\n");
+    errorcnt++;
+  }
   if (errorcnt)
   {
     Usage();
@@ -0,0 +1,142 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blkid_utils.h"
+#include "cgpt.h"
+#include "vboot_host.h"
+
+static void Usage(void)
+{
+  printf("\nUsage: %s switch [OPTIONS] -i NUM DRIVE\n\n"
+         "Make a CoreOS root partition the one to boot next, in a single\n"
+         "update of the partition table.\n\n"
+         "Options:\n"
+         "  -i NUM       Partition to switch to.\n"
+         "  -P NUM       Priority to give it. The other roots are ranked\n"
+         "                 below it while preserving their original order,\n"
+         "                 the same as with prioritize -i. Without it the\n"
+         "                 roots are renumbered from 1 up with this one on\n"
+         "                 top.\n"
+         "  -T NUM       Set the tries flag (0-15).\n"
+         "  -S NUM       Set the successful flag (0|1).\n"
+         "\n"
+         "A typical update sets the new root to -T 1 -S 0, so it is tried\n"
+         "once while the old root stays as the fallback. Without -T or -S the\n"
+         "flags are left as they are, but the partition must end up with\n"
+         "tries left or marked successful.\n"
+         "\n", progname);
+}
+
+int cmd_switch(int argc, char *argv[]) {
+  CgptSwitchParams params;
+  memset(&params, 0, sizeof(params));
+
+  int c;
+  int errorcnt = 0;
+  int r = CGPT_FAILED;
+  char *e = 0;
+
+  opterr = 0;                     // quiet, you
+  while ((c=getopt(argc, argv, ":hi:P:T:S:")) != -1)
+  {
+    switch (c)
+    {
+    case 'i':
+      params.partition = (uint32_t)strtoul(optarg, &e, 0);
+      if (!*optarg || (e && *e))
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      break;
+    case 'P':
+      params.priority = (int)strtol(optarg, &e, 0);
+      if (!*optarg || (e && *e))
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      if (params.priority < 1 || params.priority > 15) {
+        Error("value for -%c must be between 1 and 15\n", c);
+        errorcnt++;
+      }
+      break;
+    case 'T':
+      params.set_tries = 1;
+      params.tries = (int)strtol(optarg, &e, 0);
+      if (!*optarg || (e && *e))
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      if (params.tries < 0 || params.tries > 15) {
+        Error("value for -%c must be between 0 and 15\n", c);
+        errorcnt++;
+      }
+      break;
+    case 'S':
+      params.set_successful = 1;
+      params.successful = (int)strtol(optarg, &e, 0);
+      if (!*optarg || (e && *e))
+      {
+        Error("invalid argument to -%c: \"%s\"\n", c, optarg);
+        errorcnt++;
+      }
+      if (params.successful < 0 || params.successful > 1) {
+        Error("value for -%c must be between 0 and 1\n", c);
+        errorcnt++;
+      }
+      break;
+
+    case 'h':
+      Usage();
+      return CGPT_OK;
+    case '?':
+      Error("unrecognized option: -%c\n", optopt);
+      errorcnt++;
+      break;
+    case ':':
+      Error("missing argument to -%c\n", optopt);
+      errorcnt++;
+      break;
+    default:
+      errorcnt++;
+      break;
+    }
+  }
+  if (errorcnt)
+  {
+    Usage();
+    return CGPT_FAILED;
+  }
+
+  if (optind >= argc) {
+    Error("missing drive argument\n");
+    return CGPT_FAILED;
+  }
+
+  params.drive_name = strdup(argv[optind]);
+
+  r = translate_partition_dev(&params.drive_name, &params.partition);
+  if (r != CGPT_OK)
+    goto out;
+
+  if (!params.partition) {
+    Error("missing -i option\n");
+    Usage();
+    r = CGPT_FAILED;
+    goto out;
+  }
+
+  r = CgptSwitch(&params);
+
+out:
+  free(params.drive_name);
+  return r;
+}
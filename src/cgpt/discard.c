@@ -0,0 +1,152 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "discard.h"
+#include "kernel_sync.h"
+#include "vboot_host.h"
+
+// Discards, or with zero set makes sure the range reads back as zeros.
+static int Discard(int fd, uint64_t offset, uint64_t bytes, int zero) {
+  struct stat st;
+  uint64_t range[2] = { offset, bytes };
+
+  if (!bytes)
+    return CGPT_OK;
+  if (fstat(fd, &st) < 0) {
+    Error("Can't stat the drive: %s\n", strerror(errno));
+    return CGPT_FAILED;
+  }
+
+  if (S_ISBLK(st.st_mode)) {
+    if (!zero && ioctl(fd, BLKDISCARD, &range) == 0)
+      return CGPT_OK;
+    if ((zero || errno == EOPNOTSUPP) && ioctl(fd, BLKZEROOUT, &range) == 0)
+      return CGPT_OK;
+  } else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       offset, bytes) == 0) {
+    return CGPT_OK;
+  }
+
+  Error("Can't %s bytes %llu-%llu: %s\n", zero ? "zero" : "discard",
+        (unsigned long long)offset, (unsigned long long)(offset + bytes - 1),
+        strerror(errno));
+  return CGPT_FAILED;
+}
+
+int DiscardRange(int fd, uint64_t offset, uint64_t bytes) {
+  return Discard(fd, offset, bytes, 0);
+}
+
+int ZeroRange(int fd, uint64_t offset, uint64_t bytes) {
+  return Discard(fd, offset, bytes, 1);
+}
+
+// The used entries of the table the kernel would pick, copied out, so
+// both sides of the comparison have the same layout.
+static int CopyEntries(struct drive *drive, GptEntry **entries_out,
+                       uint32_t *count_out) {
+  GptEntry *entries, *entry;
+  uint32_t i, count = 0, num_entries;
+  int table = TableForKernel(drive);
+
+  *entries_out = NULL;
+  *count_out = 0;
+  if (table < 0)
+    return CGPT_OK;
+
+  num_entries = TableHeader(drive, table)->number_of_entries;
+  if (!(entries = calloc(num_entries ? num_entries : 1, sizeof(*entries)))) {
+    Error("Out of memory\n");
+    return CGPT_FAILED;
+  }
+  for (i = 0; i < num_entries; i++) {
+    entry = TableEntry(drive, table, i);
+    if (!GuidIsZero(&entry->type))
+      memcpy(&entries[count++], entry, sizeof(*entry));
+  }
+  *entries_out = entries;
+  *count_out = count;
+  return CGPT_OK;
+}
+
+int TrackDiscards(struct drive *drive) {
+  free(drive->discard_before);
+  return CopyEntries(drive, &drive->discard_before,
+                     &drive->num_discard_before);
+}
+
+static const GptEntry *SamePartition(const GptEntry *entry,
+                                     const GptEntry *entries,
+                                     uint32_t count) {
+  uint32_t i;
+
+  for (i = 0; i < count; i++)
+    if (GuidEqual(&entries[i].unique, &entry->unique))
+      return &entries[i];
+  return NULL;
+}
+
+// Discards the sectors of entry that keep is not also using.
+static int DiscardExcept(struct drive *drive, const GptEntry *entry,
+                         const GptEntry *keep) {
+  uint64_t start = entry->starting_lba, end = entry->ending_lba;
+  uint64_t bytes = drive->gpt.sector_bytes;
+  int errors = 0;
+
+  if (end < start)
+    return CGPT_OK;
+  if (!keep || keep->ending_lba < start || keep->starting_lba > end)
+    return DiscardRange(drive->fd, start * bytes, (end - start + 1) * bytes);
+
+  if (keep->starting_lba > start &&
+      CGPT_OK != DiscardRange(drive->fd, start * bytes,
+                              (keep->starting_lba - start) * bytes))
+    errors++;
+  if (keep->ending_lba < end &&
+      CGPT_OK != DiscardRange(drive->fd, (keep->ending_lba + 1) * bytes,
+                              (end - keep->ending_lba) * bytes))
+    errors++;
+  return errors ? CGPT_FAILED : CGPT_OK;
+}
+
+int DiscardChangedSectors(struct drive *drive) {
+  GptEntry *after;
+  uint32_t num_after, i;
+  int errors = 0;
+
+  if (!drive->discard_before)
+    return CGPT_OK;
+  if (CGPT_OK != CopyEntries(drive, &after, &num_after))
+    return CGPT_FAILED;
+
+  for (i = 0; i < drive->num_discard_before; i++) {
+    const GptEntry *old = &drive->discard_before[i];
+
+    if (CGPT_OK != DiscardExcept(drive, old,
+                                 SamePartition(old, after, num_after)))
+      errors++;
+  }
+  for (i = 0; i < num_after; i++) {
+    if (CGPT_OK != DiscardExcept(drive, &after[i],
+                                 SamePartition(&after[i],
+                                               drive->discard_before,
+                                               drive->num_discard_before)))
+      errors++;
+  }
+
+  free(after);
+  return errors ? CGPT_FAILED : CGPT_OK;
+}
@@ -0,0 +1,37 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_DISCARD_H_
+#define CGPT_DISCARD_H_
+
+#include <stdint.h>
+
+#include "cgpt.h"
+
+// Throws away offset..offset+bytes of the drive open on fd. Block devices
+// get BLKDISCARD, or BLKZEROOUT if they can't discard; image files get a
+// hole punched. Discarded sectors may read back as zeros or as their old
+// contents, depending on the device. Returns CGPT_OK or CGPT_FAILED.
+int DiscardRange(int fd, uint64_t offset, uint64_t bytes);
+
+// Like DiscardRange, but the range always reads back as zeros after:
+// block devices get BLKZEROOUT, which unmaps where the device can promise
+// zeros and has the kernel write them otherwise.
+int ZeroRange(int fd, uint64_t offset, uint64_t bytes);
+
+// Remembers the partitions drive has now. DriveClose then discards every
+// sector that changed hands by the time the table is written: the sectors
+// of removed partitions, of new ones, and those a partition gave up or
+// took over by moving or resizing. A partition that keeps its unique GUID
+// keeps the sectors it had, even if its type or label changed. Returns
+// CGPT_OK or CGPT_FAILED.
+int TrackDiscards(struct drive *drive);
+
+// Does the discarding TrackDiscards set up, from the table in memory.
+// SyncKernelPartitions calls it once the kernel has dropped the removed
+// partitions and before it adds the new ones. Returns CGPT_OK if nothing
+// was tracked.
+int DiscardChangedSectors(struct drive *drive);
+
+#endif  // CGPT_DISCARD_H_
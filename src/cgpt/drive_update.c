@@ -0,0 +1,137 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+// The writing half of DriveClose, apart from DriveOpen and the rest of
+// cgpt_common.c so that tools which only read tables don't link the code
+// that updates the kernel and discards sectors.
+
+#include <errno.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "kernel_sync.h"
+#include "vboot_host.h"
+
+int WritePMBR(struct drive *drive) {
+  if (-1 == lseek(drive->fd, 0, SEEK_SET))
+    return CGPT_FAILED;
+
+  int nwrote = write(drive->fd, &drive->pmbr, sizeof(struct pmbr));
+  if (nwrote != sizeof(struct pmbr))
+    return CGPT_FAILED;
+
+  return CGPT_OK;
+}
+
+/* Saves sectors to 'fd'.
+ *
+ *   fd -- file descriptot.
+ *   buf -- pointer to buffer
+ *   sector -- starting sector offset
+ *   sector_bytes -- bytes per sector
+ *   sector_count -- number of sector to save
+ *
+ * Returns CGPT_OK for successful, CGPT_FAILED for failed.
+ */
+static int Save(const int fd, const uint8_t *buf,
+                const uint64_t sector,
+                const uint64_t sector_bytes,
+                const uint64_t sector_count) {
+  int count;  /* byte count to write */
+  int nwrote;
+
+  if (!buf)
+    return CGPT_FAILED;
+  count = sector_bytes * sector_count;
+
+  if (-1 == lseek(fd, sector * sector_bytes, SEEK_SET))
+    return CGPT_FAILED;
+
+  nwrote = write(fd, buf, count);
+  if (nwrote < count)
+    return CGPT_FAILED;
+
+  return CGPT_OK;
+}
+
+int DriveClose(struct drive *drive, int update_as_needed) {
+  struct added_partitions added;
+  uint64_t entries_lba;
+  uint32_t entries_sectors;
+  int errors = 0;
+
+  // Write the secondary copy first and each header after its entries, so a
+  // partial update leaves one whole copy, old or new, as long as the writes
+  // land in order.
+  if (update_as_needed) {
+    if (drive->gpt.modified & GPT_MODIFIED_ENTRIES2) {
+      GetEntriesLocation(&drive->gpt, SECONDARY, &entries_lba, &entries_sectors);
+      if (CGPT_OK != Save(drive->fd, drive->gpt.secondary_entries,
+                          entries_lba,
+                          drive->gpt.sector_bytes, entries_sectors)) {
+        errors++;
+        Error("Cannot write secondary entries: %s\n", strerror(errno));
+      }
+    }
+    if (drive->gpt.modified & GPT_MODIFIED_HEADER2) {
+      if(CGPT_OK != Save(drive->fd, drive->gpt.secondary_header,
+                         drive->gpt.drive_sectors - GPT_PMBR_SECTOR,
+                         drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
+        errors++;
+        Error("Cannot write secondary header: %s\n", strerror(errno));
+      }
+    }
+    if (drive->gpt.modified & GPT_MODIFIED_ENTRIES1) {
+      GetEntriesLocation(&drive->gpt, PRIMARY, &entries_lba, &entries_sectors);
+      if (CGPT_OK != Save(drive->fd, drive->gpt.primary_entries,
+                          entries_lba,
+                          drive->gpt.sector_bytes, entries_sectors)) {
+        errors++;
+        Error("Cannot write primary entries: %s\n", strerror(errno));
+      }
+    }
+    if (drive->gpt.modified & GPT_MODIFIED_HEADER1) {
+      if (CGPT_OK != Save(drive->fd, drive->gpt.primary_header,
+                          GPT_PMBR_SECTOR,
+                          drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
+        errors++;
+        Error("Cannot write primary header: %s\n", strerror(errno));
+      }
+    }
+    if (drive->pmbr_modified && CGPT_OK != WritePMBR(drive)) {
+      errors++;
+      Error("Cannot write legacy MBR: %s\n", strerror(errno));
+    }
+  }
+
+  // Sync early! Only sync file descriptor here, and leave the whole system sync
+  // outside cgpt because whole system sync would trigger tons of disk accesses
+  // and timeout tests.
+  fsync(drive->fd);
+
+  // Tell the kernel about the new layout, one partition at a time, rather
+  // than having the caller reread the whole table. Discarding happens in
+  // the middle of that too.
+  if (update_as_needed && !errors && drive->gpt.modified) {
+    if (CGPT_OK != SyncKernelPartitions(drive, &added)) {
+      errors++;
+      Error("The partition table was written but the kernel's partitions "
+            "or discarded sectors aren't all up to date\n");
+    } else if (added.partnos) {
+      // udev only handles the events of a disk's partitions once it can
+      // take a shared lock on the disk, so let go of ours before waiting.
+      flock(drive->fd, LOCK_UN);
+      if (CGPT_OK != WaitForAddedPartitions(&added,
+                                            drive->uevent_timeout_ms))
+        errors++;
+    }
+  }
+
+  DriveRelease(drive);
+
+  return errors ? CGPT_FAILED : CGPT_OK;
+}
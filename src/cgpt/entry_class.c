@@ -0,0 +1,133 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "entry_class.h"
+
+// The type GUID is the first field of each entry, so a sweep reads one
+// 16-byte vector per sizeof(GptEntry) stride.
+#if defined(__SSE2__)
+
+typedef __m128i guid_vec;
+
+static inline guid_vec LoadGuid(const void *p) {
+  return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline int GuidVecEqual(guid_vec a, guid_vec b) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+typedef uint8x16_t guid_vec;
+
+static inline guid_vec LoadGuid(const void *p) {
+  return vld1q_u8((const uint8_t *)p);
+}
+
+static inline int GuidVecEqual(guid_vec a, guid_vec b) {
+  return vminvq_u8(vceqq_u8(a, b)) == 0xff;
+}
+
+#else
+
+typedef struct { uint64_t lo, hi; } guid_vec;
+
+static inline guid_vec LoadGuid(const void *p) {
+  guid_vec v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline int GuidVecEqual(guid_vec a, guid_vec b) {
+  return a.lo == b.lo && a.hi == b.hi;
+}
+
+#endif
+
+static inline void SetBit(entry_bitmap bitmap, uint32_t i) {
+  bitmap[i / 64] |= 1ULL << (i % 64);
+}
+
+void ClassifyEntries(struct drive *drive, int secondary,
+                     struct entry_classes *cls) {
+  const uint8_t *entry;
+  guid_vec zero = LoadGuid(&guid_unused);
+  guid_vec kernel = LoadGuid(&guid_chromeos_kernel);
+  guid_vec root = LoadGuid(&guid_coreos_rootfs);
+  uint32_t i;
+
+  memset(cls, 0, sizeof(*cls));
+  // No valid header yet, e.g. while creating a table.
+  cls->num_entries = GetNumberOfEntries(drive);
+  if (!cls->num_entries)
+    return;
+  entry = (const uint8_t *)GetEntry(&drive->gpt, secondary, 0);
+
+  for (i = 0; i < cls->num_entries; i++, entry += sizeof(GptEntry)) {
+    guid_vec type = LoadGuid(entry);
+
+    if (GuidVecEqual(type, zero))
+      continue;
+    SetBit(cls->used, i);
+    if (GuidVecEqual(type, kernel))
+      SetBit(cls->kernel, i);
+    else if (GuidVecEqual(type, root))
+      SetBit(cls->root, i);
+  }
+}
+
+uint32_t MatchEntryType(struct drive *drive, int secondary, const Guid *type,
+                        entry_bitmap bitmap) {
+  const uint8_t *entry;
+  guid_vec want = LoadGuid(type);
+  uint32_t num_entries = GetNumberOfEntries(drive);
+  uint32_t i, count = 0;
+
+  memset(bitmap, 0, sizeof(entry_bitmap));
+  if (!num_entries)
+    return 0;
+  entry = (const uint8_t *)GetEntry(&drive->gpt, secondary, 0);
+  for (i = 0; i < num_entries; i++, entry += sizeof(GptEntry)) {
+    if (GuidVecEqual(LoadGuid(entry), want)) {
+      SetBit(bitmap, i);
+      count++;
+    }
+  }
+  return count;
+}
+
+int NextEntry(const entry_bitmap bitmap, uint32_t num_entries, int prev) {
+  uint32_t i = prev + 1;
+  uint64_t word;
+
+  if (i >= num_entries)
+    return -1;
+
+  word = bitmap[i / 64] & (~0ULL << (i % 64));
+  for (i /= 64; !word; word = bitmap[i]) {
+    if (++i >= (num_entries + 63) / 64)
+      return -1;
+  }
+  i = i * 64 + __builtin_ctzll(word);
+  return i < num_entries ? (int)i : -1;
+}
+
+uint32_t CountEntries(const entry_bitmap bitmap) {
+  uint32_t i, count = 0;
+
+  for (i = 0; i < ENTRY_BITMAP_WORDS; i++)
+    count += __builtin_popcountll(bitmap[i]);
+  return count;
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_ENTRY_CLASS_H_
+#define CGPT_ENTRY_CLASS_H_
+
+#include <stdint.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+
+#define ENTRY_BITMAP_WORDS (MAX_NUMBER_OF_ENTRIES / 64)
+
+// One bit per entry, entry i is bit i % 64 of word i / 64.
+typedef uint64_t entry_bitmap[ENTRY_BITMAP_WORDS];
+
+// The entries of one table sorted into the classes commands filter on.
+struct entry_classes {
+  uint32_t num_entries;
+  entry_bitmap used;
+  entry_bitmap kernel;      // ChromeOS kernel
+  entry_bitmap root;        // CoreOS rootfs
+};
+
+// Sweeps the type GUIDs of the table once, with SSE2 or NEON where the
+// compiler targets them, and fills in cls.
+void ClassifyEntries(struct drive *drive, int secondary,
+                     struct entry_classes *cls);
+
+// Sets the bits of the entries of the given type, which must not be the
+// unused type, and returns how many there are.
+uint32_t MatchEntryType(struct drive *drive, int secondary, const Guid *type,
+                        entry_bitmap bitmap);
+
+// Returns the first set bit after prev (-1 to start), or -1 if there is
+// none. Loop with
+//   for (i = NextEntry(bits, n, -1); i >= 0; i = NextEntry(bits, n, i))
+int NextEntry(const entry_bitmap bitmap, uint32_t num_entries, int prev);
+
+uint32_t CountEntries(const entry_bitmap bitmap);
+
+#endif  // CGPT_ENTRY_CLASS_H_
@@ -0,0 +1,218 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "entry_index.h"
+#include "vboot_host.h"
+
+#define SLOT_EMPTY    0
+#define SLOT_DELETED  0xffff
+#define MIN_SLOTS     64
+
+// FNV-1a, good enough for GUIDs that are random to begin with.
+static uint32_t Hash(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint32_t h = 2166136261u;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static size_t NameUnits(const uint16_t *name) {
+  size_t n = 0;
+
+  while (n < ENTRY_NAME_UNITS && name[n])
+    n++;
+  return n;
+}
+
+static int NamesEqual(const uint16_t *a, const uint16_t *b) {
+  size_t n = NameUnits(a);
+
+  return n == NameUnits(b) && !memcmp(a, b, n * sizeof(*a));
+}
+
+// The name field of the packed entry may be unaligned.
+static void EntryName(const GptEntry *entry, uint16_t *name) {
+  memcpy(name, entry->name, ENTRY_NAME_UNITS * sizeof(*name));
+}
+
+static uint32_t NameHash(const uint16_t *name) {
+  return Hash(name, NameUnits(name) * sizeof(*name));
+}
+
+static void Insert(uint16_t *slots, uint32_t mask, uint32_t hash,
+                   uint32_t index) {
+  uint32_t i, slot;
+
+  for (i = 0; i <= mask; i++) {
+    slot = (hash + i) & mask;
+    if (slots[slot] == SLOT_EMPTY || slots[slot] == SLOT_DELETED) {
+      slots[slot] = index + 1;
+      return;
+    }
+  }
+}
+
+static void Remove(uint16_t *slots, uint32_t mask, uint32_t hash,
+                   uint32_t index) {
+  uint32_t i, slot;
+
+  for (i = 0; i <= mask; i++) {
+    slot = (hash + i) & mask;
+    if (slots[slot] == SLOT_EMPTY)
+      return;
+    if (slots[slot] == index + 1) {
+      slots[slot] = SLOT_DELETED;
+      return;
+    }
+  }
+}
+
+static void FreeEntryIndex(struct entry_index *idx) {
+  free(idx->guid_slots);
+  free(idx->label_slots);
+  free(idx->guid_hash);
+  free(idx->label_hash);
+  free(idx);
+}
+
+static void IndexEntry(struct drive *drive, struct entry_index *idx,
+                       uint32_t index) {
+  GptEntry *entry = GetEntry(&drive->gpt, ANY_VALID, index);
+  uint16_t name[ENTRY_NAME_UNITS];
+
+  if (GuidIsZero(&entry->type))
+    return;
+
+  EntryName(entry, name);
+  idx->guid_hash[index] = Hash(&entry->unique, sizeof(Guid));
+  idx->label_hash[index] = NameHash(name);
+  Insert(idx->guid_slots, idx->mask, idx->guid_hash[index], index);
+  Insert(idx->label_slots, idx->mask, idx->label_hash[index], index);
+}
+
+static struct entry_index *GetEntryIndex(struct drive *drive) {
+  struct entry_index *idx;
+  uint32_t num_entries = GetNumberOfEntries(drive);
+  uint32_t slots = MIN_SLOTS;
+  uint32_t i;
+
+  if (drive->entry_index)
+    return drive->entry_index;
+
+  // Keep the tables at most half full so probe runs stay short.
+  while (slots < 2 * num_entries)
+    slots <<= 1;
+
+  idx = calloc(1, sizeof(*idx));
+  if (idx) {
+    idx->guid_slots = calloc(slots, sizeof(*idx->guid_slots));
+    idx->label_slots = calloc(slots, sizeof(*idx->label_slots));
+    idx->guid_hash = calloc(num_entries, sizeof(*idx->guid_hash));
+    idx->label_hash = calloc(num_entries, sizeof(*idx->label_hash));
+  }
+  if (!idx || !idx->guid_slots || !idx->label_slots ||
+      !idx->guid_hash || !idx->label_hash) {
+    Error("Out of memory building the entry index\n");
+    if (idx)
+      FreeEntryIndex(idx);
+    return NULL;
+  }
+  idx->mask = slots - 1;
+  idx->num_entries = num_entries;
+
+  for (i = 0; i < num_entries; i++)
+    IndexEntry(drive, idx, i);
+
+  drive->entry_index = idx;
+  return idx;
+}
+
+void UpdateEntryIndex(struct drive *drive, uint32_t index) {
+  struct entry_index *idx = drive->entry_index;
+
+  // Not built yet, it will pick up the change when it is.
+  if (!idx || index >= idx->num_entries)
+    return;
+
+  Remove(idx->guid_slots, idx->mask, idx->guid_hash[index], index);
+  Remove(idx->label_slots, idx->mask, idx->label_hash[index], index);
+  IndexEntry(drive, idx, index);
+}
+
+void DropEntryIndex(struct drive *drive) {
+  if (!drive->entry_index)
+    return;
+  FreeEntryIndex(drive->entry_index);
+  drive->entry_index = NULL;
+}
+
+int NextUniqueMatch(struct drive *drive, const Guid *guid,
+                    struct entry_cursor *cursor) {
+  struct entry_index *idx = GetEntryIndex(drive);
+  uint32_t hash = Hash(guid, sizeof(Guid));
+
+  if (!idx)
+    return -1;
+
+  while (cursor->probe <= idx->mask) {
+    uint16_t slot = idx->guid_slots[(hash + cursor->probe++) & idx->mask];
+    GptEntry *entry;
+
+    if (slot == SLOT_EMPTY)
+      break;
+    if (slot == SLOT_DELETED)
+      continue;
+    entry = GetEntry(&drive->gpt, ANY_VALID, slot - 1);
+    if (GuidEqual(&entry->unique, guid))
+      return slot - 1;
+  }
+  cursor->probe = idx->mask + 1;
+  return -1;
+}
+
+int NextLabelMatch(struct drive *drive, const char *label,
+                   struct entry_cursor *cursor) {
+  struct entry_index *idx = GetEntryIndex(drive);
+  // One unit more than a name can hold to catch labels that are too long.
+  uint16_t want[ENTRY_NAME_UNITS + 2], name[ENTRY_NAME_UNITS];
+  uint32_t hash;
+
+  if (!idx)
+    return -1;
+
+  memset(want, 0, sizeof(want));
+  if (CGPT_OK != UTF8ToUTF16((const uint8_t *)label, want,
+                             ARRAY_COUNT(want)) || want[ENTRY_NAME_UNITS])
+    return -1;
+  hash = NameHash(want);
+
+  while (cursor->probe <= idx->mask) {
+    uint16_t slot = idx->label_slots[(hash + cursor->probe++) & idx->mask];
+
+    if (slot == SLOT_EMPTY)
+      break;
+    if (slot == SLOT_DELETED)
+      continue;
+    EntryName(GetEntry(&drive->gpt, ANY_VALID, slot - 1), name);
+    if (NamesEqual(name, want))
+      return slot - 1;
+  }
+  cursor->probe = idx->mask + 1;
+  return -1;
+}
+
+int FindUniqueGuid(struct drive *drive, const Guid *guid) {
+  struct entry_cursor cursor = { 0 };
+
+  return NextUniqueMatch(drive, guid, &cursor);
+}
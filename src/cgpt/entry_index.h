@@ -0,0 +1,54 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_ENTRY_INDEX_H_
+#define CGPT_ENTRY_INDEX_H_
+
+#include <stdint.h>
+
+#include "cgpt.h"
+#include "cgptlib.h"
+#include "gpt.h"
+
+// Number of UTF-16 code units in a partition name.
+#define ENTRY_NAME_UNITS 36
+
+// Open addressing hash tables from the unique GUID and from the raw UTF-16
+// label of the used entries to their index. Labels don't have to be unique,
+// so both tables keep every entry and lookups walk all matches.
+struct entry_index {
+  uint32_t mask;            // number of slots - 1, a power of two minus one
+  uint16_t *guid_slots;     // entry index + 1, or one of the SLOT_ values
+  uint16_t *label_slots;
+  uint32_t *guid_hash;      // per entry, to find its slots again
+  uint32_t *label_hash;
+  uint32_t num_entries;
+};
+
+// Walks the matches of one lookup. Zero it before the first call.
+struct entry_cursor {
+  uint32_t probe;
+};
+
+// The index of an open drive covers the ANY_VALID entries and is built on
+// first use. DriveClose drops it. Code that changes the unique GUID, label
+// or type of an entry must call UpdateEntryIndex afterwards, and code that
+// rewrites the entries wholesale must call DropEntryIndex.
+void UpdateEntryIndex(struct drive *drive, uint32_t index);
+void DropEntryIndex(struct drive *drive);
+
+// Returns the index of the next used entry with the given unique GUID, or
+// -1 once there are no more (or the index couldn't be built).
+int NextUniqueMatch(struct drive *drive, const Guid *guid,
+                    struct entry_cursor *cursor);
+
+// Same for a label given in UTF-8. Labels that can't be converted to UTF-16
+// match nothing.
+int NextLabelMatch(struct drive *drive, const char *label,
+                   struct entry_cursor *cursor);
+
+// Returns the index of the used entry with the given unique GUID, or -1.
+int FindUniqueGuid(struct drive *drive, const Guid *guid);
+
+#endif  // CGPT_ENTRY_INDEX_H_
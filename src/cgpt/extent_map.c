@@ -0,0 +1,200 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "extent_map.h"
+
+static int CompareExtents(const void *a, const void *b) {
+  const struct extent *x = a, *y = b;
+
+  if (x->start != y->start)
+    return x->start < y->start ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+int BuildExtentMap(struct extent_map *map, GptData *gpt) {
+  GptHeader *h = (GptHeader *)gpt->primary_header;
+  GptEntry *entries = (GptEntry *)gpt->primary_entries;
+  uint64_t next;
+  uint32_t i;
+
+  memset(map, 0, sizeof(*map));
+  map->used = calloc(h->number_of_entries, sizeof(*map->used));
+  // Every used extent leaves at most one gap before it, plus the tail.
+  map->free = calloc(h->number_of_entries + 1, sizeof(*map->free));
+  if (!map->used || !map->free) {
+    Error("Out of memory building the extent map\n");
+    FreeExtentMap(map);
+    return CGPT_FAILED;
+  }
+
+  for (i = 0; i < h->number_of_entries; i++) {
+    if (IsUnusedEntry(&entries[i]))
+      continue;
+    map->used[map->num_used].start = entries[i].starting_lba;
+    map->used[map->num_used].end = entries[i].ending_lba;
+    map->used[map->num_used].index = i;
+    map->num_used++;
+  }
+  qsort(map->used, map->num_used, sizeof(*map->used), CompareExtents);
+
+  // Overlapping entries are tolerated here, CheckEntries reports them.
+  next = h->first_usable_lba;
+  for (i = 0; i <= map->num_used && next <= h->last_usable_lba; i++) {
+    uint64_t end = h->last_usable_lba;
+
+    if (i < map->num_used) {
+      if (map->used[i].start <= next) {
+        if (map->used[i].end >= next)
+          next = map->used[i].end + 1;
+        continue;
+      }
+      if (map->used[i].start - 1 < end)
+        end = map->used[i].start - 1;
+    }
+    map->free[map->num_free].start = next;
+    map->free[map->num_free].end = end;
+    map->num_free++;
+    if (i < map->num_used)
+      next = map->used[i].end + 1;
+  }
+
+  return CGPT_OK;
+}
+
+void FreeExtentMap(struct extent_map *map) {
+  free(map->used);
+  free(map->free);
+  memset(map, 0, sizeof(*map));
+}
+
+const struct extent_map *GetExtentMap(struct drive *drive) {
+  struct extent_map *map;
+
+  if (drive->extents)
+    return drive->extents;
+
+  map = malloc(sizeof(*map));
+  if (!map) {
+    Error("Out of memory building the extent map\n");
+    return NULL;
+  }
+  if (CGPT_OK != BuildExtentMap(map, &drive->gpt)) {
+    free(map);
+    return NULL;
+  }
+  drive->extents = map;
+  return map;
+}
+
+void DropExtentMap(struct drive *drive) {
+  if (!drive->extents)
+    return;
+  FreeExtentMap(drive->extents);
+  free(drive->extents);
+  drive->extents = NULL;
+}
+
+const struct extent *FindFreeExtent(const struct extent_map *map,
+                                    uint64_t lba) {
+  uint32_t lo = 0, hi = map->num_free;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (lba < map->free[mid].start)
+      hi = mid;
+    else if (lba > map->free[mid].end)
+      lo = mid + 1;
+    else
+      return &map->free[mid];
+  }
+  return NULL;
+}
+
+// Index of the first used extent starting after lba.
+static uint32_t UpperBound(const struct extent_map *map, uint64_t lba) {
+  uint32_t lo = 0, hi = map->num_used;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (map->used[mid].start <= lba)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+const struct extent *NextUsedExtent(const struct extent_map *map,
+                                    uint64_t lba, int exclude) {
+  uint32_t i;
+
+  for (i = UpperBound(map, lba); i < map->num_used; i++)
+    if ((int)map->used[i].index != exclude)
+      return &map->used[i];
+  return NULL;
+}
+
+const struct extent *FindUsedOverlap(const struct extent_map *map,
+                                     uint64_t start, uint64_t end,
+                                     int exclude) {
+  uint32_t i = UpperBound(map, end);
+
+  // Without overlaps the ends are sorted too, so only the last extent
+  // starting at or before end can reach back to start.
+  while (i > 0) {
+    const struct extent *e = &map->used[--i];
+
+    if ((int)e->index == exclude)
+      continue;
+    return e->end >= start ? e : NULL;
+  }
+  return NULL;
+}
+
+int FindFreeSpace(const struct extent_map *map, enum cgpt_fit fit,
+                  uint64_t align, uint64_t size,
+                  uint64_t *start, uint64_t *found_size) {
+  uint64_t best_start = 0, best_avail = 0;
+  int found = 0;
+  uint32_t i;
+
+  if (!align)
+    align = 1;
+
+  for (i = 0; i < map->num_free; i++) {
+    const struct extent *f = &map->free[i];
+    uint64_t first = (f->start + align - 1) / align * align;
+    uint64_t avail;
+
+    if (first < f->start || first > f->end)
+      continue;
+    avail = f->end - first + 1;
+    if (avail < (size ? size : align))
+      continue;
+
+    if (!found ||
+        (fit == FIT_BEST && avail < best_avail) ||
+        (fit == FIT_LARGEST && avail > best_avail)) {
+      best_start = first;
+      best_avail = avail;
+      found = 1;
+      if (fit == FIT_FIRST)
+        break;
+    }
+  }
+
+  if (!found)
+    return CGPT_FAILED;
+
+  *start = best_start;
+  *found_size = size ? size : best_avail / align * align;
+  return CGPT_OK;
+}
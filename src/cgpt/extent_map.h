@@ -0,0 +1,68 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_EXTENT_MAP_H_
+#define CGPT_EXTENT_MAP_H_
+
+#include <stdint.h>
+
+#include "cgpt.h"
+#include "cgpt_params.h"
+#include "cgptlib.h"
+
+// A range of sectors, inclusive at both ends.
+struct extent {
+  uint64_t start;
+  uint64_t end;
+  uint32_t index;   // entry index for used extents
+};
+
+// The used partitions of a table sorted by start, and the free gaps of the
+// usable space between them, also sorted.
+struct extent_map {
+  struct extent *used;
+  uint32_t num_used;
+  struct extent *free;
+  uint32_t num_free;
+};
+
+// Builds the map from the primary entries and header.
+// Returns CGPT_OK or CGPT_FAILED.
+int BuildExtentMap(struct extent_map *map, GptData *gpt);
+void FreeExtentMap(struct extent_map *map);
+
+// Returns the map of an open drive, building it on first use, or NULL if
+// it can't be built. UpdateAllEntries and DriveClose drop it, so code that
+// changes the primary header or entries some other way must call
+// DropExtentMap before asking again.
+const struct extent_map *GetExtentMap(struct drive *drive);
+void DropExtentMap(struct drive *drive);
+
+// Returns the free extent containing lba, or NULL if lba isn't free.
+const struct extent *FindFreeExtent(const struct extent_map *map,
+                                    uint64_t lba);
+
+// Returns the first used extent starting after lba, skipping the entry at
+// exclude (-1 for none), or NULL if there is none.
+const struct extent *NextUsedExtent(const struct extent_map *map,
+                                    uint64_t lba, int exclude);
+
+// Returns a used extent other than the entry at exclude that shares a
+// sector with start..end, or NULL. The used extents must not overlap each
+// other, which CheckEntries guarantees for a table that passed
+// GptSanityCheck.
+const struct extent *FindUsedOverlap(const struct extent_map *map,
+                                     uint64_t start, uint64_t end,
+                                     int exclude);
+
+// Picks a free extent for a partition of size sectors starting on an
+// align-sector boundary, using the given policy. A size of 0 takes the
+// whole chosen extent, trimmed so the partition also ends on a boundary.
+// Returns CGPT_OK with start and size filled in, or CGPT_FAILED if nothing
+// fits.
+int FindFreeSpace(const struct extent_map *map, enum cgpt_fit fit,
+                  uint64_t align, uint64_t size,
+                  uint64_t *start, uint64_t *found_size);
+
+#endif  // CGPT_EXTENT_MAP_H_
@@ -0,0 +1,216 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "cgpt.h"
+#include "fs_grow.h"
+#include "kernel_sync.h"
+
+// From linux/fs/ext4/ext4.h, which isn't exported.
+#define EXT4_IOC_RESIZE_FS _IOW('f', 16, uint64_t)
+
+// From xfs_fs.h, which comes with xfsprogs rather than the kernel headers.
+struct xfs_fsop_geom_v1 {
+  uint32_t blocksize;
+  uint32_t rtextsize;
+  uint32_t agblocks;
+  uint32_t agcount;
+  uint32_t logblocks;
+  uint32_t sectsize;
+  uint32_t inodesize;
+  uint32_t imaxpct;
+  uint64_t datablocks;
+  uint64_t rtblocks;
+  uint64_t rtextents;
+  uint64_t logstart;
+  unsigned char uuid[16];
+  uint32_t sunit;
+  uint32_t swidth;
+  int32_t version;
+  uint32_t flags;
+  uint32_t logsectsize;
+  uint32_t rtsectsize;
+  uint32_t dirblocksize;
+};
+
+struct xfs_growfs_data {
+  uint64_t newblocks;
+  uint32_t imaxpct;
+};
+
+#define XFS_IOC_FSGEOMETRY_V1 _IOR('X', 100, struct xfs_fsop_geom_v1)
+#define XFS_IOC_FSGROWFSDATA _IOW('X', 110, struct xfs_growfs_data)
+
+// Finds the device number and node of partition partno of disk.
+static int FindPartition(dev_t disk, uint32_t partno, dev_t *devno,
+                         struct grown_fs *fs) {
+  char sysdir[PATH_MAX], partdir[PATH_MAX], path[PATH_MAX];
+  unsigned int maj, min;
+  uint64_t n;
+  struct dirent *d;
+  DIR *dir;
+  FILE *f;
+  int found = 0;
+
+  snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u",
+           major(disk), minor(disk));
+  if (!(dir = opendir(sysdir)))
+    return CGPT_FAILED;
+  while (!found && (d = readdir(dir)) != NULL) {
+    if (d->d_name[0] == '.' ||
+        snprintf(partdir, sizeof(partdir), "%s/%s", sysdir, d->d_name) >=
+        sizeof(partdir) ||
+        ReadSysfsNumber(partdir, "partition", &n) < 0 || n != partno ||
+        snprintf(path, sizeof(path), "%s/dev", partdir) >= sizeof(path) ||
+        !(f = fopen(path, "r")))
+      continue;
+    if (fscanf(f, "%u:%u", &maj, &min) == 2) {
+      *devno = makedev(maj, min);
+      found = snprintf(fs->node, sizeof(fs->node), "/dev/%s", d->d_name) <
+              sizeof(fs->node);
+    }
+    fclose(f);
+  }
+  closedir(dir);
+  return found ? CGPT_OK : CGPT_FAILED;
+}
+
+// Undoes the octal escapes of spaces and such in mountinfo fields.
+static void Unescape(char *s) {
+  char *out = s;
+
+  while (*s) {
+    if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+        s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+      *out++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+      s += 4;
+    } else {
+      *out++ = *s++;
+    }
+  }
+  *out = '\0';
+}
+
+// Finds where devno is mounted, and as what.
+static int FindMount(dev_t devno, struct grown_fs *fs) {
+  char *line = NULL, *mountpoint, *sep, *type, *save;
+  unsigned int maj, min;
+  size_t len = 0;
+  FILE *f;
+  int found = 0;
+
+  if (!(f = fopen("/proc/self/mountinfo", "r")))
+    return CGPT_FAILED;
+  // ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS [OPTIONAL...] - TYPE SOURCE ...
+  while (!found && getline(&line, &len, f) > 0) {
+    if (sscanf(line, "%*u %*u %u:%u", &maj, &min) != 2 ||
+        makedev(maj, min) != devno)
+      continue;
+    if (!(sep = strstr(line, " - ")) ||
+        !strtok_r(line, " ", &save) || !strtok_r(NULL, " ", &save) ||
+        !strtok_r(NULL, " ", &save) || !strtok_r(NULL, " ", &save) ||
+        !(mountpoint = strtok_r(NULL, " ", &save)) ||
+        !(type = strtok_r(sep + 3, " ", &save)))
+      continue;
+    Unescape(mountpoint);
+    found = snprintf(fs->mountpoint, sizeof(fs->mountpoint), "%s",
+                     mountpoint) < sizeof(fs->mountpoint) &&
+            snprintf(fs->type, sizeof(fs->type), "%s", type) <
+            sizeof(fs->type);
+  }
+  free(line);
+  fclose(f);
+  return found ? CGPT_OK : CGPT_FAILED;
+}
+
+static int GrowExt4(int fd, uint64_t size, struct grown_fs *fs) {
+  struct statfs before, after;
+  uint64_t blocks;
+
+  if (fstatfs(fd, &before) < 0) {
+    Error("Can't read the block size of %s: %s\n", fs->mountpoint,
+          strerror(errno));
+    return CGPT_FAILED;
+  }
+  // The kernel does nothing if the count doesn't change.
+  blocks = size / before.f_bsize;
+  if (ioctl(fd, EXT4_IOC_RESIZE_FS, &blocks) < 0) {
+    Error("Can't grow the %s filesystem on %s: %s\n", fs->type,
+          fs->mountpoint, strerror(errno));
+    return CGPT_FAILED;
+  }
+  fs->blocks = blocks;
+  // f_blocks leaves out the metadata overhead, so it can't be compared
+  // with blocks up front, but it only changes if the filesystem grew.
+  if (fstatfs(fd, &after) == 0 && after.f_blocks == before.f_blocks)
+    return CGPT_NOOP;
+  return CGPT_OK;
+}
+
+static int GrowXfs(int fd, uint64_t size, struct grown_fs *fs) {
+  struct xfs_fsop_geom_v1 geom;
+  struct xfs_growfs_data grow;
+
+  if (ioctl(fd, XFS_IOC_FSGEOMETRY_V1, &geom) < 0) {
+    Error("Can't read the geometry of %s: %s\n", fs->mountpoint,
+          strerror(errno));
+    return CGPT_FAILED;
+  }
+  fs->blocks = geom.datablocks;
+  grow.newblocks = size / geom.blocksize;
+  grow.imaxpct = geom.imaxpct;
+  if (grow.newblocks <= geom.datablocks)
+    return CGPT_NOOP;
+  if (ioctl(fd, XFS_IOC_FSGROWFSDATA, &grow) < 0) {
+    Error("Can't grow the xfs filesystem on %s: %s\n", fs->mountpoint,
+          strerror(errno));
+    return CGPT_FAILED;
+  }
+  fs->blocks = grow.newblocks;
+  return CGPT_OK;
+}
+
+int GrowFilesystem(dev_t disk, uint32_t partno, uint64_t size,
+                   struct grown_fs *fs) {
+  dev_t devno;
+  int fd, r;
+
+  memset(fs, 0, sizeof(*fs));
+  if (CGPT_OK != FindPartition(disk, partno, &devno, fs)) {
+    Error("Can't find the device of partition %u\n", partno);
+    return CGPT_FAILED;
+  }
+  if (CGPT_OK != FindMount(devno, fs)) {
+    Error("%s isn't mounted, only mounted filesystems can be grown\n",
+          fs->node);
+    return CGPT_FAILED;
+  }
+  if (strcmp(fs->type, "ext2") && strcmp(fs->type, "ext3") &&
+      strcmp(fs->type, "ext4") && strcmp(fs->type, "xfs")) {
+    Error("Can't grow %s filesystems like the one on %s\n", fs->type,
+          fs->node);
+    return CGPT_FAILED;
+  }
+
+  // Both ioctls go to any file of the mounted filesystem.
+  fd = open(fs->mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    Error("Can't open %s: %s\n", fs->mountpoint, strerror(errno));
+    return CGPT_FAILED;
+  }
+  r = strcmp(fs->type, "xfs") ? GrowExt4(fd, size, fs)
+                              : GrowXfs(fd, size, fs);
+  close(fd);
+  return r;
+}
@@ -0,0 +1,29 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_FS_GROW_H_
+#define CGPT_FS_GROW_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// The filesystem GrowFilesystem found, for reporting.
+struct grown_fs {
+  char node[PATH_MAX];          // /dev node of the partition
+  char mountpoint[PATH_MAX];
+  char type[32];
+  uint64_t blocks;              // filesystem blocks it now has
+};
+
+// Grows the filesystem mounted from partition partno of disk to fill the
+// partition's size bytes, online and through the filesystem's own ioctl
+// rather than resize2fs or xfs_growfs. ext2, ext3 and ext4 (as long as the
+// ext4 driver mounted them) and XFS are supported. Returns CGPT_NOOP if the
+// filesystem already fills the partition, CGPT_FAILED if it isn't mounted,
+// isn't supported or refused to grow.
+int GrowFilesystem(dev_t disk, uint32_t partno, uint64_t size,
+                   struct grown_fs *fs);
+
+#endif  // CGPT_FS_GROW_H_
@@ -0,0 +1,295 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "discard.h"
+#include "kernel_sync.h"
+#include "uevent_wait.h"
+#include "vboot_host.h"
+
+// sysfs gives partition offsets and sizes in these, whatever the disk uses.
+#define SYSFS_SECTOR_BYTES 512
+
+// A partition as the kernel currently has it.
+struct kernel_part {
+  int partno;
+  uint64_t start;   // bytes
+  uint64_t size;    // bytes
+  int removed;      // deleted, so its number is free again
+  int stuck;        // should have been deleted but the kernel refused
+};
+
+int BlkpgPartition(int fd, int op, int partno, uint64_t start, uint64_t size) {
+  struct blkpg_ioctl_arg arg;
+  struct blkpg_partition part;
+
+  memset(&part, 0, sizeof(part));
+  part.pno = partno;
+  part.start = start;
+  part.length = size;
+  arg.op = op;
+  arg.flags = 0;
+  arg.datalen = sizeof(part);
+  arg.data = &part;
+
+  return ioctl(fd, BLKPG, &arg);
+}
+
+int ReadSysfsNumber(const char *dir, const char *attr, uint64_t *value) {
+  char path[PATH_MAX];
+  unsigned long long v;
+  FILE *f;
+  int r = -1;
+
+  if (snprintf(path, sizeof(path), "%s/%s", dir, attr) >= sizeof(path))
+    return -1;
+  if (!(f = fopen(path, "r")))
+    return -1;
+  if (fscanf(f, "%llu", &v) == 1) {
+    *value = v;
+    r = 0;
+  }
+  fclose(f);
+  return r;
+}
+
+// Lists the partitions the kernel knows for the disk in sysdir. Returns the
+// number found, or -1 if out of memory.
+static int ReadKernelParts(const char *sysdir, struct kernel_part **parts_out) {
+  struct kernel_part *parts = NULL, *p;
+  char partdir[PATH_MAX];
+  struct dirent *d;
+  uint64_t partno, start, size;
+  int num_parts = 0;
+  DIR *dir;
+
+  *parts_out = NULL;
+  if (!(dir = opendir(sysdir)))
+    return 0;
+
+  while ((d = readdir(dir)) != NULL) {
+    if (d->d_name[0] == '.')
+      continue;
+    if (snprintf(partdir, sizeof(partdir), "%s/%s", sysdir, d->d_name) >=
+        sizeof(partdir))
+      continue;
+    if (ReadSysfsNumber(partdir, "partition", &partno) < 0 ||
+        ReadSysfsNumber(partdir, "start", &start) < 0 ||
+        ReadSysfsNumber(partdir, "size", &size) < 0)
+      continue;
+
+    p = realloc(parts, (num_parts + 1) * sizeof(*parts));
+    if (!p) {
+      free(parts);
+      closedir(dir);
+      return -1;
+    }
+    parts = p;
+    p = &parts[num_parts++];
+    p->partno = partno;
+    p->start = start * SYSFS_SECTOR_BYTES;
+    p->size = size * SYSFS_SECTOR_BYTES;
+    p->removed = 0;
+    p->stuck = 0;
+  }
+
+  closedir(dir);
+  *parts_out = parts;
+  return num_parts;
+}
+
+int TableForKernel(struct drive *drive) {
+  GptData *gpt = &drive->gpt;
+
+  if (!CheckHeader((GptHeader *)gpt->primary_header, 0, gpt->drive_sectors,
+                   gpt->sector_bytes) &&
+      !CheckEntries((GptEntry *)gpt->primary_entries,
+                    (GptHeader *)gpt->primary_header))
+    return PRIMARY;
+  if (!CheckHeader((GptHeader *)gpt->secondary_header, 1, gpt->drive_sectors,
+                   gpt->sector_bytes) &&
+      !CheckEntries((GptEntry *)gpt->secondary_entries,
+                    (GptHeader *)gpt->secondary_header))
+    return SECONDARY;
+  return -1;
+}
+
+GptHeader *TableHeader(struct drive *drive, int table) {
+  return (GptHeader *)(table == PRIMARY ? drive->gpt.primary_header
+                                        : drive->gpt.secondary_header);
+}
+
+GptEntry *TableEntry(struct drive *drive, int table, uint32_t index) {
+  return (GptEntry *)((table == PRIMARY ? drive->gpt.primary_entries
+                                        : drive->gpt.secondary_entries) +
+                      index * TableHeader(drive, table)->size_of_entry);
+}
+
+static uint32_t TableEntries(struct drive *drive, int table) {
+  return table < 0 ? 0 : TableHeader(drive, table)->number_of_entries;
+}
+
+// Where partition partno should be according to the table, in bytes.
+// Returns 0 if the table doesn't have it.
+static int WantedPart(struct drive *drive, int table, int partno,
+                      uint64_t *start, uint64_t *size) {
+  GptEntry *entry;
+
+  if (partno < 1 || partno > TableEntries(drive, table))
+    return 0;
+  entry = TableEntry(drive, table, partno - 1);
+  if (GuidIsZero(&entry->type))
+    return 0;
+  *start = entry->starting_lba * drive->gpt.sector_bytes;
+  *size = (entry->ending_lba - entry->starting_lba + 1) *
+          drive->gpt.sector_bytes;
+  return 1;
+}
+
+static int KernelOp(struct drive *drive, int op, int partno,
+                    uint64_t start, uint64_t size) {
+  const char *what = op == BLKPG_ADD_PARTITION ? "add" :
+                     op == BLKPG_DEL_PARTITION ? "remove" : "resize";
+
+  if (BlkpgPartition(drive->fd, op, partno, start, size) == 0)
+    return CGPT_OK;
+  Error("Can't %s partition %d in the kernel: %s\n", what, partno,
+        errno == EBUSY ? "it is in use" : strerror(errno));
+  return CGPT_FAILED;
+}
+
+int SyncKernelPartitions(struct drive *drive, struct added_partitions *added) {
+  struct kernel_part *parts;
+  char sysdir[PATH_MAX];
+  struct stat stat;
+  uint64_t max_parts, start, size;
+  uint32_t max_entries;
+  int num_parts, table, i, partno;
+  int errors = 0;
+
+  if (added)
+    memset(added, 0, sizeof(*added));
+
+  if (fstat(drive->fd, &stat) == -1 || !S_ISBLK(stat.st_mode))
+    return DiscardChangedSectors(drive);
+
+  snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u",
+           major(stat.st_rdev), minor(stat.st_rdev));
+  // A partition can't have partitions of its own, and neither can disks
+  // with a single minor such as device-mapper targets.
+  if (ReadSysfsNumber(sysdir, "partition", &max_parts) == 0)
+    return DiscardChangedSectors(drive);
+  if (ReadSysfsNumber(sysdir, "ext_range", &max_parts) < 0)
+    max_parts = UINT32_MAX;
+  if (max_parts <= 1)
+    return DiscardChangedSectors(drive);
+
+  num_parts = ReadKernelParts(sysdir, &parts);
+  if (num_parts < 0) {
+    Error("Out of memory reading the kernel's partitions\n");
+    return CGPT_FAILED;
+  }
+
+  table = TableForKernel(drive);
+
+  // The kernel announces the new partitions as soon as they're added, so
+  // listen first.
+  if (added && drive->uevent_timeout_ms) {
+    added->partnos = calloc(TableEntries(drive, table) + 1,
+                            sizeof(*added->partnos));
+    if (!added->partnos) {
+      Error("Out of memory reading the kernel's partitions\n");
+      free(parts);
+      return CGPT_FAILED;
+    }
+    UeventListen(&added->uevents, stat.st_rdev);
+  }
+
+  // Drop what's gone or moved, and shrink what got smaller, first, so that
+  // nothing added or grown below overlaps a stale partition.
+  for (i = 0; i < num_parts; i++) {
+    struct kernel_part *p = &parts[i];
+
+    if (!WantedPart(drive, table, p->partno, &start, &size) ||
+        start != p->start) {
+      if (CGPT_OK != KernelOp(drive, BLKPG_DEL_PARTITION, p->partno, 0, 0)) {
+        p->stuck = 1;
+        errors++;
+        continue;
+      }
+      p->removed = 1;
+    } else if (size < p->size) {
+      if (CGPT_OK != KernelOp(drive, BLKPG_RESIZE_PARTITION, p->partno,
+                              start, size))
+        errors++;
+    }
+  }
+
+  // Nothing the kernel still has is discarded, so a partition it wouldn't
+  // let go of stays intact. New partitions appear already discarded.
+  if (!errors && CGPT_OK != DiscardChangedSectors(drive))
+    errors++;
+
+  // The kernel would ignore partitions past the minors it has for the disk.
+  max_entries = TableEntries(drive, table);
+  if (max_entries > max_parts - 1)
+    max_entries = max_parts - 1;
+  for (partno = 1; partno <= max_entries; partno++) {
+    int present = 0;
+
+    if (!WantedPart(drive, table, partno, &start, &size))
+      continue;
+    for (i = 0; i < num_parts; i++) {
+      if (parts[i].partno != partno)
+        continue;
+      present = !parts[i].removed;
+      // A partition we failed to remove keeps its number and old place.
+      if (present && !parts[i].stuck && size > parts[i].size &&
+               CGPT_OK != KernelOp(drive, BLKPG_RESIZE_PARTITION, partno,
+                                   start, size))
+        errors++;
+      break;
+    }
+    if (!present) {
+      if (CGPT_OK != KernelOp(drive, BLKPG_ADD_PARTITION, partno, start, size))
+        errors++;
+      else if (added && added->partnos)
+        added->partnos[added->count++] = partno;
+    }
+  }
+
+  free(parts);
+  if (errors) {
+    if (added)
+      WaitForAddedPartitions(added, 0);
+    return CGPT_FAILED;
+  }
+  return CGPT_OK;
+}
+
+int WaitForAddedPartitions(struct added_partitions *added, int timeout_ms) {
+  int retval = CGPT_OK;
+
+  if (!added->partnos)
+    return CGPT_OK;
+  if (timeout_ms)
+    retval = UeventWaitForPartitions(&added->uevents, added->partnos,
+                                     added->count, timeout_ms);
+  UeventClose(&added->uevents);
+  free(added->partnos);
+  memset(added, 0, sizeof(*added));
+  return retval;
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_KERNEL_SYNC_H_
+#define CGPT_KERNEL_SYNC_H_
+
+#include <linux/blkpg.h>
+#include <stdint.h>
+
+#include "cgpt.h"
+#include "uevent_wait.h"
+
+/* For building with linux headers < 3.6 */
+#ifndef BLKPG_RESIZE_PARTITION
+# define BLKPG_RESIZE_PARTITION 3
+#endif
+
+// Reads a number from attr in a sysfs directory such as /sys/dev/block/8:0.
+// Returns -1 if there isn't one.
+int ReadSysfsNumber(const char *dir, const char *attr, uint64_t *value);
+
+// Picks the copy of the table the kernel's own GPT scan would use, PRIMARY
+// or SECONDARY, or -1 if neither is valid and the kernel should see no
+// partitions at all.
+int TableForKernel(struct drive *drive);
+
+// valid_headers may be stale after the table was rewritten, so these go by
+// the copy TableForKernel picked rather than GetEntry().
+GptHeader *TableHeader(struct drive *drive, int table);
+GptEntry *TableEntry(struct drive *drive, int table, uint32_t index);
+
+// Issues one BLKPG ioctl for partition partno of the disk open on fd. op is
+// BLKPG_ADD_PARTITION, BLKPG_DEL_PARTITION or BLKPG_RESIZE_PARTITION; start
+// and size are in bytes and ignored for deletes. Returns the ioctl's result.
+int BlkpgPartition(int fd, int op, int partno, uint64_t start, uint64_t size);
+
+// The partitions SyncKernelPartitions added, to wait for once the drive is
+// unlocked.
+struct added_partitions {
+  struct uevent_wait uevents;
+  uint32_t *partnos;            // NULL if there's nothing to wait for
+  int count;
+};
+
+// Brings the kernel's partitions of a block device in line with the table
+// in memory, as DriveClose is about to leave it on disk. Only partitions
+// that were added, removed, moved or resized are touched, so the others
+// stay mounted and udev only hears about what changed. Image files, disks
+// that can't hold partitions and partitions themselves are left alone.
+// Sectors tracked by TrackDiscards are discarded in between removing and
+// adding partitions, or right away for drives the kernel doesn't partition.
+// With drive->uevent_timeout_ms set and added not NULL it listens for the
+// partitions it adds before adding them, and fills in added for
+// WaitForAddedPartitions.
+// Returns CGPT_FAILED if the kernel refused a change, e.g. because the
+// partition is in use, or discarding failed.
+int SyncKernelPartitions(struct drive *drive, struct added_partitions *added);
+
+// Waits up to timeout_ms until the partitions in added have been announced
+// and have device nodes, then frees added. udev won't handle them while the
+// disk is locked, so the caller has to unlock it first. A timeout_ms of 0
+// only frees added. Returns CGPT_FAILED if the wait timed out.
+int WaitForAddedPartitions(struct added_partitions *added, int timeout_ms);
+
+#endif  // CGPT_KERNEL_SYNC_H_
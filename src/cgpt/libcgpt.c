@@ -0,0 +1,15 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+// Globals the cgpt binary sets up in main(), with fixed values for libcgpt.
+// None of them change after load, so the library stays safe to call from
+// several threads.
+
+#include <uuid/uuid.h>
+
+#include "cgpt.h"
+
+const char* progname = "libcgpt";
+const char* command = "";
+void (*uuid_generator)(uint8_t* buffer) = uuid_generate;
@@ -0,0 +1,269 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgpt.h"
+#include "discard.h"
+#include "payload.h"
+
+#define PAYLOAD_BUFFER_SIZE (1024 * 1024)
+// Zero blocks are looked for at this granularity.
+#define PAYLOAD_ZERO_BLOCK 4096
+// BLKZEROOUT only takes whole logical sectors, which are never larger than
+// this, so zeros around the ends of such a range are written instead.
+#define PAYLOAD_ZERO_ALIGN 4096
+
+// Where the payload is being copied to.
+struct copy {
+  const char *file;
+  int src;
+  int dst;
+  uint64_t offset;      // of the payload in dst
+  int can_clone;
+  uint64_t clone_align;
+  int can_copy;         // with copy_file_range
+  char *buf;
+  struct payload_stats *stats;
+};
+
+static int IsZero(const char *buf, size_t len) {
+  return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
+
+// Shares len bytes at pos of the payload with the image. Returns -1 with
+// errno set if the filesystem can't.
+static int CloneRange(struct copy *c, uint64_t pos, uint64_t len) {
+#ifdef FICLONERANGE
+  struct file_clone_range range;
+
+  range.src_fd = c->src;
+  range.src_offset = pos;
+  range.src_length = len;
+  range.dest_offset = c->offset + pos;
+  return ioctl(c->dst, FICLONERANGE, &range);
+#else
+  errno = EOPNOTSUPP;
+  return -1;
+#endif
+}
+
+// Has the kernel copy pos..end of the payload into the image, so the
+// filesystems can share blocks on their own terms or copy on the server.
+// Returns how far it got, short of end if these files or this kernel
+// can't, leaving the rest to CopyRange, or -1 on error.
+static int64_t KernelCopy(struct copy *c, uint64_t pos, uint64_t end) {
+  loff_t in, out;
+  ssize_t n;
+
+  while (c->can_copy && pos < end) {
+    in = pos;
+    out = c->offset + pos;
+    n = copy_file_range(c->src, &in, c->dst, &out, end - pos, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno != EXDEV && errno != EOPNOTSUPP &&
+        errno != ENOSYS && errno != EINVAL) {
+      Error("Can't copy %s to the drive: %s\n", c->file, strerror(errno));
+      return -1;
+    }
+    // A payload that got shorter is reported by CopyRange.
+    if (n <= 0) {
+      c->can_copy = 0;
+      break;
+    }
+    c->stats->kernel_copied += n;
+    pos += n;
+  }
+  return pos;
+}
+
+static int WriteAll(struct copy *c, const char *data, uint64_t pos,
+                    size_t len) {
+  ssize_t n;
+
+  while (len) {
+    n = pwrite(c->dst, data, len, c->offset + pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      Error("Can't write %s to the drive: %s\n", c->file,
+            n < 0 ? strerror(errno) : "short write");
+      return CGPT_FAILED;
+    }
+    data += n;
+    pos += n;
+    len -= n;
+  }
+  return CGPT_OK;
+}
+
+// Zeroes len bytes at pos of the payload in the image.
+static int WriteZeros(struct copy *c, uint64_t pos, uint64_t len) {
+  static const char zeros[PAYLOAD_ZERO_ALIGN];
+  uint64_t start = c->offset + pos, end = start + len;
+  uint64_t first = (start + PAYLOAD_ZERO_ALIGN - 1) / PAYLOAD_ZERO_ALIGN *
+                   PAYLOAD_ZERO_ALIGN;
+  uint64_t last = end / PAYLOAD_ZERO_ALIGN * PAYLOAD_ZERO_ALIGN;
+
+  c->stats->zeroed += len;
+  if (first >= last)
+    first = last = end;
+  while (start < first) {
+    len = first - start < sizeof(zeros) ? first - start : sizeof(zeros);
+    if (CGPT_OK != WriteAll(c, zeros, start - c->offset, len))
+      return CGPT_FAILED;
+    start += len;
+  }
+  if (first < last && CGPT_OK != ZeroRange(c->dst, first, last - first))
+    return CGPT_FAILED;
+  return WriteAll(c, zeros, last - c->offset, end - last);
+}
+
+// Writes out a run of blocks of the buffer, or zeroes it if they're zeros.
+static int FlushRun(struct copy *c, const char *data, uint64_t pos,
+                    size_t len, int zero) {
+  if (zero)
+    return WriteZeros(c, pos, len);
+  c->stats->written += len;
+  return WriteAll(c, data, pos, len);
+}
+
+// Copies pos..end of the payload through the buffer, skipping zero blocks.
+static int CopyRange(struct copy *c, uint64_t pos, uint64_t end) {
+  size_t len, i, run, block;
+  ssize_t n;
+  int zero;
+
+  while (pos < end) {
+    len = end - pos < PAYLOAD_BUFFER_SIZE ? end - pos : PAYLOAD_BUFFER_SIZE;
+    n = pread(c->src, c->buf, len, pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      Error("Can't read %s: %s\n", c->file,
+            n < 0 ? strerror(errno) : "it got shorter");
+      return CGPT_FAILED;
+    }
+
+    // Group the blocks into runs of zeros and of data.
+    for (i = 0; i < n; i += run) {
+      block = n - i < PAYLOAD_ZERO_BLOCK ? n - i : PAYLOAD_ZERO_BLOCK;
+      zero = IsZero(c->buf + i, block);
+      for (run = block; i + run < n; run += block) {
+        block = n - i - run < PAYLOAD_ZERO_BLOCK ? n - i - run
+                                                 : PAYLOAD_ZERO_BLOCK;
+        if (IsZero(c->buf + i + run, block) != zero)
+          break;
+      }
+      if (CGPT_OK != FlushRun(c, c->buf + i, pos + i, run, zero))
+        return CGPT_FAILED;
+    }
+    pos += n;
+  }
+  return CGPT_OK;
+}
+
+// Gets one extent of data of the payload into the image: reflinked, else
+// copied by the kernel, else copied through the buffer.
+static int CopyData(struct copy *c, uint64_t pos, uint64_t end) {
+  uint64_t len;
+  int64_t copied;
+
+  // Reflinks work on whole filesystem blocks only.
+  if (c->can_clone && pos % c->clone_align == 0 &&
+      (c->offset + pos) % c->clone_align == 0) {
+    len = (end - pos) / c->clone_align * c->clone_align;
+    if (len && CloneRange(c, pos, len) == 0) {
+      c->stats->cloned += len;
+      pos += len;
+    } else if (len && errno != EINVAL) {
+      // Different filesystems, or one that doesn't share blocks.
+      c->can_clone = 0;
+    }
+  }
+  if ((copied = KernelCopy(c, pos, end)) < 0)
+    return CGPT_FAILED;
+  return CopyRange(c, copied, end);
+}
+
+int WritePayload(int fd, uint64_t offset, uint64_t max_bytes,
+                 const char *file, struct payload_stats *stats) {
+  struct copy c;
+  struct stat st;
+  off_t size, data, hole;
+  uint64_t pos = 0;
+  int seek_holes = 1, r = CGPT_FAILED;
+
+  memset(stats, 0, sizeof(*stats));
+  memset(&c, 0, sizeof(c));
+  c.file = file;
+  c.dst = fd;
+  c.offset = offset;
+  c.stats = stats;
+
+  if ((c.src = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+    Error("Can't open %s: %s\n", file, strerror(errno));
+    return CGPT_FAILED;
+  }
+  if ((size = lseek(c.src, 0, SEEK_END)) < 0) {
+    Error("Can't get the size of %s: %s\n", file, strerror(errno));
+    goto out;
+  }
+  stats->size = size;
+  if (size > max_bytes) {
+    Error("%s is %llu bytes, the partition only has room for %llu\n", file,
+          (unsigned long long)size, (unsigned long long)max_bytes);
+    goto out;
+  }
+  // Both only work between regular files.
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_blksize > 0) {
+    c.can_clone = 1;
+    c.clone_align = st.st_blksize;
+    c.can_copy = 1;
+  }
+  if (!(c.buf = malloc(PAYLOAD_BUFFER_SIZE))) {
+    Error("Out of memory\n");
+    goto out;
+  }
+
+  while (pos < size) {
+    // Anything the filesystem can't tell apart is data.
+    data = seek_holes ? lseek(c.src, pos, SEEK_DATA) : pos;
+    if (data < 0 && errno == ENXIO) {
+      data = size;
+    } else if (data < 0) {
+      seek_holes = 0;
+      data = pos;
+    }
+    if (data > pos) {
+      if (CGPT_OK != WriteZeros(&c, pos, data - pos))
+        goto out;
+      pos = data;
+      if (pos >= size)
+        break;
+    }
+
+    hole = seek_holes ? lseek(c.src, pos, SEEK_HOLE) : size;
+    if (hole < 0 || hole > size)
+      hole = size;
+    if (CGPT_OK != CopyData(&c, pos, hole))
+      goto out;
+    pos = hole;
+  }
+  r = CGPT_OK;
+
+out:
+  free(c.buf);
+  close(c.src);
+  return r;
+}
@@ -0,0 +1,32 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_PAYLOAD_H_
+#define CGPT_PAYLOAD_H_
+
+#include <stdint.h>
+
+// How the bytes of a payload got into the image.
+struct payload_stats {
+  uint64_t size;        // of the payload
+  uint64_t cloned;      // shared with the payload file through a reflink
+  uint64_t kernel_copied;  // copied by the kernel with copy_file_range
+  uint64_t written;     // copied through cgpt
+  uint64_t zeroed;      // holes and zero blocks, left as holes or unmapped
+};
+
+// Copies file into the drive open on fd at offset, failing if it is larger
+// than max_bytes. Data is reflinked with FICLONERANGE where both files are
+// on a filesystem that can share blocks. What can't be reflinked into an
+// image file is copied with copy_file_range, which also covers filesystems
+// that share blocks without FICLONERANGE or copy on the server, and
+// everything else is copied through a buffer. The holes of file, found
+// with SEEK_DATA and SEEK_HOLE, are never written but zeroed with
+// ZeroRange, and so are all-zero blocks the buffered copy comes across.
+// What lies past the end of file is left alone. Returns CGPT_OK or
+// CGPT_FAILED.
+int WritePayload(int fd, uint64_t offset, uint64_t max_bytes,
+                 const char *file, struct payload_stats *stats);
+
+#endif  // CGPT_PAYLOAD_H_
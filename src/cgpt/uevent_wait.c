@@ -0,0 +1,276 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgpt.h"
+#include "uevent_wait.h"
+
+// Multicast groups of NETLINK_KOBJECT_UEVENT.
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_GROUP_UDEV 2
+
+// udev prefixes its messages with a header, see libudev-monitor.c.
+#define UDEV_PREFIX "libudev"
+#define UDEV_MAGIC 0xfeedcafe
+struct udev_header {
+  char prefix[8];
+  uint32_t magic;               // big-endian
+  uint32_t header_size;
+  uint32_t properties_off;
+  uint32_t properties_len;
+};
+
+#define UEVENT_BUFFER_SIZE (16 * 1024)
+#define UEVENT_POLL_MS 10
+
+// One partition we're waiting for.
+struct pending {
+  uint32_t partno;
+  int seen;                     // got its add event
+  char node[PATH_MAX];          // /dev node, once we know its name
+};
+
+void UeventListen(struct uevent_wait *w, dev_t disk) {
+  struct sockaddr_nl addr;
+  char link[PATH_MAX];
+  const char *devices;
+  ssize_t len;
+  int on = 1, rcvbuf = 1024 * 1024;
+
+  memset(w, 0, sizeof(*w));
+  w->sock = -1;
+  snprintf(w->sysdir, sizeof(w->sysdir), "/sys/dev/block/%u:%u",
+           major(disk), minor(disk));
+
+  // /sys/dev/block/MAJ:MIN links to ../../devices/..., the DEVPATH.
+  len = readlink(w->sysdir, link, sizeof(link) - 1);
+  if (len < 0)
+    return;
+  link[len] = '\0';
+  if (!(devices = strstr(link, "/devices/")))
+    return;
+  snprintf(w->devpath, sizeof(w->devpath), "%s", devices);
+
+  w->from_udev = access("/run/udev/control", F_OK) == 0;
+  w->sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                   NETLINK_KOBJECT_UEVENT);
+  if (w->sock < 0)
+    return;
+  (void) setsockopt(w->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  (void) setsockopt(w->sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = w->from_udev ? UEVENT_GROUP_UDEV : UEVENT_GROUP_KERNEL;
+  if (bind(w->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(w->sock);
+    w->sock = -1;
+  }
+}
+
+void UeventClose(struct uevent_wait *w) {
+  if (w->sock >= 0)
+    close(w->sock);
+  w->sock = -1;
+}
+
+static int64_t NowMs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int IsBlockNode(const char *path) {
+  struct stat st;
+
+  return path[0] && stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+// Looks up the value of key in a NUL-separated list of KEY=VALUE strings.
+static const char *Property(const char *props, size_t len, const char *key) {
+  size_t keylen = strlen(key);
+  const char *p = props, *end = props + len;
+
+  while (p < end) {
+    size_t n = strnlen(p, end - p);
+
+    if (n > keylen && !strncmp(p, key, keylen) && p[keylen] == '=')
+      return p + keylen + 1;
+    p += n + 1;
+  }
+  return NULL;
+}
+
+// Reads whatever events are queued and marks the partitions they announce.
+static void ReadEvents(struct uevent_wait *w, struct pending *parts,
+                       int count) {
+  char buf[UEVENT_BUFFER_SIZE];
+  char control[CMSG_SPACE(sizeof(struct ucred))];
+  struct sockaddr_nl addr;
+  struct iovec iov = { buf, sizeof(buf) - 1 };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct ucred *cred;
+  const char *props, *action, *devpath, *devtype, *partn, *devname;
+  size_t devpath_len = strlen(w->devpath), props_len;
+  ssize_t len;
+  int i;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    len = recvmsg(w->sock, &msg, 0);
+    if (len <= 0)
+      return;
+    buf[len] = '\0';
+
+    // Only trust the kernel, and udev running as root.
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+      continue;
+    cred = (struct ucred *)CMSG_DATA(cmsg);
+    if (cred->uid != 0 || (!w->from_udev && addr.nl_pid != 0))
+      continue;
+
+    if (w->from_udev) {
+      struct udev_header *h = (struct udev_header *)buf;
+
+      if (len < sizeof(*h) || strcmp(h->prefix, UDEV_PREFIX) ||
+          be32toh(h->magic) != UDEV_MAGIC ||
+          h->properties_off + h->properties_len > len)
+        continue;
+      props = buf + h->properties_off;
+      props_len = h->properties_len;
+    } else {
+      // "ACTION@DEVPATH" and then the properties.
+      size_t n = strnlen(buf, len);
+      if (n >= len)
+        continue;
+      props = buf + n + 1;
+      props_len = len - n - 1;
+    }
+
+    action = Property(props, props_len, "ACTION");
+    devpath = Property(props, props_len, "DEVPATH");
+    devtype = Property(props, props_len, "DEVTYPE");
+    partn = Property(props, props_len, "PARTN");
+    devname = Property(props, props_len, "DEVNAME");
+    if (!action || !devpath || !devtype || !partn || !devname ||
+        (strcmp(action, "add") && strcmp(action, "change")) ||
+        strcmp(devtype, "partition") ||
+        strncmp(devpath, w->devpath, devpath_len) ||
+        devpath[devpath_len] != '/')
+      continue;
+
+    for (i = 0; i < count; i++) {
+      if (parts[i].partno != strtoul(partn, NULL, 10))
+        continue;
+      parts[i].seen = 1;
+      // The kernel's DEVNAME is relative to /dev, udev's isn't.
+      snprintf(parts[i].node, sizeof(parts[i].node), "%s%s",
+               devname[0] == '/' ? "" : "/dev/", devname);
+    }
+  }
+}
+
+// Without a socket, find the node names in sysfs and just wait for them.
+static void PollNodes(struct uevent_wait *w, struct pending *parts,
+                      int count) {
+  char path[PATH_MAX];
+  struct dirent *d;
+  unsigned long partno;
+  DIR *dir;
+  FILE *f;
+  int i;
+
+  if (!(dir = opendir(w->sysdir)))
+    return;
+  while ((d = readdir(dir)) != NULL) {
+    if (d->d_name[0] == '.')
+      continue;
+    if (snprintf(path, sizeof(path), "%s/%s/partition", w->sysdir,
+                 d->d_name) >= sizeof(path) ||
+        !(f = fopen(path, "r")))
+      continue;
+    if (fscanf(f, "%lu", &partno) == 1) {
+      for (i = 0; i < count; i++) {
+        if (parts[i].partno != partno)
+          continue;
+        parts[i].seen = 1;
+        snprintf(parts[i].node, sizeof(parts[i].node), "/dev/%s", d->d_name);
+      }
+    }
+    fclose(f);
+  }
+  closedir(dir);
+}
+
+int UeventWaitForPartitions(struct uevent_wait *w, const uint32_t *partnos,
+                            int count, int timeout_ms) {
+  struct pending *parts;
+  int64_t deadline = NowMs() + timeout_ms, left;
+  int i, waiting, r = CGPT_FAILED;
+
+  if (count <= 0)
+    return CGPT_OK;
+  if (!(parts = calloc(count, sizeof(*parts)))) {
+    Error("Out of memory waiting for partitions\n");
+    return CGPT_FAILED;
+  }
+  for (i = 0; i < count; i++)
+    parts[i].partno = partnos[i];
+
+  for (;;) {
+    if (w->sock >= 0)
+      ReadEvents(w, parts, count);
+    else
+      PollNodes(w, parts, count);
+
+    waiting = -1;
+    for (i = 0; i < count && waiting < 0; i++)
+      if (!parts[i].seen || !IsBlockNode(parts[i].node))
+        waiting = i;
+    if (waiting < 0) {
+      r = CGPT_OK;
+      break;
+    }
+
+    left = deadline - NowMs();
+    if (left <= 0) {
+      Error("Timed out waiting for the device of partition %u\n",
+            parts[waiting].partno);
+      break;
+    }
+    if (left > UEVENT_POLL_MS)
+      left = UEVENT_POLL_MS;
+    if (w->sock >= 0) {
+      struct pollfd pfd = { w->sock, POLLIN, 0 };
+      (void) poll(&pfd, 1, left);
+    } else {
+      usleep(left * 1000);
+    }
+  }
+
+  free(parts);
+  return r;
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2015 CoreOS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CGPT_UEVENT_WAIT_H_
+#define CGPT_UEVENT_WAIT_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A subscription to the uevents of one disk's partitions. When udev is
+// running we hear its events, which it only sends once it has created the
+// device node and symlinks; otherwise we hear the kernel's own and wait for
+// devtmpfs to make the node.
+struct uevent_wait {
+  int sock;                     // -1 if we can only poll /dev
+  int from_udev;
+  char sysdir[PATH_MAX];        // /sys/dev/block/MAJ:MIN of the disk
+  char devpath[PATH_MAX];       // DEVPATH of the disk in uevents
+};
+
+// Starts listening for the partitions of disk. This has to happen before
+// the kernel is told about them, or the events may be missed. Never fails:
+// without a socket UeventWaitForPartitions falls back to polling.
+void UeventListen(struct uevent_wait *w, dev_t disk);
+
+// Waits up to timeout_ms for the add events of the given partitions and for
+// their device nodes. Returns CGPT_OK once all are there, CGPT_FAILED after
+// the deadline.
+int UeventWaitForPartitions(struct uevent_wait *w, const uint32_t *partnos,
+                            int count, int timeout_ms);
+
+void UeventClose(struct uevent_wait *w);
+
+#endif  // CGPT_UEVENT_WAIT_H_
@@ -2,45 +2,250 @@
  * Use of this source code is governed by a BSD-style license that can be
  * found in the LICENSE file.
  *
- * Finds the size of an ext{2,3,4} filesystem located at the beginning of a given device.
+ * Finds the size of the filesystem located at the beginning of a given
+ * device. ext{2,3,4}, XFS, btrfs, squashfs and erofs are sized from their
+ * primary superblock; ext{2,3,4} falls back to a full libext2fs open when
+ * that superblock fails its checksum. Filesystems inside GPT partitions of
+ * a disk image can be sized directly, without attaching the image.
  */
 
 #include <stdio.h>
 #include <inttypes.h>
 #include <error.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
 #include <ext2fs/ext2fs.h>
 
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "minsize.h"
+#include "probe.h"
+#include "vboot_host.h"
+
+// Required by the cgpt helpers for error messages.
+const char* progname = "e2size";
+const char* command = "";
+
 static void usage() {
-	fprintf(stderr, "Usage: e2size <device>\n");
+	fprintf(stderr, "Usage: e2size [-v] [-m] <device>\n"
+		"       e2size [-v] [-m] -p SELECTOR <image>\n"
+		"       e2size [-v] [-m] -a <image>\n\n"
+		"Print the size in bytes of the filesystem on <device>.\n\n"
+		"Options:\n"
+		"  -v           Also print the filesystem type and block size\n"
+		"  -p SELECTOR  Size the filesystem in one GPT partition of\n"
+		"               <image>, given as a number, PARTLABEL=<label>,\n"
+		"               PARTTYPE=<type> or PARTUUID=<guid>\n"
+		"  -a           Size the filesystem in every GPT partition of\n"
+		"               <image>, one \"NUMBER SIZE\" line each\n"
+		"  -m, --min    Print \"SIZE USED MIN\" instead, where MIN is\n"
+		"               the estimated size ext2/3/4 can be shrunk to\n");
 }
 
-int main(int argc, char *argv[]) {
-	ext2_filsys fs;
+static const struct option long_options[] = {
+	{"min", no_argument, NULL, 'm'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+/* Opens the filesystem at a byte offset through the unix I/O manager's
+ * offset option, so partitions inside images need no loop device. */
+static int ext2_full_size(const char *device, uint64_t offset,
+			  struct fs_info *info) {
+	ext2_filsys fs = NULL;
 	errcode_t err;
-	uint64_t fs_size = 0;
-	int retc = 1;
+	char io_options[32];
+
+	snprintf(io_options, sizeof(io_options), "offset=%" PRIu64, offset);
+
+	initialize_ext2_error_table();
+	err = ext2fs_open2(device, offset ? io_options : NULL, 0, 0, 0,
+			   unix_io_manager, &fs);
+
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", device, error_message(err));
+		return -1;
+	}
+
+	info->block_size = fs->blocksize;
+	info->size = ext2fs_blocks_count(fs->super) * fs->blocksize;
+
+	ext2fs_close(fs);
+	return 0;
+}
+
+/* Returns 0 if the filesystem was sized, 1 if there is none we know of
+ * and -1 on error. Only errors are reported when quiet is set. */
+static int fs_size(int fd, const char *device, uint64_t offset, int quiet,
+		   struct fs_info *info) {
+	switch (probe_fs(fd, offset, info)) {
+	case PROBE_OK:
+		return 0;
+	case PROBE_BAD_CSUM:
+		if (!strncmp(info->type, "ext", 3) &&
+		    ext2_full_size(device, offset, info) == 0)
+			return 0;
+		fprintf(stderr, "%s: %s superblock checksum mismatch\n",
+			device, info->type);
+		return -1;
+	case PROBE_UNKNOWN:
+		if (!quiet)
+			fprintf(stderr, "%s: no supported filesystem found\n",
+				device);
+		return 1;
+	default:
+		fprintf(stderr, "%s: %s\n", device, strerror(errno));
+		return -1;
+	}
+}
+
+/* Prints the size, or with min set "SIZE USED MIN", prefixed with the
+ * partition number when it isn't zero. */
+static int print_size(const char *device, uint64_t offset,
+		      const struct fs_info *info, uint32_t number,
+		      int verbose, int min) {
+	struct fs_usage usage;
+
+	if (min) {
+		if (strncmp(info->type, "ext", 3)) {
+			fprintf(stderr, "%s: can't estimate the minimum size "
+				"of %s\n", device, info->type);
+			return -1;
+		}
+		if (ext2_min_size(device, offset, &usage) < 0)
+			return -1;
+	}
+
+	if (number)
+		printf("%u ", number);
+	if (verbose)
+		printf("%s ", info->type);
+	if (min)
+		printf("%" PRIu64 " %" PRIu64 " %" PRIu64,
+		       usage.size, usage.used, usage.min);
+	else
+		printf("%" PRIu64, info->size);
+	if (verbose)
+		printf(" %" PRIu32, info->block_size);
+	printf("\n");
+	return 0;
+}
+
+static int partition_sizes(const char *image, const char *selector,
+			   int verbose, int min) {
+	struct partition_selector sel;
+	struct drive drive;
+	struct fs_info info;
+	uint32_t index, i, count;
+	uint64_t offset;
+	int gpt_retval, rc, retc = 1;
+
+	if (selector && ParsePartitionSelector(selector, &sel) != CGPT_OK)
+		return 1;
+
+	if (DriveOpen(image, &drive, 0, O_RDONLY) != CGPT_OK)
+		return 1;
 
-	if (argc != 2) {
+	gpt_retval = GptSanityCheck(&drive.gpt);
+	if (gpt_retval != GPT_SUCCESS) {
+		fprintf(stderr, "%s: invalid GPT: %s\n",
+			image, GptError(gpt_retval));
+		goto out;
+	}
+
+	if (selector) {
+		if (SelectPartition(&drive, &sel, &index) != CGPT_OK)
+			goto out;
+		i = index;
+		count = index + 1;
+	} else {
+		i = 0;
+		count = GetNumberOfEntries(&drive);
+	}
+
+	retc = 0;
+	for (; i < count; i++) {
+		GptEntry *entry = GetEntry(&drive.gpt, ANY_VALID, i);
+
+		if (GuidIsZero(&entry->type))
+			continue;
+
+		offset = entry->starting_lba * drive.gpt.sector_bytes;
+		rc = fs_size(drive.fd, image, offset, !selector, &info);
+		if (rc < 0 || (rc > 0 && selector)) {
+			retc = 1;
+			continue;
+		}
+		if (rc > 0)
+			continue;
+
+		if (print_size(image, offset, &info, selector ? 0 : i + 1,
+			       verbose, min) < 0)
+			retc = 1;
+	}
+
+out:
+	DriveRelease(&drive);
+	return retc;
+}
+
+int main(int argc, char *argv[]) {
+	struct fs_info info;
+	const char *device, *selector = NULL;
+	int fd = -1, verbose = 0, all = 0, min = 0, retc = 1, c;
+
+	while ((c = getopt_long(argc, argv, "ahmp:v", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			min = 1;
+			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'p':
+			selector = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			goto out;
+		}
+	}
+
+	if (argc - optind != 1 || (all && selector)) {
 		usage();
 		goto out;
 	}
+	device = argv[optind];
 
-	err = ext2fs_open(argv[1], 0, 0, 0, unix_io_manager, &fs);
+	if (all || selector)
+		return partition_sizes(device, selector, verbose, min);
 
-	if (err != 0) {
-		fprintf(stderr, "%s\n", strerror(errno));
+	fd = open(device, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", device, strerror(errno));
 		goto out;
 	}
 
-	fs_size = ext2fs_blocks_count(fs->super) * fs->blocksize;
+	if (fs_size(fd, device, 0, 0, &info) != 0)
+		goto out;
 
-	printf("%" PRIu64 "\n", fs_size);
+	if (print_size(device, 0, &info, 0, verbose, min) < 0)
+		goto out;
 
 	retc = 0;
 
 out:
-	if ( fs != NULL ) {
-		ext2fs_close(fs);
+	if (fd >= 0) {
+		close(fd);
 	}
 	return retc;
 }
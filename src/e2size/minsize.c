@@ -0,0 +1,304 @@
+/* Copyright (c) 2015 The CoreOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Estimates the minimum size an ext{2,3,4} filesystem can be shrunk to,
+ * worked out the way resize2fs -P does so that resize2fs accepts it:
+ * enough block groups to hold every used inode, enough data blocks outside
+ * of per-group metadata to hold everything currently allocated, the
+ * metadata of the whole last flex group, and room for extent trees to
+ * grow while blocks move. The bitmaps are read and counted in parallel.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ext2fs/ext2fs.h>
+
+#include "minsize.h"
+
+/* resize2fs refuses to leave a last group with fewer data blocks. */
+#define MIN_LAST_GROUP_DATA	50
+/* resize2fs keeps at most this fraction of the blocks it frees as room
+ * for new extent tree blocks. */
+#define EXTENT_MARGIN_DIVISOR	500
+
+struct group_scan {
+	ext2_filsys fs;
+	dgrp_t first, last;	/* groups [first, last) */
+	uint64_t used_blocks;
+	uint64_t used_inodes;
+	uint64_t overhead;
+	errcode_t err;
+};
+
+static uint64_t count_bits(const uint8_t *buf, uint64_t bits) {
+	uint64_t n = 0, i;
+
+	for (i = 0; i < bits / 8; i++)
+		n += __builtin_popcount(buf[i]);
+	if (bits % 8)
+		n += __builtin_popcount(buf[i] & ((1 << (bits % 8)) - 1));
+	return n;
+}
+
+/* Blocks taken by the superblock, descriptors, bitmaps and inode table of
+ * a group, wherever flex_bg may have placed them. */
+static uint64_t group_overhead(ext2_filsys fs, dgrp_t group) {
+	uint64_t overhead = 2 + fs->inode_blocks_per_group;
+
+	if (ext2fs_bg_has_super(fs, group))
+		overhead += 1 + fs->desc_blocks +
+			    fs->super->s_reserved_gdt_blocks;
+	return overhead;
+}
+
+static void *scan_groups(void *arg) {
+	struct group_scan *scan = arg;
+	ext2_filsys fs = scan->fs;
+	uint32_t bpg = EXT2_BLOCKS_PER_GROUP(fs->super);
+	uint32_t ipg = EXT2_INODES_PER_GROUP(fs->super);
+	uint8_t *buf;
+	dgrp_t g;
+
+	buf = malloc((bpg > ipg ? bpg : ipg) / 8 + 1);
+	if (!buf) {
+		scan->err = EXT2_ET_NO_MEMORY;
+		return NULL;
+	}
+
+	for (g = scan->first; g < scan->last; g++) {
+		blk64_t first = ext2fs_group_first_block2(fs, g);
+		blk64_t num = ext2fs_group_last_block2(fs, g) - first + 1;
+
+		memset(buf, 0, num / 8 + 1);
+		scan->err = ext2fs_get_block_bitmap_range2(fs->block_map,
+							   first, num, buf);
+		if (scan->err)
+			break;
+		scan->used_blocks += count_bits(buf, num);
+		scan->overhead += group_overhead(fs, g);
+
+		if (ext2fs_bg_flags_test(fs, g, EXT2_BG_INODE_UNINIT))
+			continue;
+		memset(buf, 0, ipg / 8 + 1);
+		scan->err = ext2fs_get_inode_bitmap_range2(fs->inode_map,
+							   (uint64_t)g * ipg + 1,
+							   ipg, buf);
+		if (scan->err)
+			break;
+		scan->used_inodes += count_bits(buf, ipg);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* With flex_bg the metadata of a group may live anywhere in its flex
+ * group, so resize2fs keeps room for all of the flex group that holds
+ * the last of the given groups. */
+static dgrp_t flex_end(ext2_filsys fs, dgrp_t groups, dgrp_t flexbg_size) {
+	if (flexbg_size == 1)
+		return groups;
+	groups += flexbg_size - (groups & (flexbg_size - 1));
+	return groups < fs->group_desc_count ? groups : fs->group_desc_count;
+}
+
+/* Smallest block count whose groups hold data_needed blocks outside of
+ * their metadata and used_inodes in their inode tables, as computed by
+ * calculate_minimum_resize_size() in resize2fs. */
+static blk64_t min_blocks(ext2_filsys fs, uint64_t data_needed,
+			  uint64_t used_inodes) {
+	uint32_t bpg = EXT2_BLOCKS_PER_GROUP(fs->super);
+	uint32_t ipg = EXT2_INODES_PER_GROUP(fs->super);
+	uint64_t data_blocks, last_start = 0, overhead, margin, worst;
+	uint64_t extents_per_block;
+	dgrp_t flexbg_size = 1, groups, flex_groups, g;
+	blk64_t blocks, table_end;
+
+	if (ext2fs_has_feature_flex_bg(fs->super))
+		flexbg_size = 1U << fs->super->s_log_groups_per_flex;
+
+	groups = (used_inodes + ipg - 1) / ipg;
+	if (groups < 1)
+		groups = 1;
+	flex_groups = flex_end(fs, groups, flexbg_size);
+
+	/* Data blocks in the groups the inodes need, and how many of them
+	 * come before the last group. */
+	data_blocks = (uint64_t)groups * bpg;
+	for (g = 0; g < flex_groups; g++) {
+		overhead = group_overhead(fs, g);
+		if (g + 1 < groups)
+			last_start += bpg - overhead;
+		data_blocks = data_blocks > overhead ?
+			      data_blocks - overhead : 0;
+	}
+
+	/* Add groups until the data fits. */
+	while (data_needed > data_blocks) {
+		dgrp_t extra = (data_needed - data_blocks + bpg - 1) / bpg;
+
+		data_blocks += (uint64_t)extra * bpg;
+		last_start += bpg - group_overhead(fs, groups - 1);
+
+		g = flex_groups;
+		groups += extra;
+		if (groups > fs->group_desc_count)
+			return ext2fs_blocks_count(fs->super);
+		if (groups > flex_groups)
+			flex_groups = flex_end(fs, groups, flexbg_size);
+
+		for (; g < flex_groups; g++) {
+			overhead = group_overhead(fs, g);
+			if (g + 1 < groups)
+				last_start += bpg - overhead;
+			data_blocks = data_blocks > overhead ?
+				      data_blocks - overhead : 0;
+		}
+	}
+
+	/* The last group holds the metadata of the rest of its flex group,
+	 * or of the first flex group entirely, and whatever data is left. */
+	g = groups - 1;
+	if (g < flexbg_size)
+		g = 0;
+	for (overhead = 0; g < flex_groups; g++)
+		overhead += group_overhead(fs, g);
+	if (last_start < data_needed &&
+	    data_needed - last_start > MIN_LAST_GROUP_DATA)
+		overhead += data_needed - last_start;
+	else
+		overhead += MIN_LAST_GROUP_DATA;
+
+	blocks = fs->super->s_first_data_block +
+		 (blk64_t)(groups - 1) * bpg + overhead;
+	table_end = ext2fs_inode_table_loc(fs, groups - 1) +
+		    fs->inode_blocks_per_group;
+	if (blocks < table_end)
+		blocks = table_end;
+	if (blocks >= ext2fs_blocks_count(fs->super))
+		return ext2fs_blocks_count(fs->super);
+
+	/* Moving a block may split an extent, at worst one per block or
+	 * one extent block per inode. */
+	if (ext2fs_has_feature_extents(fs->super)) {
+		extents_per_block = fs->blocksize /
+				    sizeof(struct ext3_extent) - 1;
+		margin = (ext2fs_blocks_count(fs->super) - blocks) /
+			 EXTENT_MARGIN_DIVISOR;
+		worst = (data_needed + extents_per_block - 1) /
+			extents_per_block;
+		if (worst < used_inodes)
+			worst = used_inodes;
+		blocks += margin < worst ? margin : worst;
+	}
+
+	return blocks;
+}
+
+int ext2_min_size(const char *device, uint64_t offset, struct fs_usage *usage) {
+	ext2_filsys fs = NULL;
+	struct group_scan *scans = NULL;
+	pthread_t *threads = NULL;
+	uint64_t used_blocks, used_inodes = 0, overhead = 0, data;
+	blk64_t blocks;
+	char io_options[32];
+	errcode_t err;
+	long nthreads, started = 0, i;
+	int retc = -1;
+
+	snprintf(io_options, sizeof(io_options), "offset=%" PRIu64, offset);
+
+	/* Threads are only used for reading the bitmaps if the filesystem
+	 * is opened with EXT2_FLAG_THREADS. */
+	initialize_ext2_error_table();
+	err = ext2fs_open2(device, offset ? io_options : NULL,
+			   EXT2_FLAG_64BITS | EXT2_FLAG_THREADS, 0, 0,
+			   unix_io_manager, &fs);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", device, error_message(err));
+		return -1;
+	}
+
+	if (ext2fs_has_feature_bigalloc(fs->super)) {
+		fprintf(stderr, "%s: bigalloc filesystems are not supported\n",
+			device);
+		goto out;
+	}
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > fs->group_desc_count)
+		nthreads = fs->group_desc_count;
+
+	/* The default rbtree bitmaps keep a lookup cursor that is updated
+	 * on every read, so only flat bitmaps can be shared by threads.
+	 * libext2fs reads them with a thread per range of groups too. */
+	fs->default_bitmap_type = EXT2FS_BMAP64_BITARRAY;
+	err = ext2fs_rw_bitmaps(fs, EXT2_BITMAPS_BLOCK | EXT2_BITMAPS_INODE,
+				nthreads);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", device, error_message(err));
+		goto out;
+	}
+
+	scans = calloc(nthreads, sizeof(*scans));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!scans || !threads) {
+		fprintf(stderr, "%s: %s\n", device,
+			error_message(EXT2_ET_NO_MEMORY));
+		goto out;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		scans[i].fs = fs;
+		scans[i].first = (uint64_t)fs->group_desc_count * i / nthreads;
+		scans[i].last = (uint64_t)fs->group_desc_count * (i + 1) /
+				nthreads;
+	}
+
+	/* Scan with as many threads as start, and the rest inline. */
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, scan_groups,
+				   &scans[started]))
+			break;
+	for (i = started; i < nthreads; i++)
+		scan_groups(&scans[i]);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	/* The boot block of 1K block filesystems is in no group. */
+	used_blocks = fs->super->s_first_data_block;
+	for (i = 0; i < nthreads; i++) {
+		if (scans[i].err) {
+			fprintf(stderr, "%s: %s\n", device,
+				error_message(scans[i].err));
+			goto out;
+		}
+		used_blocks += scans[i].used_blocks;
+		used_inodes += scans[i].used_inodes;
+		overhead += scans[i].overhead;
+	}
+
+	data = used_blocks > overhead ? used_blocks - overhead : 0;
+
+	blocks = ext2fs_blocks_count(fs->super);
+	usage->size = blocks * fs->blocksize;
+	usage->used = used_blocks * fs->blocksize;
+	usage->min = min_blocks(fs, data, used_inodes) * fs->blocksize;
+	if (usage->min > usage->size)
+		usage->min = usage->size;
+
+	retc = 0;
+
+out:
+	free(scans);
+	free(threads);
+	ext2fs_close(fs);
+	return retc;
+}
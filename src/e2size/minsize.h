@@ -0,0 +1,30 @@
+/* Copyright (c) 2015 The CoreOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Minimum shrink size estimation for ext{2,3,4} filesystems.
+ */
+#ifndef E2SIZE_MINSIZE_H_
+#define E2SIZE_MINSIZE_H_
+
+#include <stdint.h>
+
+struct fs_usage {
+	uint64_t size;		/* current size in bytes */
+	uint64_t used;		/* bytes in allocated blocks */
+	uint64_t min;		/* smallest size the filesystem can shrink to */
+};
+
+/**
+ * ext2_min_size: estimate how far the filesystem can be shrunk
+ * @device: path of the device or image holding the filesystem
+ * @offset: byte offset of the filesystem within @device
+ * @usage: filled in on success
+ *
+ * Reads the block and inode bitmaps and counts allocations with one thread
+ * per CPU, each covering a range of block groups. Returns 0 on success or
+ * -1 after printing an error.
+ */
+int ext2_min_size(const char *device, uint64_t offset, struct fs_usage *usage);
+
+#endif  /* E2SIZE_MINSIZE_H_ */
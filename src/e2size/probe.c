@@ -0,0 +1,324 @@
+/* Copyright (c) 2015 The CoreOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Reads just enough of a filesystem's primary superblock to report its
+ * size, so large filesystems can be sized without loading any group
+ * descriptors or allocation metadata.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "probe.h"
+
+/* CRC32C (Castagnoli), reflected. Callers pick the seed and whether to
+ * invert the result, since every filesystem does it differently. */
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void) {
+	uint32_t i, j, crc;
+
+	if (crc32c_table[1])
+		return;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len) {
+	crc32c_init();
+	while (len--)
+		crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static uint16_t le16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const uint8_t *p) {
+	return le16(p) | (uint32_t)le16(p + 2) << 16;
+}
+
+static uint64_t le64(const uint8_t *p) {
+	return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static uint16_t be16(const uint8_t *p) {
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const uint8_t *p) {
+	return (uint32_t)be16(p) << 16 | be16(p + 2);
+}
+
+static uint64_t be64(const uint8_t *p) {
+	return (uint64_t)be32(p) << 32 | be32(p + 4);
+}
+
+/* Returns 0 on success, 1 if the device is too short, -1 on error. */
+static int read_at(int fd, uint64_t offset, uint8_t *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return 1;
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* ext2/3/4: 1024 byte superblock, 1024 bytes in. */
+#define EXT_SB_OFFSET		1024
+#define EXT_SB_SIZE		1024
+#define EXT_MAGIC		0xEF53
+#define EXT_COMPAT_HAS_JOURNAL	0x0004
+#define EXT_INCOMPAT_EXT4	(0x0040 | 0x0080 | 0x0200)  /* extents, 64bit, flex_bg */
+#define EXT_INCOMPAT_64BIT	0x0080
+#define EXT_RO_COMPAT_EXT4	(0x0008 | 0x0010 | 0x0020 | 0x0040 | 0x0400)
+#define EXT_RO_COMPAT_CSUM	0x0400  /* metadata_csum */
+
+static enum probe_result probe_ext(int fd, uint64_t offset,
+				   struct fs_info *info) {
+	uint8_t sb[EXT_SB_SIZE];
+	uint32_t compat, incompat, ro_compat, log_bs;
+	uint64_t blocks;
+	int rc;
+
+	rc = read_at(fd, offset + EXT_SB_OFFSET, sb, sizeof(sb));
+	if (rc)
+		return rc < 0 ? PROBE_IO_ERROR : PROBE_UNKNOWN;
+
+	if (le16(sb + 0x38) != EXT_MAGIC)
+		return PROBE_UNKNOWN;
+
+	log_bs = le32(sb + 0x18);
+	if (log_bs > 6)
+		return PROBE_UNKNOWN;
+
+	compat = le32(sb + 0x5C);
+	incompat = le32(sb + 0x60);
+	ro_compat = le32(sb + 0x64);
+
+	blocks = le32(sb + 0x04);
+	if (incompat & EXT_INCOMPAT_64BIT)
+		blocks |= (uint64_t)le32(sb + 0x150) << 32;
+
+	if ((incompat & EXT_INCOMPAT_EXT4) || (ro_compat & EXT_RO_COMPAT_EXT4))
+		info->type = "ext4";
+	else if (compat & EXT_COMPAT_HAS_JOURNAL)
+		info->type = "ext3";
+	else
+		info->type = "ext2";
+	info->block_size = 1024 << log_bs;
+	info->size = blocks * info->block_size;
+
+	/* The checksum covers everything before it and is not inverted. */
+	if ((ro_compat & EXT_RO_COMPAT_CSUM) &&
+	    crc32c(~0U, sb, 0x3FC) != le32(sb + 0x3FC))
+		return PROBE_BAD_CSUM;
+
+	return PROBE_OK;
+}
+
+/* XFS: big endian superblock in the first sector. */
+#define XFS_MAGIC		"XFSB"
+#define XFS_CRC_OFFSET		224
+#define XFS_MAX_SECTSIZE	32768
+
+static enum probe_result probe_xfs(int fd, uint64_t offset,
+				   struct fs_info *info) {
+	static const uint8_t zero[4];
+	uint8_t head[512], *sb;
+	uint32_t sectsize, crc;
+	enum probe_result ret = PROBE_OK;
+	int rc;
+
+	rc = read_at(fd, offset, head, sizeof(head));
+	if (rc)
+		return rc < 0 ? PROBE_IO_ERROR : PROBE_UNKNOWN;
+
+	if (memcmp(head, XFS_MAGIC, 4))
+		return PROBE_UNKNOWN;
+
+	info->type = "xfs";
+	info->block_size = be32(head + 4);
+	info->size = be64(head + 8) * info->block_size;
+
+	/* Only version 5 superblocks carry a checksum. */
+	if ((be16(head + 100) & 0xf) != 5)
+		return PROBE_OK;
+
+	sectsize = be16(head + 102);
+	if (sectsize < sizeof(head) || sectsize > XFS_MAX_SECTSIZE)
+		return PROBE_BAD_CSUM;
+
+	sb = malloc(sectsize);
+	if (!sb)
+		return PROBE_IO_ERROR;
+	rc = read_at(fd, offset, sb, sectsize);
+	if (rc) {
+		free(sb);
+		return rc < 0 ? PROBE_IO_ERROR : PROBE_BAD_CSUM;
+	}
+
+	/* The checksum is computed with its own field treated as zero. */
+	crc = crc32c(~0U, sb, XFS_CRC_OFFSET);
+	crc = crc32c(crc, zero, sizeof(zero));
+	crc = crc32c(crc, sb + XFS_CRC_OFFSET + 4,
+		     sectsize - XFS_CRC_OFFSET - 4);
+	if (~crc != le32(sb + XFS_CRC_OFFSET))
+		ret = PROBE_BAD_CSUM;
+
+	free(sb);
+	return ret;
+}
+
+/* btrfs: 4K superblock at 64K. */
+#define BTRFS_SB_OFFSET		0x10000
+#define BTRFS_SB_SIZE		0x1000
+#define BTRFS_MAGIC		"_BHRfS_M"
+#define BTRFS_CSUM_CRC32C	0
+
+static enum probe_result probe_btrfs(int fd, uint64_t offset,
+				     struct fs_info *info) {
+	uint8_t sb[BTRFS_SB_SIZE];
+	uint32_t crc;
+	int rc;
+
+	rc = read_at(fd, offset + BTRFS_SB_OFFSET, sb, sizeof(sb));
+	if (rc)
+		return rc < 0 ? PROBE_IO_ERROR : PROBE_UNKNOWN;
+
+	if (memcmp(sb + 0x40, BTRFS_MAGIC, 8))
+		return PROBE_UNKNOWN;
+
+	/* Report this device's size, not the sum over the whole pool. */
+	info->type = "btrfs";
+	info->block_size = le32(sb + 0x90);
+	info->size = le64(sb + 0xD1);
+
+	/* Other checksum algorithms are left to btrfs itself. */
+	if (le16(sb + 0xC4) != BTRFS_CSUM_CRC32C)
+		return PROBE_OK;
+
+	crc = ~crc32c(~0U, sb + 0x20, sizeof(sb) - 0x20);
+	if (crc != le32(sb))
+		return PROBE_BAD_CSUM;
+
+	return PROBE_OK;
+}
+
+/* squashfs: little endian superblock at 0, no checksum. */
+#define SQUASHFS_MAGIC		0x73717368
+
+static enum probe_result probe_squashfs(int fd, uint64_t offset,
+					struct fs_info *info) {
+	uint8_t sb[96];
+	int rc;
+
+	rc = read_at(fd, offset, sb, sizeof(sb));
+	if (rc)
+		return rc < 0 ? PROBE_IO_ERROR : PROBE_UNKNOWN;
+
+	if (le32(sb) != SQUASHFS_MAGIC)
+		return PROBE_UNKNOWN;
+
+	info->type = "squashfs";
+	info->block_size = le32(sb + 12);
+	info->size = le64(sb + 40);
+	return PROBE_OK;
+}
+
+/* erofs: superblock at 1024, checksummed up to the end of the block. */
+#define EROFS_SB_OFFSET		1024
+#define EROFS_MAGIC		0xE0F5E1E2
+#define EROFS_COMPAT_SB_CHKSUM	0x0001
+
+static enum probe_result probe_erofs(int fd, uint64_t offset,
+				     struct fs_info *info) {
+	static const uint8_t zero[4];
+	uint8_t head[128], *sb;
+	uint32_t bits, len, crc;
+	enum probe_result ret = PROBE_OK;
+	int rc;
+
+	rc = read_at(fd, offset + EROFS_SB_OFFSET, head, sizeof(head));
+	if (rc)
+		return rc < 0 ? PROBE_IO_ERROR : PROBE_UNKNOWN;
+
+	if (le32(head) != EROFS_MAGIC)
+		return PROBE_UNKNOWN;
+
+	bits = head[12];
+	if (bits < 9 || bits > 16)
+		return PROBE_UNKNOWN;
+
+	info->type = "erofs";
+	info->block_size = 1 << bits;
+	info->size = (uint64_t)le32(head + 36) << bits;
+
+	if (!(le32(head + 8) & EROFS_COMPAT_SB_CHKSUM))
+		return PROBE_OK;
+
+	len = info->block_size;
+	if (len > EROFS_SB_OFFSET)
+		len -= EROFS_SB_OFFSET;
+	if (len < sizeof(head))
+		return PROBE_BAD_CSUM;
+
+	sb = malloc(len);
+	if (!sb)
+		return PROBE_IO_ERROR;
+	rc = read_at(fd, offset + EROFS_SB_OFFSET, sb, len);
+	if (rc) {
+		free(sb);
+		return rc < 0 ? PROBE_IO_ERROR : PROBE_BAD_CSUM;
+	}
+
+	/* Like ext4, seeded with ~0 and not inverted. */
+	crc = crc32c(~0U, sb, 4);
+	crc = crc32c(crc, zero, sizeof(zero));
+	crc = crc32c(crc, sb + 8, len - 8);
+	if (crc != le32(sb + 4))
+		ret = PROBE_BAD_CSUM;
+
+	free(sb);
+	return ret;
+}
+
+enum probe_result probe_fs(int fd, uint64_t offset, struct fs_info *info) {
+	static enum probe_result (*const probes[])(int, uint64_t,
+						    struct fs_info *) = {
+		probe_ext,
+		probe_xfs,
+		probe_squashfs,
+		probe_erofs,
+		probe_btrfs,
+	};
+	enum probe_result ret;
+	size_t i;
+
+	for (i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+		memset(info, 0, sizeof(*info));
+		ret = probes[i](fd, offset, info);
+		if (ret != PROBE_UNKNOWN)
+			return ret;
+	}
+
+	return PROBE_UNKNOWN;
+}
@@ -0,0 +1,36 @@
+/* Copyright (c) 2015 The CoreOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Filesystem size detection from the primary superblock alone.
+ */
+#ifndef E2SIZE_PROBE_H_
+#define E2SIZE_PROBE_H_
+
+#include <stdint.h>
+
+struct fs_info {
+	const char *type;	/* "ext4", "xfs", "btrfs", ... */
+	uint64_t size;		/* filesystem size in bytes */
+	uint32_t block_size;	/* in bytes */
+};
+
+enum probe_result {
+	PROBE_OK = 0,
+	PROBE_UNKNOWN,		/* no supported superblock found */
+	PROBE_BAD_CSUM,		/* superblock found, checksum mismatch */
+	PROBE_IO_ERROR,		/* see errno */
+};
+
+/**
+ * probe_fs: identify the filesystem starting at @offset bytes into @fd
+ * @fd: file descriptor open for reading
+ * @offset: byte offset of the start of the filesystem
+ * @info: filled in when PROBE_OK or PROBE_BAD_CSUM is returned
+ *
+ * Only the primary superblock is read. ext2/3/4, XFS, btrfs, squashfs and
+ * erofs are recognised.
+ */
+enum probe_result probe_fs(int fd, uint64_t offset, struct fs_info *info);
+
+#endif  /* E2SIZE_PROBE_H_ */
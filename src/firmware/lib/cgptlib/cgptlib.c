@@ -14,11 +14,14 @@
 
 int GptInit(GptData *gpt)
 {
+	static Guid chromeos_kernel = GPT_ENT_TYPE_CHROMEOS_KERNEL;
 	int retval;
 
 	gpt->modified = 0;
 	gpt->current_kernel = CGPT_KERNEL_ENTRY_NOT_FOUND;
 	gpt->current_priority = 999;
+	gpt->kernels.total = 0;
+	gpt->kernels_tried = 0;
 
 	retval = GptSanityCheck(gpt);
 	if (GPT_SUCCESS != retval) {
@@ -26,86 +29,44 @@ int GptInit(GptData *gpt)
 		return retval;
 	}
 
-	return GptRepair(gpt);
+	retval = GptRepair(gpt);
+	if (GPT_SUCCESS != retval)
+		return retval;
+
+	/*
+	 * Sort the bootable kernels by priority once, so each call to
+	 * GptNextKernelEntry() only has to take the next one.
+	 */
+	BucketEntriesByPriority((GptHeader *)gpt->primary_header,
+				(GptEntry *)gpt->primary_entries,
+				&chromeos_kernel, 1, &gpt->kernels);
+	return GPT_SUCCESS;
 }
 
 int GptNextKernelEntry(GptData *gpt, uint64_t *start_sector, uint64_t *size)
 {
-	GptHeader *header = (GptHeader *)gpt->primary_header;
+	GptPriorityBuckets *kernels = &gpt->kernels;
 	GptEntry *entries = (GptEntry *)gpt->primary_entries;
 	GptEntry *e;
-	int new_kernel = CGPT_KERNEL_ENTRY_NOT_FOUND;
-	int new_prio = 0;
-	uint32_t i;
-
-	/*
-	 * If we already found a kernel, continue the scan at the current
-	 * kernel's priority, in case there is another kernel with the same
-	 * priority.
-	 */
-	if (gpt->current_kernel != CGPT_KERNEL_ENTRY_NOT_FOUND) {
-		for (i = gpt->current_kernel + 1;
-		     i < header->number_of_entries; i++) {
-			e = entries + i;
-			if (!IsKernelEntry(e))
-				continue;
-			VBDEBUG(("GptNextKernelEntry looking at same prio "
-				 "partition %d\n", i+1));
-			VBDEBUG(("GptNextKernelEntry s%d t%d p%d\n",
-				 GetEntrySuccessful(e), GetEntryTries(e),
-				 GetEntryPriority(e)));
-			if (!(GetEntrySuccessful(e) || GetEntryTries(e)))
-				continue;
-			if (GetEntryPriority(e) == gpt->current_priority) {
-				gpt->current_kernel = i;
-				*start_sector = e->starting_lba;
-				*size = e->ending_lba - e->starting_lba + 1;
-				VBDEBUG(("GptNextKernelEntry likes it\n"));
-				return GPT_SUCCESS;
-			}
-		}
-	}
-
-	/*
-	 * We're still here, so scan for the remaining kernel with the highest
-	 * priority less than the previous attempt.
-	 */
-	for (i = 0, e = entries; i < header->number_of_entries; i++, e++) {
-		int current_prio = GetEntryPriority(e);
-		if (!IsKernelEntry(e))
-			continue;
-		VBDEBUG(("GptNextKernelEntry looking at new prio "
-			 "partition %d\n", i+1));
-		VBDEBUG(("GptNextKernelEntry s%d t%d p%d\n",
-			 GetEntrySuccessful(e), GetEntryTries(e),
-			 GetEntryPriority(e)));
-		if (!(GetEntrySuccessful(e) || GetEntryTries(e)))
-			continue;
-		if (current_prio >= gpt->current_priority) {
-			/* Already returned this kernel in a previous call */
-			continue;
-		}
-		if (current_prio > new_prio) {
-			new_kernel = i;
-			new_prio = current_prio;
-		}
-	}
-
-	/*
-	 * Save what we found.  Note that if we didn't find a new kernel,
-	 * new_prio will still be -1, so future calls to this function will
-	 * also fail.
-	 */
-	gpt->current_kernel = new_kernel;
-	gpt->current_priority = new_prio;
+	/* Priority 0 kernels sort last and are never booted. */
+	uint32_t bootable = kernels->total -
+		kernels->count[0];
 
-	if (CGPT_KERNEL_ENTRY_NOT_FOUND == new_kernel) {
+	if (gpt->kernels_tried >= bootable) {
+		gpt->current_kernel = CGPT_KERNEL_ENTRY_NOT_FOUND;
+		gpt->current_priority = 0;
 		VBDEBUG(("GptNextKernelEntry no more kernels\n"));
 		return GPT_ERROR_NO_VALID_KERNEL;
 	}
 
-	VBDEBUG(("GptNextKernelEntry likes partition %d\n", new_kernel + 1));
-	e = entries + new_kernel;
+	gpt->current_kernel = kernels->order[gpt->kernels_tried++];
+	e = entries + gpt->current_kernel;
+	gpt->current_priority = GetEntryPriority(e);
+	VBDEBUG(("GptNextKernelEntry s%d t%d p%d\n",
+		 GetEntrySuccessful(e), GetEntryTries(e),
+		 GetEntryPriority(e)));
+	VBDEBUG(("GptNextKernelEntry likes partition %d\n",
+		 gpt->current_kernel + 1));
 	*start_sector = e->starting_lba;
 	*size = e->ending_lba - e->starting_lba + 1;
 	return GPT_SUCCESS;
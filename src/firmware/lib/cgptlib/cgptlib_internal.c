@@ -14,8 +14,10 @@
 
 int CheckParameters(GptData *gpt)
 {
-	/* Currently, we only support 512-byte sectors. */
-	if (gpt->sector_bytes != 512)
+	/* Sectors must be a power of 2 from 512 to 4096 bytes. */
+	if (gpt->sector_bytes < MIN_SECTOR_BYTES ||
+	    gpt->sector_bytes > MAX_SECTOR_BYTES ||
+	    (gpt->sector_bytes & (gpt->sector_bytes - 1)))
 		return GPT_ERROR_INVALID_SECTOR_SIZE;
 
 	/*
@@ -23,7 +25,8 @@ int CheckParameters(GptData *gpt)
 	 * too small to contain basic GPT structure (PMBR + Headers + Entries),
 	 * the value is wrong.
 	 */
-	if (gpt->drive_sectors < (1 + 2 * (1 + GPT_ENTRIES_SECTORS)))
+	if (gpt->drive_sectors <
+	    (1 + 2 * (1 + GPT_ENTRIES_SECTORS(gpt->sector_bytes))))
 		return GPT_ERROR_INVALID_SECTOR_NUMBER;
 
 	return GPT_SUCCESS;
@@ -42,8 +45,18 @@ uint32_t HeaderCrc(GptHeader *h)
 	return crc32;
 }
 
-int CheckHeader(GptHeader *h, int is_secondary, uint64_t drive_sectors)
+uint32_t CalculateEntriesSectors(const GptHeader *h, uint32_t sector_bytes)
 {
+	uint64_t bytes = (uint64_t)h->number_of_entries * h->size_of_entry;
+
+	return (bytes + sector_bytes - 1) / sector_bytes;
+}
+
+int CheckHeader(GptHeader *h, int is_secondary, uint64_t drive_sectors,
+		uint32_t sector_bytes)
+{
+	uint32_t entries_sectors;
+
 	if (!h)
 		return 1;
 
@@ -79,23 +92,28 @@ int CheckHeader(GptHeader *h, int is_secondary, uint64_t drive_sectors)
 		return 1;
 	if ((h->number_of_entries < MIN_NUMBER_OF_ENTRIES) ||
 	    (h->number_of_entries > MAX_NUMBER_OF_ENTRIES) ||
-	    (h->number_of_entries * h->size_of_entry != TOTAL_ENTRIES_SIZE))
+	    (h->number_of_entries * h->size_of_entry > MAX_ENTRIES_SIZE))
+		return 1;
+	entries_sectors = CalculateEntriesSectors(h, sector_bytes);
+	if (drive_sectors < 3 + 2 * entries_sectors)
 		return 1;
 
 	/*
 	 * Check locations for the header and its entries.  The primary
-	 * immediately follows the PMBR, and is followed by its entries.  The
-	 * secondary is at the end of the drive, preceded by its entries.
+	 * immediately follows the PMBR, and its entries may be anywhere
+	 * between it and FirstUsableLBA, e.g. pushed out to an alignment
+	 * boundary.  The secondary is at the end of the drive, preceded by
+	 * its entries.
 	 */
 	if (is_secondary) {
 		if (h->my_lba != drive_sectors - 1)
 			return 1;
-		if (h->entries_lba != h->my_lba - GPT_ENTRIES_SECTORS)
+		if (h->entries_lba != h->my_lba - entries_sectors)
 			return 1;
 	} else {
 		if (h->my_lba != 1)
 			return 1;
-		if (h->entries_lba != h->my_lba + 1)
+		if (h->entries_lba < h->my_lba + 1)
 			return 1;
 	}
 
@@ -104,12 +122,15 @@ int CheckHeader(GptHeader *h, int is_secondary, uint64_t drive_sectors)
 	 * LastUsableLBA must be before the start of the secondary GPT table
 	 * array.  FirstUsableLBA <= LastUsableLBA.
 	 */
-	if (h->first_usable_lba < 2 + GPT_ENTRIES_SECTORS)
+	if (h->first_usable_lba < 2 + entries_sectors)
 		return 1;
-	if (h->last_usable_lba >= drive_sectors - 1 - GPT_ENTRIES_SECTORS)
+	if (h->last_usable_lba >= drive_sectors - 1 - entries_sectors)
 		return 1;
 	if (h->first_usable_lba > h->last_usable_lba)
 		return 1;
+	if (!is_secondary &&
+	    h->entries_lba > h->first_usable_lba - entries_sectors)
+		return 1;
 
 	/* Success */
 	return 0;
@@ -127,6 +148,134 @@ int IsKernelEntry(const GptEntry *e)
 	return !Memcmp(&e->type, &chromeos_kernel, sizeof(Guid));
 }
 
+void BucketEntriesByPriority(const GptHeader *h, const GptEntry *entries,
+			     const Guid *type, int bootable_only,
+			     GptPriorityBuckets *buckets)
+{
+	uint16_t matched[MAX_NUMBER_OF_ENTRIES];
+	uint8_t priority[MAX_NUMBER_OF_ENTRIES];
+	uint16_t next[GPT_NUM_PRIORITIES];
+	uint32_t num_entries = h->number_of_entries;
+	uint32_t i, n = 0;
+	int p;
+
+	Memset(buckets, 0, sizeof(*buckets));
+	if (num_entries > MAX_NUMBER_OF_ENTRIES)
+		num_entries = MAX_NUMBER_OF_ENTRIES;
+
+	for (i = 0; i < num_entries; i++) {
+		const GptEntry *e = entries + i;
+
+		if (Memcmp(&e->type, type, sizeof(Guid)))
+			continue;
+		if (bootable_only &&
+		    !(GetEntrySuccessful(e) || GetEntryTries(e)))
+			continue;
+		matched[n] = i;
+		priority[n] = GetEntryPriority(e);
+		buckets->count[priority[n]]++;
+		n++;
+	}
+
+	/* Counting sort, stable so table order holds within a priority. */
+	for (p = GPT_NUM_PRIORITIES - 1; p >= 0; p--) {
+		buckets->start[p] = buckets->total;
+		next[p] = buckets->total;
+		buckets->total += buckets->count[p];
+	}
+	for (i = 0; i < n; i++)
+		buckets->order[next[priority[i]]++] = matched[i];
+}
+
+typedef int (*EntryLessFunc)(const GptEntry *a, const GptEntry *b);
+
+static int StartsBefore(const GptEntry *a, const GptEntry *b)
+{
+	return a->starting_lba < b->starting_lba;
+}
+
+static int GuidBefore(const GptEntry *a, const GptEntry *b)
+{
+	return Memcmp(&a->unique, &b->unique, sizeof(Guid)) < 0;
+}
+
+static void SiftDown(const GptEntry *entries, uint16_t *idx, uint32_t root,
+		     uint32_t count, EntryLessFunc less)
+{
+	uint32_t child;
+	uint16_t tmp;
+
+	while ((child = 2 * root + 1) < count) {
+		if (child + 1 < count &&
+		    less(&entries[idx[child]], &entries[idx[child + 1]]))
+			child++;
+		if (!less(&entries[idx[root]], &entries[idx[child]]))
+			return;
+		tmp = idx[root];
+		idx[root] = idx[child];
+		idx[child] = tmp;
+		root = child;
+	}
+}
+
+/* Heapsorts an array of entry indices, without needing any memory. */
+static void SortEntryIndices(const GptEntry *entries, uint16_t *idx,
+			     uint32_t count, EntryLessFunc less)
+{
+	uint32_t i;
+	uint16_t tmp;
+
+	for (i = count / 2; i-- > 0; )
+		SiftDown(entries, idx, i, count, less);
+	for (i = count; i-- > 1; ) {
+		tmp = idx[0];
+		idx[0] = idx[i];
+		idx[i] = tmp;
+		SiftDown(entries, idx, 0, i, less);
+	}
+}
+
+/*
+ * Checks the used entries in O(n log n) by sorting them by start and by
+ * unique GUID and comparing neighbours. Returns 1 if they are all valid,
+ * 0 if something is wrong or can't be checked this way.
+ */
+static int EntriesAreValid(const GptEntry *entries, const GptHeader *h)
+{
+	uint16_t idx[MAX_NUMBER_OF_ENTRIES];
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (h->number_of_entries > MAX_NUMBER_OF_ENTRIES)
+		return 0;
+
+	for (i = 0; i < h->number_of_entries; i++) {
+		const GptEntry *entry = &entries[i];
+
+		if (IsUnusedEntry(entry))
+			continue;
+		if ((entry->starting_lba < h->first_usable_lba) ||
+		    (entry->ending_lba > h->last_usable_lba) ||
+		    (entry->ending_lba < entry->starting_lba))
+			return 0;
+		idx[count++] = i;
+	}
+
+	SortEntryIndices(entries, idx, count, StartsBefore);
+	for (i = 1; i < count; i++)
+		if (entries[idx[i - 1]].ending_lba >=
+		    entries[idx[i]].starting_lba)
+			return 0;
+
+	SortEntryIndices(entries, idx, count, GuidBefore);
+	for (i = 1; i < count; i++)
+		if (!Memcmp(&entries[idx[i - 1]].unique,
+			    &entries[idx[i]].unique, sizeof(Guid)))
+			return 0;
+
+	return 1;
+}
+
 int CheckEntries(GptEntry *entries, GptHeader *h)
 {
 	GptEntry *entry;
@@ -139,6 +288,13 @@ int CheckEntries(GptEntry *entries, GptHeader *h)
 	if (crc32 != h->entries_crc32)
 		return GPT_ERROR_CRC_CORRUPTED;
 
+	/*
+	 * Valid tables are the common case and take the fast path. The pair
+	 * by pair check below only runs to find out which error to report.
+	 */
+	if (EntriesAreValid(entries, h))
+		return 0;
+
 	/* Check all entries. */
 	for (i = 0, entry = entries; i < h->number_of_entries; i++, entry++) {
 		GptEntry *e2;
@@ -220,11 +376,13 @@ int GptSanityCheck(GptData *gpt)
 		return retval;
 
 	/* Check both headers; we need at least one valid header. */
-	if (0 == CheckHeader(header1, 0, gpt->drive_sectors)) {
+	if (0 == CheckHeader(header1, 0, gpt->drive_sectors,
+			     gpt->sector_bytes)) {
 		gpt->valid_headers |= MASK_PRIMARY;
 		goodhdr = header1;
 	}
-	if (0 == CheckHeader(header2, 1, gpt->drive_sectors)) {
+	if (0 == CheckHeader(header2, 1, gpt->drive_sectors,
+			     gpt->sector_bytes)) {
 		gpt->valid_headers |= MASK_SECONDARY;
 		if (!goodhdr)
 			goodhdr = header2;
@@ -285,14 +443,21 @@ static int GptRecomputeSize(GptData *gpt)
 	uint64_t alt_lba, alt_entries_lba, last_usable_lba;
 	uint32_t was_valid;
 
+	if (MASK_PRIMARY & gpt->valid_headers)
+		header = (GptHeader *)(gpt->primary_header);
+	else if (MASK_SECONDARY & gpt->valid_headers)
+		header = (GptHeader *)(gpt->secondary_header);
+	else
+		return GPT_ERROR_INVALID_HEADERS;
+
 	alt_lba = gpt->drive_sectors - 1;
-	alt_entries_lba = alt_lba - GPT_ENTRIES_SECTORS;
+	alt_entries_lba = alt_lba -
+		CalculateEntriesSectors(header, gpt->sector_bytes);
 	last_usable_lba = alt_entries_lba - 1;
 
 	/* If the preferred header matches the above values based on the
 	 * disk size then all is good and quit. Otherwise try to update. */
 	if (MASK_PRIMARY & gpt->valid_headers) {
-		header = (GptHeader *)(gpt->primary_header);
 		if (header->alternate_lba == alt_lba &&
 		    header->last_usable_lba == last_usable_lba)
 			return GPT_SUCCESS;
@@ -303,8 +468,7 @@ static int GptRecomputeSize(GptData *gpt)
 		header->header_crc32 = HeaderCrc(header);
 		was_valid = MASK_PRIMARY;
 	}
-	else if (MASK_SECONDARY & gpt->valid_headers) {
-		header = (GptHeader *)(gpt->secondary_header);
+	else {
 		if (header->my_lba == alt_lba &&
 		    header->entries_lba == alt_entries_lba &&
 		    header->last_usable_lba == last_usable_lba)
@@ -317,9 +481,6 @@ static int GptRecomputeSize(GptData *gpt)
 		header->header_crc32 = HeaderCrc(header);
 		was_valid = MASK_SECONDARY;
 	}
-	else {
-		return GPT_ERROR_INVALID_HEADERS;
-	}
 
 	/* Hopefully the header we just updated is valid and not the other.
 	 * If that isn't give up and clean up our mess. */
@@ -363,7 +524,8 @@ int GptRepair(GptData *gpt)
 		Memcpy(header2, header1, sizeof(GptHeader));
 		header2->my_lba = gpt->drive_sectors - 1;
 		header2->alternate_lba = 1;
-		header2->entries_lba = header2->my_lba - GPT_ENTRIES_SECTORS;
+		header2->entries_lba = header2->my_lba -
+			CalculateEntriesSectors(header2, gpt->sector_bytes);
 		header2->header_crc32 = HeaderCrc(header2);
 		gpt->modified |= GPT_MODIFIED_HEADER2;
 	}
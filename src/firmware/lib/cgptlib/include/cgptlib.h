@@ -34,11 +34,38 @@ enum {
 #define GPT_MODIFIED_ENTRIES2 0x08
 
 /*
- * Size of GptData.primary_entries and secondary_entries: 128 bytes/entry * 128
- * entries.
+ * Size of a standard entries array: 128 bytes/entry * 128 entries.
  */
 #define TOTAL_ENTRIES_SIZE 16384
 
+/* Most entries a header may declare. */
+#define MAX_NUMBER_OF_ENTRIES 512
+
+/*
+ * Size of GptData.primary_entries and secondary_entries: 128 bytes/entry * up
+ * to MAX_NUMBER_OF_ENTRIES, the largest array a header may declare.
+ */
+#define MAX_ENTRIES_SIZE 65536
+
+/* Partition priorities run from 0 (never boot) to 15. */
+#define GPT_NUM_PRIORITIES 16
+
+/*
+ * The entries of one type grouped by priority, see BucketEntriesByPriority().
+ * Fixed size so firmware can keep it in GptData without allocating.
+ */
+typedef struct {
+	/*
+	 * Entry indices, highest priority first and in table order within a
+	 * priority.  Priority p covers order[start[p]] to
+	 * order[start[p] + count[p] - 1].
+	 */
+	uint16_t order[MAX_NUMBER_OF_ENTRIES];
+	uint16_t start[GPT_NUM_PRIORITIES];
+	uint16_t count[GPT_NUM_PRIORITIES];
+	uint16_t total;
+} GptPriorityBuckets;
+
 /*
  * The 'update_type' of GptUpdateKernelEntry().  We expose TRY and BAD only
  * because those are what verified boot needs.  For more precise control on GPT
@@ -63,9 +90,9 @@ typedef struct {
 	uint8_t *primary_header;
 	/* GPT secondary header, from last sector of disk (size: 512 bytes) */
 	uint8_t *secondary_header;
-	/* Primary GPT table, follows primary header (size: 16 KB) */
+	/* Primary GPT table, follows primary header (size: 64 KB) */
 	uint8_t *primary_entries;
-	/* Secondary GPT table, precedes secondary header (size: 16 KB) */
+	/* Secondary GPT table, precedes secondary header (size: 64 KB) */
 	uint8_t *secondary_entries;
 	/* Size of a LBA sector, in bytes */
 	uint32_t sector_bytes;
@@ -85,6 +112,10 @@ typedef struct {
 	/* Internal variables */
 	uint32_t valid_headers, valid_entries;
 	int current_priority;
+	/* Bootable kernels by priority, filled in by GptInit() */
+	GptPriorityBuckets kernels;
+	/* How many of them GptNextKernelEntry() has returned */
+	uint32_t kernels_tried;
 } GptData;
 
 /**
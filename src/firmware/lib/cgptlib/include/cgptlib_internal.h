@@ -57,16 +57,17 @@
 #define MAX_SIZE_OF_ENTRY 512
 #define SIZE_OF_ENTRY_MULTIPLE 8
 #define MIN_NUMBER_OF_ENTRIES 32
-#define MAX_NUMBER_OF_ENTRIES 512
+
+/* Supported logical sector sizes, powers of two in between. */
+#define MIN_SECTOR_BYTES 512
+#define MAX_SECTOR_BYTES 4096
 
 /* Defines GPT sizes */
 #define GPT_PMBR_SECTOR 1  /* size (in sectors) of PMBR */
 #define GPT_HEADER_SECTOR 1
-/*
- * Entries sectors assumes sector size if 512 bytes; then (TOTAL_ENTRIES_SIZE /
- * 512) = 32
- */
-#define GPT_ENTRIES_SECTORS 32
+/* Sectors taken by a standard TOTAL_ENTRIES_SIZE entries array. */
+#define GPT_ENTRIES_SECTORS(sector_bytes) \
+	((TOTAL_ENTRIES_SIZE + (sector_bytes) - 1) / (sector_bytes))
 
 /*
  * Alias name of index in internal array for primary and secondary header and
@@ -90,12 +91,19 @@ enum {
  */
 int CheckParameters(GptData* gpt);
 
+/**
+ * Return the number of sectors needed to hold the entries array described by
+ * the header, e.g. 32 for 128 entries of 128 bytes in 512-byte sectors.
+ */
+uint32_t CalculateEntriesSectors(const GptHeader *h, uint32_t sector_bytes);
+
 /**
  * Check header fields.
  *
  * Returns 0 if header is valid, 1 if invalid.
  */
-int CheckHeader(GptHeader *h, int is_secondary, uint64_t drive_sectors);
+int CheckHeader(GptHeader *h, int is_secondary, uint64_t drive_sectors,
+		uint32_t sector_bytes);
 
 /**
  * Calculate and return the header CRC.
@@ -167,6 +175,15 @@ int IsUnusedEntry(const GptEntry *e);
  */
 int IsKernelEntry(const GptEntry *e);
 
+/**
+ * Group the used entries of the given type by priority, in one pass over the
+ * table and without allocating.  If bootable_only is set, entries which are
+ * neither successful nor have tries left are skipped.
+ */
+void BucketEntriesByPriority(const GptHeader *h, const GptEntry *entries,
+			     const Guid *type, int bootable_only,
+			     GptPriorityBuckets *buckets);
+
 /**
  * Copy the current kernel partition's UniquePartitionGuid to the dest.
  */
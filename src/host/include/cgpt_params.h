@@ -20,8 +20,18 @@ typedef struct CgptCreateParams {
   int zap;
   int create;
   uint64_t min_size;
+  uint32_t sector_bytes;
+  uint64_t align_bytes;
+  int discard;            // discard the partitions the table had
 } CgptCreateParams;
 
+// How cgpt add picks free space for a partition without a beginning.
+enum cgpt_fit {
+  FIT_FIRST = 0,    // lowest free extent that fits
+  FIT_BEST,         // smallest free extent that fits
+  FIT_LARGEST,      // largest free extent
+};
+
 typedef struct CgptAddParams {
   char *drive_name;
   uint32_t partition;
@@ -44,6 +54,12 @@ typedef struct CgptAddParams {
   int set_tries;
   int set_priority;
   int set_raw;
+  enum cgpt_fit fit;
+  int size_rest;          // -s rest: up to the end of the free extent
+  uint32_t size_percent;  // -s N%: of the usable space
+  uint64_t align_bytes;   // 0 for the device topology
+  int wait_seconds;       // for a new partition's device node, 0 for none
+  int discard;            // discard the sectors that change partition
 } CgptAddParams;
 
 typedef struct CgptShowParams {
@@ -54,6 +70,7 @@ typedef struct CgptShowParams {
   uint32_t partition;
   int single_item;
   int debug;
+  int free_space;         // --free: list the unallocated extents
   int num_partitions;
 } CgptShowParams;
 
@@ -77,13 +94,58 @@ typedef struct CgptPrioritizeParams {
   int orig_priority;
 } CgptPrioritizeParams;
 
+typedef struct CgptSwitchParams {
+  char *drive_name;
+  uint32_t partition;     // 1-based root to boot next
+  int priority;           // 0 to rank it above all other roots
+  int tries;
+  int successful;
+  int set_tries;
+  int set_successful;
+} CgptSwitchParams;
+
+// A file to copy into a partition, see cgpt compose.
+typedef struct CgptPayload {
+  uint32_t partition;
+  char *file;
+} CgptPayload;
+
+typedef struct CgptBatchParams {
+  char *drive_name;
+  char *script;           // NULL for stdin
+  int wait_seconds;       // for new partitions' device nodes, 0 for none
+  int discard;            // discard the sectors that change partition
+  CgptPayload *payloads;  // copied in once the table is final
+  int num_payloads;
+  int verbose;            // report how each payload was copied
+} CgptBatchParams;
+
+typedef struct CgptFlashParams {
+  char *image;            // "-" for stdin
+  char *drive_name;
+  int jobs;               // writes in flight, 0 for the default
+  uint64_t chunk_bytes;   // of each write, 0 for the default
+  int verify;             // read back and compare CRCs
+  char *checkpoint;       // file to resume from and record progress in
+  int verbose;
+} CgptFlashParams;
+
+typedef struct CgptDiscardFreeParams {
+  char *drive_name;
+  int verbose;
+} CgptDiscardFreeParams;
+
 typedef struct CgptNextParams {
   char *drive_name;
   char *drive_type;
 } CgptNextParams;
 
 typedef struct CgptResizeParams {
-  char *partition_desc;
+  char *partition_desc;   // a partition device to grow, and/or
+  char **targets;         // more of them, or drives with all_resize
+  int num_targets;
+  int all_resize;         // grow every coreos-resize partition of targets
+  int grow_fs;            // then grow their mounted ext4 or xfs filesystems
   uint64_t min_resize_bytes;
 } CgptResizeParams;
 
@@ -3,6 +3,10 @@
  * found in the LICENSE file.
  *
  * vboot-related functions exported for use by userspace programs
+ *
+ * The Cgpt* and GUID functions are also shipped as libcgpt. They keep no
+ * state between calls, so different drives may be handled from different
+ * threads, and they report failures with CGPT_FAILED rather than exiting.
  */
 
 #ifndef VBOOT_HOST_H_
@@ -16,6 +20,10 @@
 
 #include "cgpt_params.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* partition table manipulation */
 int CgptCreate(CgptCreateParams *params);
 int CgptAdd(CgptAddParams *params);
@@ -28,7 +36,10 @@ int CgptShow(CgptShowParams *params);
 int CgptGetNumNonEmptyPartitions(CgptShowParams *params);
 int CgptRepair(CgptRepairParams *params);
 int CgptResize(CgptResizeParams *params);
+int CgptDiscardFree(CgptDiscardFreeParams *params);
+int CgptFlash(CgptFlashParams *params);
 int CgptPrioritize(CgptPrioritizeParams *params);
+int CgptSwitch(CgptSwitchParams *params);
 void CgptFind(CgptFindParams *params);
 int CgptLegacy(CgptLegacyParams *params);
 
@@ -47,6 +58,10 @@ void GuidToStrLower(const Guid *guid, char *str, unsigned int buflen);
 int GuidEqual(const Guid *guid1, const Guid *guid2);
 int GuidIsZero(const Guid *guid);
 
+#ifdef __cplusplus
+}
+#endif
+
 
 /****************************************************************************/
 /* Kernel command line */
@@ -4,21 +4,160 @@
  */
 
 #include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <linux/loop.h>
 #include <sys/file.h>
 #include <libmount/libmount.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-static int get_node(const char *image_path, char **loopdev, int *loop) {
-	
+#include "cgpt.h"
+#include "cgptlib_internal.h"
+#include "vboot_host.h"
+
+// Required by the cgpt helpers for error messages.
+const char* progname = "loopy";
+const char* command = "";
+
+/* The region of the image to attach. A zero sizelimit means the rest of
+ * the image. */
+struct region {
+        uint64_t offset;
+        uint64_t sizelimit;
+};
+
+/* Read the logical sector size of the disk the backing file lives on.
+ * Partitions have no queue directory of their own, so fall back to the
+ * parent disk's. Returns 0 if unknown, e.g. on tmpfs or btrfs. */
+static unsigned int backing_sector_size(dev_t dev) {
+        static const char *const fmts[] = {
+                "/sys/dev/block/%u:%u/queue/logical_block_size",
+                "/sys/dev/block/%u:%u/../queue/logical_block_size",
+        };
+        char path[64];
+        unsigned int size = 0, i;
+        FILE *f;
+
+        for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]) && !size; i++) {
+                snprintf(path, sizeof(path), fmts[i], major(dev), minor(dev));
+                f = fopen(path, "r");
+                if (!f)
+                        continue;
+                if (fscanf(f, "%u", &size) != 1)
+                        size = 0;
+                fclose(f);
+        }
+        return size;
+}
+
+/* Direct I/O on the backing file has to be aligned to the logical sector
+ * size of the disk below it, so use that as the loop block size. Going
+ * any larger would refuse filesystems in the image with smaller blocks.
+ * The loop driver accepts powers of two from 512 bytes to the page size. */
+static unsigned int backing_block_size(int fd, const struct region *region) {
+        struct stat st;
+        unsigned int bs;
 
+        if (fstat(fd, &st) < 0)
+                return 512;
+
+        bs = backing_sector_size(st.st_dev);
+        if (bs < 512 || bs > (unsigned int)sysconf(_SC_PAGESIZE) ||
+            (bs & (bs - 1)))
+                return 512;
+
+        /* A larger block size would hide the tail of the image, and the
+         * start of a partition must stay aligned for direct I/O. */
+        if (st.st_size % bs || region->offset % bs || region->sizelimit % bs)
+                return 512;
+
+        return bs;
+}
+
+/* Pre-5.8 kernels lack LOOP_CONFIGURE, so attach in several steps. Direct
+ * I/O and the block size are best effort; the device works without them. */
+static int legacy_configure(int loop, int fd, unsigned int block_size,
+                            const struct region *region) {
         struct loop_info64 info = {
+                .lo_offset = region->offset,
+                .lo_sizelimit = region->sizelimit,
                 .lo_flags = LO_FLAGS_AUTOCLEAR
         };
 
-	int nr = -1, fd = -1, control = -1, success = -1;
+        if (ioctl(loop, LOOP_SET_FD, fd) < 0) {
+                if (errno != EBUSY)
+                        perror("Failed to set loopback file descriptor fd on loopdev");
+                return -1;
+        }
+
+        if (ioctl(loop, LOOP_SET_BLOCK_SIZE, (unsigned long)block_size) < 0)
+                perror("Warning: failed to set loop device block size");
+
+        if (ioctl(loop, LOOP_SET_STATUS64, &info) < 0) {
+                perror("Failed to set loop device status on new node");
+                ioctl(loop, LOOP_CLR_FD, 0);
+                return -1;
+        }
+
+        if (ioctl(loop, LOOP_SET_DIRECT_IO, 1UL) < 0)
+                perror("Warning: direct I/O unavailable, using buffered I/O");
+
+        return 0;
+}
+
+static int configure(int loop, int fd, const struct region *region) {
+        unsigned int block_size = backing_block_size(fd, region);
+#ifdef LOOP_CONFIGURE
+        struct loop_config config = {
+                .fd = fd,
+                .block_size = block_size,
+                .info = {
+                        .lo_offset = region->offset,
+                        .lo_sizelimit = region->sizelimit,
+                        .lo_flags = LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO
+                }
+        };
+
+        if (ioctl(loop, LOOP_CONFIGURE, &config) == 0)
+                return 0;
+
+        /* Some kernels refuse direct I/O the backing file can't do. */
+        if (errno == EINVAL) {
+                config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+                if (ioctl(loop, LOOP_CONFIGURE, &config) == 0)
+                        return 0;
+        }
+
+        /* Another process bound the device first; the caller retries. */
+        if (errno == EBUSY)
+                return -1;
+
+        /* Older kernels report unknown loop ioctls as EINVAL or ENOTTY. */
+        if (errno != EINVAL && errno != ENOTTY) {
+                perror("Failed to configure loop device");
+                return -1;
+        }
+#endif
+        return legacy_configure(loop, fd, block_size, region);
+}
+
+/* LOOP_CTL_GET_FREE only reports a free device, it doesn't reserve it, so
+ * concurrent callers can be handed the same number. Whoever binds it first
+ * wins and everyone else gets EBUSY and asks again. */
+#define LOOP_ALLOC_RETRIES 64
+
+static int get_node(const char *image_path, const struct region *region,
+                    char **loopdev, int *loop) {
+
+	int nr = -1, fd = -1, control = -1, success = -1, attempt;
 
         fd = open(image_path, O_CLOEXEC|O_RDWR);
         if (fd < 0) {
@@ -32,34 +171,47 @@ static int get_node(const char *image_path, char **loopdev, int *loop) {
                 goto out;
         }
 
-        nr = ioctl(control, LOOP_CTL_GET_FREE);
-        if (nr < 0) {
-                perror("Failed to allocate loop device node");
-                goto out;
-        }
+        for (attempt = 0; ; attempt++) {
+                if (attempt == LOOP_ALLOC_RETRIES) {
+                        fprintf(stderr, "Gave up allocating a loop device "
+                                "after %d attempts\n", attempt);
+                        goto out;
+                }
 
-         if (asprintf(loopdev, "/dev/loop%i", nr) < 0) {
-                perror("Failed to retrieve path of loop device node");
-                goto out;
-        }
+                nr = ioctl(control, LOOP_CTL_GET_FREE);
+                if (nr < 0) {
+                        perror("Failed to allocate loop device node");
+                        goto out;
+                }
 
-        printf("initializing loop device node at /dev/loop%d \n", nr);
+                if (asprintf(loopdev, "/dev/loop%i", nr) < 0) {
+                        *loopdev = NULL;
+                        perror("Failed to retrieve path of loop device node");
+                        goto out;
+                }
 
-        *loop = open(*loopdev, O_CLOEXEC|O_RDWR);
-        if (*loop < 0) {
-                perror("Failed to open loop device loopdev");
-                goto out;
-        }
+                *loop = open(*loopdev, O_CLOEXEC|O_RDWR);
+                if (*loop < 0) {
+                        /* Removed by someone else since GET_FREE. */
+                        if (errno != ENOENT && errno != ENXIO) {
+                                perror("Failed to open loop device loopdev");
+                                goto out;
+                        }
+                } else if (configure(*loop, fd, region) == 0) {
+                        break;
+                } else if (errno != EBUSY) {
+                        goto out;
+                } else {
+                        close(*loop);
+                        *loop = -1;
+                }
 
-        if (ioctl(*loop, LOOP_SET_FD, fd) < 0) {
-                perror("Failed to set loopback file descriptor fd on loopdev");
-                goto out;
+                free(*loopdev);
+                *loopdev = NULL;
+                usleep(1000 * (attempt + 1));
         }
 
-	if (ioctl(*loop, LOOP_SET_STATUS64, &info) < 0) {
-		perror("Failed to set loop device status on new node");
-		goto out;
-	}
+        printf("initializing loop device node at /dev/loop%d \n", nr);
 
         success = 1;
 
@@ -68,8 +220,13 @@ static int get_node(const char *image_path, char **loopdev, int *loop) {
                 if (fd >= 0)
                         close(fd);
 
-                if (success != 1 && nr >= 0 && control >= 0)
-                        ioctl(control, LOOP_CTL_REMOVE, nr);
+                /* The device is never removed here: an unbound node may
+                 * already have been handed to another caller, and a
+                 * bound one cleans itself up through autoclear. */
+                if (success != 1 && *loop >= 0) {
+                        close(*loop);
+                        *loop = -1;
+                }
 
                 if (control >= 0)
                         close(control);
@@ -78,17 +235,63 @@ static int get_node(const char *image_path, char **loopdev, int *loop) {
 
 }
 
-static int single_mount(const char *image_path, const char *target) {
+/* Look up a partition in the image's GPT so it can be attached on its own,
+ * without a partition scan and the udev round trip that comes with it. */
+static int find_partition(const char *image_path, const char *selector,
+                          struct region *region) {
+        struct partition_selector sel;
+        struct drive drive;
+        GptEntry *entry;
+        uint32_t index;
+        int gpt_retval, rc = -1;
+
+        if (ParsePartitionSelector(selector, &sel) != CGPT_OK)
+                return -1;
+
+        if (DriveOpen(image_path, &drive, 0, O_RDONLY) != CGPT_OK)
+                return -1;
+
+        gpt_retval = GptSanityCheck(&drive.gpt);
+        if (gpt_retval != GPT_SUCCESS) {
+                fprintf(stderr, "Invalid GPT in %s: %s\n",
+                        image_path, GptError(gpt_retval));
+                goto out;
+        }
+
+        if (SelectPartition(&drive, &sel, &index) != CGPT_OK)
+                goto out;
+
+        entry = GetEntry(&drive.gpt, ANY_VALID, index);
+        region->offset = entry->starting_lba * drive.gpt.sector_bytes;
+        region->sizelimit = (entry->ending_lba - entry->starting_lba + 1) *
+                            drive.gpt.sector_bytes;
+        printf("using partition %u of %s\n", index + 1, image_path);
+        rc = 0;
+
+        out:
+                DriveRelease(&drive);
+                return rc;
+}
+
+/* Mount one image using the caller's libmount context, which is reset
+ * first so a worker can reuse it for every entry it handles. */
+static int single_mount(struct libmnt_context *cxt, const char *image_path,
+                        const struct region *region, const char *target,
+                        const char *options) {
 
 
         int rc = -1;
 	int loop = -1;
-        struct libmnt_context *cxt;
-        cxt = mnt_new_context();
         char *source = NULL;
 
-        if ( get_node(image_path, &source, &loop) < 0 ) {
-                printf("Failed to get node for mounting");
+        if ( mnt_reset_context(cxt) < 0 ) {
+                fprintf(stderr, "Failed to reset mount context\n");
+                return -1;
+        }
+
+        if ( get_node(image_path, region, &source, &loop) < 0 ) {
+                fprintf(stderr, "Failed to get node for mounting %s\n",
+                        image_path);
                 goto out;
         }
 
@@ -102,6 +305,11 @@ static int single_mount(const char *image_path, const char *target) {
                 goto out;
         }
 
+        if ( options && mnt_context_set_options(cxt, options) < 0 ) {
+                perror("Failed to set mount options");
+                goto out;
+        }
+
         rc = mnt_context_mount(cxt);
         if (rc) {
                 if (rc > 0) {
@@ -119,8 +327,6 @@ static int single_mount(const char *image_path, const char *target) {
 		if (rc > 0) 
 			rc = -1;
 		
-		mnt_free_context(cxt);
-        
 	       	free(source);
 
 		if (loop >= 0)
@@ -129,23 +335,243 @@ static int single_mount(const char *image_path, const char *target) {
         return rc;
 }
 
+/* One line of a manifest: IMAGE TARGET [OPTIONS] */
+struct mount_job {
+        char *image;
+        char *target;
+        char *options;
+        int line;
+};
+
+struct batch {
+        struct mount_job *jobs;
+        int count;
+        int next;
+        int failed;
+        pthread_mutex_t lock;
+};
+
+static int read_manifest(const char *path, struct batch *batch) {
+        FILE *f;
+        char *line = NULL;
+        size_t len = 0;
+        int lineno = 0, alloc = 0, rc = 0;
+
+        f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+        if (!f) {
+                perror("Failed to open manifest");
+                return -1;
+        }
+
+        while (getline(&line, &len, f) != -1) {
+                char *image, *target, *options, *extra, *save = NULL;
+                struct mount_job *job;
+
+                lineno++;
+                image = strtok_r(line, " \t\n", &save);
+                if (!image || image[0] == '#')
+                        continue;
+                target = strtok_r(NULL, " \t\n", &save);
+                options = strtok_r(NULL, " \t\n", &save);
+                extra = strtok_r(NULL, " \t\n", &save);
+                if (!target || extra) {
+                        fprintf(stderr, "%s:%d: expected IMAGE TARGET "
+                                "[OPTIONS]\n", path, lineno);
+                        rc = -1;
+                        break;
+                }
+
+                if (batch->count == alloc) {
+                        alloc = alloc ? alloc * 2 : 16;
+                        job = realloc(batch->jobs, alloc * sizeof(*job));
+                        if (!job) {
+                                perror("Failed to read manifest");
+                                rc = -1;
+                                break;
+                        }
+                        batch->jobs = job;
+                }
+
+                job = &batch->jobs[batch->count++];
+                job->image = strdup(image);
+                job->target = strdup(target);
+                job->options = options ? strdup(options) : NULL;
+                job->line = lineno;
+                if (!job->image || !job->target || (options && !job->options)) {
+                        perror("Failed to read manifest");
+                        rc = -1;
+                        break;
+                }
+        }
+
+        free(line);
+        if (f != stdin)
+                fclose(f);
+        return rc;
+}
+
+static void *mount_worker(void *arg) {
+        struct batch *batch = arg;
+        struct libmnt_context *cxt;
+        struct region region = { 0, 0 };
+        int i, failed = 0;
+
+        cxt = mnt_new_context();
+        if (!cxt) {
+                /* Leave the jobs to the other workers. */
+                fprintf(stderr, "Failed to create mount context\n");
+                return NULL;
+        }
+
+        for (;;) {
+                pthread_mutex_lock(&batch->lock);
+                batch->failed += failed;
+                i = batch->next < batch->count ? batch->next++ : -1;
+                pthread_mutex_unlock(&batch->lock);
+                if (i < 0)
+                        break;
+
+                struct mount_job *job = &batch->jobs[i];
+                failed = single_mount(cxt, job->image, &region, job->target,
+                                      job->options) < 0;
+                if (failed)
+                        fprintf(stderr, "line %d: failed to mount %s on %s\n",
+                                job->line, job->image, job->target);
+        }
+
+        mnt_free_context(cxt);
+        return NULL;
+}
+
+static int batch_mount(const char *manifest, int nthreads) {
+        struct batch batch = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+        pthread_t *threads;
+        int i, started = 0, rc = -1;
+
+        if (read_manifest(manifest, &batch) < 0)
+                goto out;
+
+        if (nthreads > batch.count)
+                nthreads = batch.count;
+
+        threads = calloc(nthreads ? nthreads : 1, sizeof(*threads));
+        if (!threads) {
+                perror("Failed to start workers");
+                goto out;
+        }
+
+        for (i = 0; i < nthreads; i++) {
+                if (pthread_create(&threads[i], NULL, mount_worker, &batch))
+                        break;
+                started++;
+        }
+
+        /* Run the jobs inline if no worker could be started. */
+        if (!started && batch.count)
+                mount_worker(&batch);
+
+        for (i = 0; i < started; i++)
+                pthread_join(threads[i], NULL);
+        free(threads);
+
+        /* Jobs nobody got to count as failures too. */
+        batch.failed += batch.count - batch.next;
+        if (batch.failed)
+                fprintf(stderr, "%d of %d mounts failed\n",
+                        batch.failed, batch.count);
+        else
+                rc = 0;
+
+        out:
+                for (i = 0; i < batch.count; i++) {
+                        free(batch.jobs[i].image);
+                        free(batch.jobs[i].target);
+                        free(batch.jobs[i].options);
+                }
+                free(batch.jobs);
+                return rc;
+}
+
+static void usage(void) {
+        fprintf(stderr,
+                "Usage: loopy [-p SELECTOR] <SOURCE> <TARGET>\n"
+                "       loopy -m MANIFEST [-j JOBS]\n\n"
+                "Attach SOURCE to a loop device and mount it on TARGET.\n\n"
+                "Options:\n"
+                "  -p SELECTOR   Only attach one GPT partition of SOURCE,\n"
+                "                given as a number, PARTLABEL=<label>,\n"
+                "                PARTTYPE=<type> or PARTUUID=<guid>\n"
+                "  -m MANIFEST   Mount every image listed in MANIFEST, one\n"
+                "                \"IMAGE TARGET [OPTIONS]\" per line, or\n"
+                "                read it from stdin if MANIFEST is -\n"
+                "  -j JOBS       Number of parallel mounts for -m\n"
+                "                (default: number of CPUs)\n");
+}
+
 int main(int argc, char *argv[]) {
 
-        const char *path, *target;
-        
-	if (!(argc == 3)) {
-                perror("Invalid usage of loop_util. Please input <SOURCE> <TARGET>");
+        const char *path, *target, *selector = NULL, *manifest = NULL;
+        struct region region = { 0, 0 };
+        struct libmnt_context *cxt;
+        long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        char *e;
+        int c;
+
+        opterr = 0;
+        while ((c = getopt(argc, argv, ":hj:m:p:")) != -1) {
+                switch (c) {
+                case 'j':
+                        jobs = strtol(optarg, &e, 10);
+                        if (*e || jobs < 1) {
+                                fprintf(stderr, "Invalid job count: %s\n",
+                                        optarg);
+                                return -1;
+                        }
+                        break;
+                case 'm':
+                        manifest = optarg;
+                        break;
+                case 'p':
+                        selector = optarg;
+                        break;
+                case 'h':
+                        usage();
+                        return 0;
+                default:
+                        usage();
+                        return -1;
+                }
+        }
+
+        if (manifest) {
+                if (argc != optind || selector) {
+                        usage();
+                        return -1;
+                }
+                return batch_mount(manifest, jobs < 1 ? 1 : jobs);
+        }
+
+        if (argc - optind != 2) {
+                usage();
                 return -1;
         }
 
-        path = argv[1];
-        target = argv[2];
+        path = argv[optind];
+        target = argv[optind + 1];
 
-        int p = single_mount(path, target);
+        if (selector && find_partition(path, selector, &region) < 0)
+                return -1;
+
+        cxt = mnt_new_context();
+        if (!cxt) {
+                fprintf(stderr, "Failed to create mount context\n");
+                return -1;
+        }
+
+        int p = single_mount(cxt, path, &region, target, NULL);
         if (p < 0)
                 fprintf(stderr, "Failure to execute single_mount");
+        mnt_free_context(cxt);
         return p;
 
 }
-
-
@@ -39,7 +39,7 @@
 #define DEFAULT_SECTOR_SIZE 512
 #define MAX_SECTOR_SIZE 4096
 #define DEFAULT_DRIVE_SECTORS 467
-#define PARTITION_ENTRIES_SIZE TOTAL_ENTRIES_SIZE /* 16384 */
+#define PARTITION_ENTRIES_SIZE MAX_ENTRIES_SIZE /* 65536 */
 
 static const Guid guid_zero = {{{0, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0}}}};
 static const Guid guid_kernel = GPT_ENT_TYPE_CHROMEOS_KERNEL;
@@ -222,9 +222,8 @@ static int TestBuildTestGptData(void)
 
 /*
  * Test if wrong sector_bytes or drive_sectors is detected by GptInit().
- * Currently we only support 512 bytes per sector.  In the future, we may
- * support other sizes.  A too small drive_sectors should be rejected by
- * GptInit().
+ * Sectors may be any power of 2 from 512 to 4096 bytes.  A too small
+ * drive_sectors should be rejected by GptInit().
  */
 static int ParameterTests(void)
 {
@@ -239,8 +238,16 @@ static int ParameterTests(void)
 		{512, 0, GPT_ERROR_INVALID_SECTOR_NUMBER},
 		{512, 66, GPT_ERROR_INVALID_SECTOR_NUMBER},
 		{512, GPT_PMBR_SECTOR + GPT_HEADER_SECTOR * 2 +
-		 GPT_ENTRIES_SECTORS * 2, GPT_SUCCESS},
-		{4096, DEFAULT_DRIVE_SECTORS, GPT_ERROR_INVALID_SECTOR_SIZE},
+		 GPT_ENTRIES_SECTORS(512) * 2, GPT_SUCCESS},
+		{1024, DEFAULT_DRIVE_SECTORS, GPT_SUCCESS},
+		{2048, DEFAULT_DRIVE_SECTORS, GPT_SUCCESS},
+		{4096, DEFAULT_DRIVE_SECTORS, GPT_SUCCESS},
+		{4096, 10, GPT_ERROR_INVALID_SECTOR_NUMBER},
+		{4096, GPT_PMBR_SECTOR + GPT_HEADER_SECTOR * 2 +
+		 GPT_ENTRIES_SECTORS(4096) * 2, GPT_SUCCESS},
+		{256, DEFAULT_DRIVE_SECTORS, GPT_ERROR_INVALID_SECTOR_SIZE},
+		{3072, DEFAULT_DRIVE_SECTORS, GPT_ERROR_INVALID_SECTOR_SIZE},
+		{8192, DEFAULT_DRIVE_SECTORS, GPT_ERROR_INVALID_SECTOR_SIZE},
 	};
 	int i;
 
@@ -343,15 +350,18 @@ static int SignatureTest(void)
 	GptHeader *h2 = (GptHeader *)gpt->secondary_header;
 	int i;
 
-	EXPECT(1 == CheckHeader(NULL, 0, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(NULL, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	for (i = 0; i < 8; ++i) {
 		BuildTestGptData(gpt);
 		h1->signature[i] ^= 0xff;
 		h2->signature[i] ^= 0xff;
 		RefreshCrc32(gpt);
-		EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-		EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+		EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+		EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 	}
 
 	return TEST_OK;
@@ -385,9 +395,11 @@ static int RevisionTest(void)
 		h2->revision = cases[i].value_to_test;
 		RefreshCrc32(gpt);
 
-		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].expect_rv);
-		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].expect_rv);
 	}
 	return TEST_OK;
@@ -418,9 +430,11 @@ static int SizeTest(void)
 		h2->size = cases[i].value_to_test;
 		RefreshCrc32(gpt);
 
-		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].expect_rv);
-		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].expect_rv);
 	}
 	return TEST_OK;
@@ -437,12 +451,16 @@ static int CrcFieldTest(void)
 	/* Modify a field that the header verification doesn't care about */
 	h1->entries_crc32++;
 	h2->entries_crc32++;
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 	/* Refresh the CRC; should pass now */
 	RefreshCrc32(gpt);
-	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	return TEST_OK;
 }
@@ -458,8 +476,10 @@ static int ReservedFieldsTest(void)
 	h1->reserved_zero ^= 0x12345678;  /* whatever random */
 	h2->reserved_zero ^= 0x12345678;  /* whatever random */
 	RefreshCrc32(gpt);
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 #ifdef PADDING_CHECKED
 	/* TODO: padding check is currently disabled */
@@ -467,8 +487,10 @@ static int ReservedFieldsTest(void)
 	h1->padding[12] ^= 0x34;  /* whatever random */
 	h2->padding[56] ^= 0x78;  /* whatever random */
 	RefreshCrc32(gpt);
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 #endif
 
 	return TEST_OK;
@@ -506,9 +528,11 @@ static int SizeOfPartitionEntryTest(void) {
 			cases[i].value_to_test;
 		RefreshCrc32(gpt);
 
-		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].expect_rv);
-		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].expect_rv);
 	}
 
@@ -516,8 +540,8 @@ static int SizeOfPartitionEntryTest(void) {
 }
 
 /*
- * Technically, any size which is 2^N where N > 6 should work, but our library
- * only supports one size.
+ * Any number of entries from 32 to 512 is valid, as long as the entries
+ * array fits where the header says it is.
  */
 static int NumberOfPartitionEntriesTest(void)
 {
@@ -525,12 +549,51 @@ static int NumberOfPartitionEntriesTest(void)
 	GptHeader *h1 = (GptHeader *)gpt->primary_header;
 	GptHeader *h2 = (GptHeader *)gpt->secondary_header;
 
+	/* A partial last sector still takes the whole sector. */
 	BuildTestGptData(gpt);
 	h1->number_of_entries--;
+	h2->number_of_entries--;
+	RefreshCrc32(gpt);
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
+
+	/* A smaller secondary array must still end right before its header */
+	BuildTestGptData(gpt);
+	h1->number_of_entries /= 2;
 	h2->number_of_entries /= 2;
 	RefreshCrc32(gpt);
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	h2->entries_lba += 16;
+	RefreshCrc32(gpt);
+	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
+
+	/* More entries need more room before FirstUsableLBA */
+	BuildTestGptData(gpt);
+	h1->number_of_entries = 256;
+	h1->first_usable_lba = 2 + 64;
+	h1->last_usable_lba = gpt->drive_sectors - 2 - 64;
+	RefreshCrc32(gpt);
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	h1->first_usable_lba--;
+	RefreshCrc32(gpt);
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+
+	BuildTestGptData(gpt);
+	h1->number_of_entries = MIN_NUMBER_OF_ENTRIES - 1;
+	h2->number_of_entries = MAX_NUMBER_OF_ENTRIES + 1;
+	RefreshCrc32(gpt);
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	return TEST_OK;
 }
@@ -545,51 +608,73 @@ static int MyLbaTest(void)
 
 	/* myLBA depends on primary vs secondary flag */
 	BuildTestGptData(gpt);
-	EXPECT(1 == CheckHeader(h1, 1, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 0, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	BuildTestGptData(gpt);
 	h1->my_lba--;
 	h2->my_lba--;
 	RefreshCrc32(gpt);
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	BuildTestGptData(gpt);
 	h1->my_lba = 2;
 	h2->my_lba--;
 	RefreshCrc32(gpt);
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	/* We should ignore the alternate_lba field entirely */
 	BuildTestGptData(gpt);
 	h1->alternate_lba++;
 	h2->alternate_lba++;
 	RefreshCrc32(gpt);
-	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	BuildTestGptData(gpt);
 	h1->alternate_lba--;
 	h2->alternate_lba--;
 	RefreshCrc32(gpt);
-	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	BuildTestGptData(gpt);
 	h1->entries_lba++;
 	h2->entries_lba++;
 	RefreshCrc32(gpt);
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
+
+	/* The primary entries may move, but only ahead of FirstUsableLBA */
+	BuildTestGptData(gpt);
+	h1->entries_lba += 8;
+	h1->first_usable_lba += 8;
+	RefreshCrc32(gpt);
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	BuildTestGptData(gpt);
 	h1->entries_lba--;
 	h2->entries_lba--;
 	RefreshCrc32(gpt);
-	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors));
-	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors));
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes));
 
 	return TEST_OK;
 }
@@ -637,9 +722,11 @@ static int FirstUsableLbaAndLastUsableLbaTest(void)
 		h2->last_usable_lba = cases[i].secondary_last_usable_lba;
 		RefreshCrc32(gpt);
 
-		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h1, 0, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].primary_rv);
-		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors) ==
+		EXPECT(CheckHeader(h2, 1, gpt->drive_sectors,
+				 gpt->sector_bytes) ==
 		       cases[i].secondary_rv);
 	}
 
@@ -787,6 +874,39 @@ static int OverlappedPartitionTest(void) {
 	return TEST_OK;
 }
 
+/* Test a table with every entry used, listed out of order. */
+static int FullTableTest(void)
+{
+	GptData *gpt = GetEmptyGptData();
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	GptEntry *e = (GptEntry *)gpt->primary_entries;
+	uint32_t i;
+
+	BuildTestGptData(gpt);
+	ZeroEntries(gpt);
+	/* 37 is coprime with 128, so each entry lands in its own slot. */
+	for (i = 0; i < h->number_of_entries; i++) {
+		Memcpy(&e[i].type, &guid_kernel, sizeof(Guid));
+		SetGuid(&e[i].unique, i);
+		e[i].starting_lba = 34 + 3 * ((i * 37) % 128);
+		e[i].ending_lba = e[i].starting_lba + 2;
+	}
+	RefreshCrc32(gpt);
+	EXPECT(0 == CheckEntries(e, h));
+
+	/* Entry 5 sits right before entry 50. */
+	e[5].ending_lba++;
+	RefreshCrc32(gpt);
+	EXPECT(GPT_ERROR_END_LBA_OVERLAP == CheckEntries(e, h));
+	e[5].ending_lba--;
+
+	SetGuid(&e[100].unique, 7);
+	RefreshCrc32(gpt);
+	EXPECT(GPT_ERROR_DUP_GUID == CheckEntries(e, h));
+
+	return TEST_OK;
+}
+
 /* Test both sanity checking and repair. */
 static int SanityCheckTest(void)
 {
@@ -809,7 +929,7 @@ static int SanityCheckTest(void)
 
 	/* Invalid sector size should fail */
 	BuildTestGptData(gpt);
-	gpt->sector_bytes = 1024;
+	gpt->sector_bytes = 1000;
 	EXPECT(GPT_ERROR_INVALID_SECTOR_SIZE == GptSanityCheck(gpt));
 
 	/* Modify headers */
@@ -995,7 +1115,7 @@ static int DriveResizeTest(void)
 	GptEntry *e2 = (GptEntry *)(gpt->secondary_entries);
 	uint64_t old_alt_lba = DEFAULT_DRIVE_SECTORS - 1;
 	uint64_t old_last_lba =
-		DEFAULT_DRIVE_SECTORS - 1 - GPT_ENTRIES_SECTORS - 1;
+		DEFAULT_DRIVE_SECTORS - 1 - GPT_ENTRIES_SECTORS(512) - 1;
 
 	/* Double check the starting point is sane */
 	BuildTestGptData(gpt);
@@ -1084,6 +1204,82 @@ static int DriveResizeTest(void)
 	return TEST_OK;
 }
 
+/*
+ * Lay the test GPT out for 4096-byte sectors: the entries array shrinks to
+ * 4 sectors, which moves the secondary entries and the usable range.
+ */
+static void BuildTestGptData4K(GptData *gpt)
+{
+	GptHeader *h1 = (GptHeader *)gpt->primary_header;
+	GptHeader *h2 = (GptHeader *)gpt->secondary_header;
+
+	BuildTestGptData(gpt);
+	gpt->sector_bytes = 4096;
+	h1->first_usable_lba = h2->first_usable_lba = 2 + 4;
+	h1->last_usable_lba = h2->last_usable_lba =
+		DEFAULT_DRIVE_SECTORS - 1 - 4 - 1;
+	h2->entries_lba = DEFAULT_DRIVE_SECTORS - 1 - 4;
+	RefreshCrc32(gpt);
+}
+
+/* Tests for drives with 4096-byte logical sectors. */
+static int FourKSectorTest(void)
+{
+	GptData *gpt = GetEmptyGptData();
+	GptHeader *h1 = (GptHeader *)gpt->primary_header;
+	GptHeader *h2 = (GptHeader *)gpt->secondary_header;
+
+	BuildTestGptData(gpt);
+	EXPECT(32 == CalculateEntriesSectors(h1, 512));
+	EXPECT(4 == CalculateEntriesSectors(h1, 4096));
+
+	BuildTestGptData4K(gpt);
+	EXPECT(GPT_SUCCESS == GptInit(gpt));
+	EXPECT(GPT_SUCCESS == GptSanityCheck(gpt));
+	EXPECT(MASK_BOTH == gpt->valid_headers);
+	EXPECT(MASK_BOTH == gpt->valid_entries);
+
+	/* A 512-byte layout doesn't fit 4096-byte sectors. */
+	BuildTestGptData(gpt);
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors, 512));
+	EXPECT(0 == CheckHeader(h2, 1, gpt->drive_sectors, 512));
+	EXPECT(0 == CheckHeader(h1, 0, gpt->drive_sectors, 4096));
+	EXPECT(1 == CheckHeader(h2, 1, gpt->drive_sectors, 4096));
+
+	/* The usable range must stay clear of the smaller entries arrays. */
+	BuildTestGptData4K(gpt);
+	h1->first_usable_lba = 5;
+	RefreshCrc32(gpt);
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors, 4096));
+	BuildTestGptData4K(gpt);
+	h1->last_usable_lba = DEFAULT_DRIVE_SECTORS - 1 - 4;
+	RefreshCrc32(gpt);
+	EXPECT(1 == CheckHeader(h1, 0, gpt->drive_sectors, 4096));
+
+	/* Repair puts the secondary entries 4 sectors before the header. */
+	BuildTestGptData4K(gpt);
+	Memset(h2, 0, sizeof(GptHeader));
+	EXPECT(GPT_SUCCESS == GptSanityCheck(gpt));
+	EXPECT(MASK_PRIMARY == gpt->valid_headers);
+	GptRepair(gpt);
+	EXPECT(GPT_SUCCESS == GptSanityCheck(gpt));
+	EXPECT(MASK_BOTH == gpt->valid_headers);
+	EXPECT(h2->entries_lba == DEFAULT_DRIVE_SECTORS - 1 - 4);
+
+	/* Growing the drive moves the secondary by whole 4K sectors. */
+	BuildTestGptData4K(gpt);
+	Memset(h2, 0, sizeof(GptHeader));
+	gpt->drive_sectors += 10;
+	EXPECT(GPT_SUCCESS == GptSanityCheck(gpt));
+	GptRepair(gpt);
+	EXPECT(GPT_SUCCESS == GptSanityCheck(gpt));
+	EXPECT(MASK_BOTH == gpt->valid_headers);
+	EXPECT(h1->last_usable_lba == DEFAULT_DRIVE_SECTORS + 10 - 1 - 4 - 1);
+	EXPECT(h2->entries_lba == DEFAULT_DRIVE_SECTORS + 10 - 1 - 4);
+
+	return TEST_OK;
+}
+
 static int EntryAttributeGetSetTest(void)
 {
 	GptData *gpt = GetEmptyGptData();
@@ -1271,6 +1467,40 @@ static int GetNextTriesTest(void)
 	return TEST_OK;
 }
 
+static int PriorityBucketsTest(void)
+{
+	GptData *gpt = GetEmptyGptData();
+	GptHeader *h = (GptHeader *)gpt->primary_header;
+	GptEntry *e1 = (GptEntry *)(gpt->primary_entries);
+	GptPriorityBuckets b;
+
+	/* Priority 3, 4, 0, 4 with X neither successful nor tried */
+	BuildTestGptData(gpt);
+	FillEntry(e1 + KERNEL_A, 1, 3, 1, 0);
+	FillEntry(e1 + KERNEL_B, 1, 4, 0, 1);
+	FillEntry(e1 + KERNEL_X, 1, 0, 0, 0);
+	FillEntry(e1 + KERNEL_Y, 1, 4, 1, 0);
+
+	BucketEntriesByPriority(h, e1, &guid_kernel, 0, &b);
+	EXPECT(4 == b.total);
+	EXPECT(2 == b.count[4] && 1 == b.count[3] && 1 == b.count[0]);
+	EXPECT(0 == b.start[4] && 2 == b.start[3] && 3 == b.start[0]);
+	EXPECT(KERNEL_B == b.order[0]);
+	EXPECT(KERNEL_Y == b.order[1]);
+	EXPECT(KERNEL_A == b.order[2]);
+	EXPECT(KERNEL_X == b.order[3]);
+
+	BucketEntriesByPriority(h, e1, &guid_kernel, 1, &b);
+	EXPECT(3 == b.total);
+	EXPECT(0 == b.count[0] && 3 == b.start[0]);
+
+	/* X and Y took over both root slots */
+	BucketEntriesByPriority(h, e1, &guid_rootfs, 0, &b);
+	EXPECT(0 == b.total);
+
+	return TEST_OK;
+}
+
 static int GptUpdateTest(void)
 {
 	GptData *gpt = GetEmptyGptData();
@@ -1497,6 +1727,7 @@ int main(int argc, char *argv[])
 		{ TEST_CASE(EntriesCrcTest), },
 		{ TEST_CASE(ValidEntryTest), },
 		{ TEST_CASE(OverlappedPartitionTest), },
+		{ TEST_CASE(FullTableTest), },
 		{ TEST_CASE(SanityCheckTest), },
 		{ TEST_CASE(NoValidKernelEntryTest), },
 		{ TEST_CASE(EntryAttributeGetSetTest), },
@@ -1504,6 +1735,7 @@ int main(int argc, char *argv[])
 		{ TEST_CASE(GetNextNormalTest), },
 		{ TEST_CASE(GetNextPrioTest), },
 		{ TEST_CASE(GetNextTriesTest), },
+		{ TEST_CASE(PriorityBucketsTest), },
 		{ TEST_CASE(GptUpdateTest), },
 		{ TEST_CASE(UpdateInvalidKernelTypeTest), },
 		{ TEST_CASE(DuplicateUniqueGuidTest), },
@@ -1511,6 +1743,7 @@ int main(int argc, char *argv[])
 		{ TEST_CASE(GetKernelGuidTest), },
 		{ TEST_CASE(ErrorTextTest), },
 		{ TEST_CASE(DriveResizeTest), },
+		{ TEST_CASE(FourKSectorTest), },
 	};
 
 	for (i = 0; i < sizeof(test_cases)/sizeof(test_cases[0]); ++i) {
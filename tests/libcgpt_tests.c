@@ -0,0 +1,87 @@
+/* Copyright (c) 2015 CoreOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Tests for the Cgpt* entry points of libcgpt
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_common.h"
+#include "vboot_host.h"
+
+#define IMAGE "libcgpt_tests.bin"
+
+/* Values out of range fail instead of rewriting the table unchanged. */
+static void SetAttributesTest(void) {
+  CgptCreateParams create;
+  CgptAddParams add;
+
+  memset(&create, 0, sizeof(create));
+  create.drive_name = IMAGE;
+  create.create = 1;
+  create.min_size = 1024 * 1024;
+  TEST_EQ(CgptCreate(&create), CGPT_OK, "CgptCreate");
+
+  memset(&add, 0, sizeof(add));
+  add.drive_name = IMAGE;
+  add.partition = 1;
+  add.begin = 100;
+  add.set_begin = 1;
+  add.size = 100;
+  add.set_size = 1;
+  TEST_EQ(StrToGuid("0FC63DAF-8483-4772-8E79-3D69D8477DE4", &add.type_guid),
+          CGPT_OK, "StrToGuid");
+  add.set_type = 1;
+  add.priority = 3;
+  add.set_priority = 1;
+  TEST_EQ(CgptAdd(&add), CGPT_OK, "CgptAdd");
+
+  add.set_begin = add.set_size = add.set_type = 0;
+  add.priority = 99;
+  TEST_EQ(CgptSetAttributes(&add), CGPT_FAILED,
+          "CgptSetAttributes priority 99");
+  add.set_priority = 0;
+  add.tries = 16;
+  add.set_tries = 1;
+  TEST_EQ(CgptSetAttributes(&add), CGPT_FAILED,
+          "CgptSetAttributes tries 16");
+  add.set_tries = 0;
+  add.successful = 2;
+  add.set_successful = 1;
+  TEST_EQ(CgptSetAttributes(&add), CGPT_FAILED,
+          "CgptSetAttributes successful 2");
+  add.set_successful = 0;
+  add.legacy_bootable = 2;
+  add.set_legacy_bootable = 1;
+  TEST_EQ(CgptSetAttributes(&add), CGPT_FAILED,
+          "CgptSetAttributes legacy bootable 2");
+  add.set_legacy_bootable = 0;
+
+  add.priority = 0;
+  TEST_EQ(CgptGetPartitionDetails(&add), CGPT_OK, "CgptGetPartitionDetails");
+  TEST_EQ(add.priority, 3, "Priority unchanged");
+
+  add.priority = 7;
+  add.set_priority = 1;
+  TEST_EQ(CgptSetAttributes(&add), CGPT_OK, "CgptSetAttributes priority 7");
+  add.priority = 0;
+  TEST_EQ(CgptGetPartitionDetails(&add), CGPT_OK, "CgptGetPartitionDetails");
+  TEST_EQ(add.priority, 7, "Priority set");
+
+  unlink(IMAGE);
+}
+
+int main(int argc, char* argv[]) {
+  int error_code = 0;
+
+  SetAttributesTest();
+
+  if (!gTestSuccess)
+    error_code = 255;
+
+  return error_code;
+}
@@ -35,6 +35,27 @@ $CGPT create -s 200 ${DEV} || error
 # test argument requirements
 $CGPT create -c ${DEV} &>/dev/null && error
 
+# test native 4K sector images, later commands should detect the size
+rm -f ${DEV}
+$CGPT create -c -s 100 --sector-size 4096 ${DEV} || error
+[ $(stat --format=%s ${DEV}) -eq $((100*4096)) ] || error
+$CGPT add -t data -b 10 -s 50 ${DEV} || error
+[ $($CGPT show -i 1 -s ${DEV}) -eq 50 ] || error
+# and from the backup header when the primary is gone
+dd if=/dev/zero of=${DEV} bs=4096 seek=1 count=1 conv=notrunc status=none
+$CGPT repair ${DEV} || error
+[ "$(head -c 4104 ${DEV} | tail -c 8)" = "EFI PART" ] || error
+[ $($CGPT show -i 1 -s ${DEV}) -eq 50 ] || error
+$CGPT create -c -s 100 --sector-size 3000 ${DEV} &>/dev/null && error
+rm -f ${DEV}
+
+# test aligning the usable space
+$CGPT create -c -s 10000 -a 1048576 ${DEV} || error
+$CGPT show -v ${DEV} | grep -q "First LBA: 2048$" || error
+$CGPT show -v ${DEV} | grep -q "Last LBA: 8191$" || error
+$CGPT create -a 1000 ${DEV} &>/dev/null && error
+rm -f ${DEV}
+
 # boy it'd be nice if dealing with block devices didn't always require root
 if [ "$(id -u)" -ne 0 ]; then
   echo "Skipping cgpt create tests w/ block devices (requires root)"
@@ -132,6 +153,136 @@ else
   trap - EXIT
 fi
 
+echo "Test cgpt resize -a on an image..."
+rm -f ${DEV}
+$CGPT create -c -s 20000 ${DEV} || error
+$CGPT add -t coreos-resize -b 100 -s 1000 ${DEV} || error
+$CGPT add -t data -b 5000 -s 1000 ${DEV} || error
+$CGPT add -t coreos-resize -b 8000 -s 1000 ${DEV} || error
+truncate --size=$((40000 * 512)) ${DEV} || error
+# partitions on files can't be named, only the drive
+$CGPT resize -m 1 ${DEV} 2>/dev/null && error
+$CGPT resize -m 1 -a ${DEV} || error
+[ $($CGPT show -i 1 -s ${DEV}) -eq 4900 ] || error
+[ $($CGPT show -i 2 -s ${DEV}) -eq 1000 ] || error
+[ $($CGPT show -i 3 -s ${DEV}) -eq 31967 ] || error
+# nothing left to grow
+$CGPT resize -m 1 -a ${DEV} || error
+[ $($CGPT show -i 3 -s ${DEV}) -eq 31967 ] || error
+# image files have no mounted filesystems to grow
+$CGPT resize --grow-fs -a ${DEV} 2>/dev/null && error
+
+echo "Test discarding with add -D, create -D and discard-free..."
+# true if sectors $1 to $1+$2 of the image read back as zeros
+zeroed() {
+  [ -z "$(dd if=${DEV} bs=512 skip=$1 count=$2 status=none | tr -d '\0')" ]
+}
+rm -f ${DEV}
+$CGPT create -c -s 20000 ${DEV} || error
+dd if=/dev/urandom of=${DEV} bs=512 seek=100 count=19000 conv=notrunc \
+  status=none || error
+$CGPT add -D -t data -b 2048 -s 1000 ${DEV} || error
+zeroed 2048 1000 || error
+zeroed 3048 1 && error
+$CGPT add -t data -b 5000 -s 1000 ${DEV} || error
+zeroed 5000 1000 && error
+# growing only discards what the partition takes over
+$CGPT add -D -i 2 -s 1500 ${DEV} || error
+zeroed 5000 1000 && error
+zeroed 6000 500 || error
+zeroed 6500 1 && error
+$CGPT discard-free ${DEV} || error
+zeroed 100 1948 || error
+zeroed 6500 13000 || error
+zeroed 5000 1500 && error
+# changing only the type keeps the data
+$CGPT add -D -i 2 -t coreos-usr ${DEV} || error
+zeroed 5000 1 && error
+zeroed 5999 1 && error
+# removing a partition discards it, as does recreating the table
+$CGPT add -D -i 2 -t unused ${DEV} || error
+zeroed 5000 1500 || error
+dd if=/dev/urandom of=${DEV} bs=512 seek=2048 count=1000 conv=notrunc \
+  status=none || error
+$CGPT create -D ${DEV} || error
+zeroed 2048 1000 || error
+echo "add -D -t data -b 3000 -s 10" | $CGPT batch ${DEV} 2>/dev/null && error
+
+echo "Test cgpt compose..."
+rm -f ${DEV} payload1.bin payload2.bin
+truncate --size=$((4000 * 512)) payload1.bin || error
+dd if=/dev/urandom of=payload1.bin bs=512 seek=1000 count=100 conv=notrunc \
+  status=none || error
+head -c 12345 /dev/urandom > payload2.bin || error
+$CGPT compose -v -p 1=payload1.bin -p 2=payload2.bin ${DEV} > compose.out \
+  <<EOF || error
+create -c -s 20000
+add -t data -b 2048 -s 4000 -l ONE
+add -t data -b 8192 -s 100 -l TWO
+EOF
+cmp -i $((2048 * 512)):0 -n $((4000 * 512)) ${DEV} payload1.bin || error
+cmp -i $((8192 * 512)):0 -n 12345 ${DEV} payload2.bin || error
+[ "$($CGPT show -i 2 -l ${DEV})" = "TWO" ] || error
+grep -q "^partition 1: .* [1-9][0-9]* zeros not written" compose.out || error
+# every byte is accounted for once, however it got there
+sed 's/^[^,]*,//; s/[^0-9 ]//g' compose.out > compose.nums
+while read size cloned kern copied zeros; do
+  [ $((cloned + kern + copied + zeros)) -eq ${size} ] || error
+done < compose.nums
+# payloads have to fit their partitions, and nothing is written otherwise
+echo "add -t data -b 10000 -s 10 -l THREE" |
+  $CGPT compose -p 3=payload1.bin ${DEV} 2>/dev/null && error
+[ "$($CGPT show -i 3 -t ${DEV})" = "00000000-0000-0000-0000-000000000000" ] ||
+  error
+$CGPT compose -p 5=payload2.bin ${DEV} </dev/null 2>/dev/null && error
+
+echo "Test cgpt flash..."
+rm -f flash.bin flash.ckpt
+truncate --size=$((30000 * 512)) flash.bin || error
+$CGPT flash -V -j 3 -b 65536 ${DEV} flash.bin || error
+cmp -n $((10000 * 512)) ${DEV} flash.bin -i 1024:1024 || error
+# the backup GPT moves to the end of the bigger drive
+$CGPT show flash.bin | grep -q "^ *29999 *1 *Sec GPT header" || error
+[ "$($CGPT show -i 2 -l flash.bin)" = "TWO" ] || error
+# again from stdin, over the GPT of the first run
+$CGPT flash -V - flash.bin < ${DEV} || error
+$CGPT show flash.bin | grep -q "^ *29999 *1 *Sec GPT header" || error
+# a checkpoint of another image is refused, a finished one is removed
+printf 'cgpt-flash 1\n512 1048576 0\n' > flash.ckpt
+$CGPT flash -c flash.ckpt ${DEV} flash.bin 2>/dev/null && error
+rm -f flash.ckpt
+$CGPT flash -c flash.ckpt ${DEV} flash.bin || error
+[ -e flash.ckpt ] && error
+# resuming from the middle of the image only writes what comes after, for
+# a file and for a pipe, whose size isn't known
+for in in ${DEV} -; do
+  rm -f flash.bin
+  head -c $((50 * 65536)) ${DEV} > flash.bin
+  truncate --size=$((20000 * 512)) flash.bin || error
+  [ ${in} = - ] && size=0 || size=$((20000 * 512))
+  printf 'cgpt-flash 1\n%d 65536 %d\n' ${size} $((50 * 65536)) > flash.ckpt
+  cat ${DEV} | $CGPT flash -v -b 65536 -c flash.ckpt ${in} flash.bin \
+    > flash.out || error
+  grep -q "^Wrote bytes $((50 * 65536))-$((20000 * 512))," flash.out || error
+  cmp ${DEV} flash.bin || error
+  [ -e flash.ckpt ] && error
+done
+# the last checkpoint from a pipe is past the last whole chunk, which
+# leaves just the table to fix
+printf 'cgpt-flash 1\n0 65536 %d\n' $((20000 * 512)) > flash.ckpt
+$CGPT flash -v -b 65536 -c flash.ckpt - flash.bin < /dev/null > flash.out ||
+  error
+grep -q "^Wrote bytes $((20000 * 512))-$((20000 * 512))," flash.out || error
+[ -e flash.ckpt ] && error
+$CGPT flash -b 1000 ${DEV} flash.bin 2>/dev/null && error
+# like the other commands, flash waits for whoever holds the drive
+if type flock &>/dev/null; then
+  flock -x flash.bin sleep 1 &
+  sleep 0.2
+  $CGPT flash ${DEV} flash.bin || error
+  wait $! || error
+fi
+
 
 # test passing partition devices to cgpt
 if [ "$(id -u)" -ne 0 ]; then
@@ -254,6 +405,17 @@ Y=$($CGPT show -s -i $RANDOM_NUM ${DEV})
 [ "$X $Y" = "$RANDOM_START $RANDOM_SIZE" ] || error
 
 
+echo "Look up partitions by label and unique GUID..."
+[ "$($CGPT find -l "${ROOTFS_LABEL}" ${DEV})" = "${DEV}${ROOTFS_NUM}" ] || error
+U=$($CGPT show -u -i $KERN_NUM ${DEV})
+[ "$($CGPT find -u $U ${DEV})" = "${DEV}${KERN_NUM}" ] || error
+$CGPT add -i $DATA_NUM -u $U ${DEV} &>/dev/null && error
+$CGPT add -i $RANDOM_NUM -l "${ESP_LABEL}" ${DEV} || error
+[ "$($CGPT find -l "${ESP_LABEL}" ${DEV} | wc -l)" -eq 2 ] || error
+$CGPT add -i $RANDOM_NUM -l "${RANDOM_LABEL}" ${DEV} || error
+$CGPT find -l "no such label" ${DEV} && error
+
+
 echo "Change the beginning..."
 DATA_START=$((DATA_START + 10))
 $CGPT add -i 1 -b ${DATA_START} ${DEV} || error
@@ -288,6 +450,35 @@ Y=$($CGPT show -u -i $KERN_NUM $DEV)
 [ "$X" = "$Y" ] || error
 
 
+echo "Test automatic placement in cgpt add..."
+rm -f ${DEV}
+$CGPT create -c -s 20480 -a 1048576 ${DEV} || error
+$CGPT add -t data -s 4096 ${DEV} || error
+[ "$($CGPT show -b -i 1 ${DEV}) $($CGPT show -s -i 1 ${DEV})" = "2048 4096" ] \
+  || error
+$CGPT add -t data -b 12000 -s 100 ${DEV} || error
+# first fit takes the gap before partition 2, largest the one after it
+$CGPT add -t data -s 100 ${DEV} || error
+[ $($CGPT show -b -i 3 ${DEV}) -eq 6144 ] || error
+$CGPT add -t data -s 100 -f largest ${DEV} || error
+[ $($CGPT show -b -i 4 ${DEV}) -eq 12100 ] || error
+$CGPT add -t data -s 10% -a 4096 ${DEV} || error
+[ $($CGPT show -b -i 5 ${DEV}) -eq 6248 ] || error
+[ $($CGPT show -s -i 5 ${DEV}) -eq 1632 ] || error
+# rest grows an existing partition up to the next one
+$CGPT add -i 3 -s rest ${DEV} || error
+[ $($CGPT show -s -i 3 ${DEV}) -eq 104 ] || error
+$CGPT add -t data -s rest -f best ${DEV} || error
+[ $($CGPT show -b -i 6 ${DEV}) -eq 7880 ] || error
+[ $($CGPT show -s -i 6 ${DEV}) -eq 4120 ] || error
+$CGPT add -t data -s 100000 ${DEV} &>/dev/null && error
+[ "$($CGPT show -q --free ${DEV})" = "12200 6232" ] || error
+$CGPT add -t data -b 12050 -s 10 ${DEV} 2>&1 | \
+  grep -q "would overlap partition 2" || error
+$CGPT add -i 4 -s rest ${DEV} || error
+[ $($CGPT show -s -i 4 ${DEV}) -eq 6332 ] || error
+[ -z "$($CGPT show -q --free ${DEV})" ] || error
+
 echo "Test the cgpt next command..."
 ROOT_A=562de070-1539-4edf-ac33-b1028227d525
 ROOT_B=839c1172-5036-4efe-9926-7074340d5772
@@ -491,6 +682,118 @@ assert_pri 13 13 14 12 15 11 10 10  9  9  8  8 7 7 6 6 5 5 4 4 3 3 2 2 1 1 1 1 1
 $CGPT prioritize -i 1 -f ${DEV}
 assert_pri 15 15 13 12 14 11 10 10  9  9  8  8 7 7 6 6 5 5 4 4 3 3 2 2 1 1 1 1 1 1 0
 
+echo "Test the cgpt switch command..."
+# A is running, B gets the update and one try
+make_pri   1 0
+$CGPT add -i 1 -S 1 ${DEV} || error
+$CGPT switch -i 2 -T 1 -S 0 ${DEV} || error
+assert_pri 1 2
+[ $($CGPT show -i 2 -T ${DEV}) -eq 1 ] || error
+[ $($CGPT show -i 2 -S ${DEV}) -eq 0 ] || error
+[ $($CGPT show -i 1 -S ${DEV}) -eq 1 ] || error
+# roll back to A, leaving its flags alone
+$CGPT switch -i 1 ${DEV} || error
+assert_pri 2 1
+[ $($CGPT show -i 1 -S ${DEV}) -eq 1 ] || error
+# refuse a root that could never boot, and write nothing
+$CGPT switch -i 2 -T 0 ${DEV} 2>/dev/null && error
+assert_pri 2 1
+[ $($CGPT show -i 2 -T ${DEV}) -eq 1 ] || error
+$CGPT switch -i 3 ${DEV} 2>/dev/null && error
+# the others are ranked below the given priority
+make_pri   3 3 0
+$CGPT switch -i 3 -P 5 -T 1 ${DEV} || error
+assert_pri 4 4 5
+
+echo "Test the cgpt batch command..."
+rm -f ${DEV}
+$CGPT batch ${DEV} <<SCRIPT || error
+# a whole image in one go
+create -c -s 20000
+add -t efi -b 64 -s 1000 -l "EFI SYSTEM" -B 1
+add -t coreos-rootfs -s 2000 -l USR-A -P 1 -S 1
+
+add -t coreos-rootfs -s 2000 -l USR-B
+boot -p -i 1
+prioritize -i 3
+SCRIPT
+[ "$($CGPT show -i 1 -l ${DEV})" = "EFI SYSTEM" ] || error
+[ $($CGPT show -i 2 -b ${DEV}) -eq 1064 ] || error
+assert_pri 1 2
+[ "$($CGPT boot ${DEV})" = "$($CGPT show -i 1 -u ${DEV})" ] || error
+$CGPT repair ${DEV} >/dev/null || error
+# any failing line, even the last, leaves the disk alone
+$CGPT batch ${DEV} 2>/dev/null <<SCRIPT && error
+add -i 2 -l CHANGED
+add -t efi -b 100 -s 10
+SCRIPT
+[ "$($CGPT show -i 2 -l ${DEV})" = "USR-A" ] || error
+echo "add -i 2 -l CHANGED ${DEV}" | $CGPT batch ${DEV} 2>/dev/null && error
+echo "show -i 2" | $CGPT batch ${DEV} 2>/dev/null && error
+echo "add -l 'unbalanced" | $CGPT batch ${DEV} 2>/dev/null && error
+printf 'add -i 2 -l CHANGED\ncreate -s 100\n' | $CGPT batch ${DEV} \
+  2>/dev/null && error
+[ "$($CGPT show -i 2 -l ${DEV})" = "USR-A" ] || error
+echo "add -i 2 -l CHANGED" > batch.txt
+$CGPT batch -f batch.txt ${DEV} >/dev/null || error
+[ "$($CGPT show -i 2 -l ${DEV})" = "CHANGED" ] || error
+
+if type flock &>/dev/null; then
+  echo "Test locking of the drive..."
+  # readers share the lock
+  flock -s ${DEV} $CGPT show -i 2 -l ${DEV} >/dev/null || error
+  # a writer waits for the holder to go away
+  flock -x ${DEV} sleep 1 &
+  sleep 0.2
+  $CGPT add -i 2 -l LOCKED ${DEV} || error
+  wait $! || error
+  [ "$($CGPT show -i 2 -l ${DEV})" = "LOCKED" ] || error
+fi
+
+if [ "$(id -u)" -ne 0 ]; then
+  echo "Skipping kernel partition sync tests (needs root)"
+elif truncate -s 10M loop_dev.bin &&
+     LOOP=$(losetup -f --show loop_dev.bin 2>/dev/null); then
+  echo "Test telling the kernel about partition changes..."
+  SYSDIR=/sys/block/$(basename ${LOOP})
+  kstart() { cat ${SYSDIR}/$(basename ${LOOP})p$1/start; }
+  $CGPT create ${LOOP} || error
+  $CGPT add -t efi -b 2048 -s 1000 ${LOOP} || error
+  $CGPT add -t coreos-rootfs -b 3048 -s 1000 ${LOOP} || error
+  [ $(kstart 1) -eq 2048 ] && [ $(kstart 2) -eq 3048 ] || error
+  $CGPT add -i 2 -b 5000 -s 1000 ${LOOP} || error
+  [ $(kstart 2) -eq 5000 ] || error
+  $CGPT add -w 5 -t efi -b 6000 -s 100 ${LOOP} || error
+  [ -b /dev/$(basename ${LOOP})p3 ] || error
+  # udev sends its event once the symlinks are made, and only handles it
+  # after cgpt unlocks the disk, so this checks that the wait comes after
+  if udevadm control --ping &>/dev/null; then
+    PARTUUID=$($CGPT show -i 3 -u ${LOOP} | tr A-Z a-z)
+    [ -L /dev/disk/by-partuuid/${PARTUUID} ] || error
+  fi
+  # grow two partitions of the disk at once
+  truncate -s 20M loop_dev.bin && losetup -c ${LOOP} || error
+  $CGPT resize -m 1 /dev/$(basename ${LOOP})p2 /dev/$(basename ${LOOP})p3 ||
+    error
+  [ $(cat ${SYSDIR}/$(basename ${LOOP})p3/size) -eq \
+    $($CGPT show -i 3 -s ${LOOP}) ] || error
+  [ $($CGPT show -i 3 -s ${LOOP}) -gt 30000 ] || error
+  # payloads that don't end on a sector boundary, after data or a hole
+  dd if=/dev/urandom of=${LOOP} bs=512 seek=6000 count=100 status=none ||
+    error
+  head -c 12345 /dev/urandom > odd.bin && truncate -s 40001 odd.bin || error
+  $CGPT compose -p 3=odd.bin ${LOOP} </dev/null || error
+  cmp -i $((6000 * 512)):0 -n 40001 ${LOOP} odd.bin || error
+  head -c 12345 /dev/urandom > odd.bin || error
+  $CGPT compose -p 3=odd.bin ${LOOP} </dev/null || error
+  cmp -i $((6000 * 512)):0 -n 12345 ${LOOP} odd.bin || error
+  $CGPT add -i 1 -t unused ${LOOP} || error
+  [ -e ${SYSDIR}/$(basename ${LOOP})p1 ] && error
+  $CGPT create -z ${LOOP} || error
+  ls ${SYSDIR} | grep -q "^$(basename ${LOOP})p" && error
+  losetup -d ${LOOP}
+fi
+
 # Now make sure that we don't need write access if we're just looking.
 if [ "$(id -u)" -eq 0 ]; then
   echo "Skipping read vs read-write access tests (doesn't work as root)"
@@ -503,6 +806,8 @@ else
   $CGPT add -i 2 -P 3 ${DEV} 2>/dev/null && error
   $CGPT repair ${DEV} 2>/dev/null && error
   $CGPT prioritize -i 3 ${DEV} 2>/dev/null && error
+  $CGPT switch -i 3 -S 1 ${DEV} 2>/dev/null && error
+  echo "add -i 2 -P 3" | $CGPT batch ${DEV} 2>/dev/null && error
 
   # Most 'boot' usage should fail too.
   $CGPT boot -p ${DEV} 2>/dev/null && error
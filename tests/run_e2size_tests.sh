@@ -0,0 +1,135 @@
+#!/bin/bash -eu
+
+# Copyright (c) 2015 CoreOS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Run tests for e2size.
+
+# Load common constants and variables.
+. "$(dirname "$0")/common.sh"
+
+E2SIZE=$(readlink -f "${1:-./e2size}")
+[ -x "$E2SIZE" ] || error "Can't execute $E2SIZE"
+# built alongside e2size
+CGPT="$(dirname "$E2SIZE")/cgpt"
+[ -x "$CGPT" ] || error "Can't execute $CGPT"
+
+# automake's exit status for a skipped test
+if ! type mkfs.ext4 resize2fs &>/dev/null; then
+  echo "Skipping e2size tests (requires mkfs.ext4 and resize2fs)"
+  exit 77
+fi
+
+# Run tests in a dedicated directory for easy cleanup or debugging.
+DIR="${TEST_DIR}/e2size_test_dir"
+[ -d "$DIR" ] || mkdir -p "$DIR"
+warning "testing $E2SIZE in $DIR"
+cd "$DIR"
+
+# Writes the bytes of a printf format at a byte offset of a file.
+poke() {
+  printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+echo "Test sizing filesystems from their superblock..."
+rm -f fs.img
+mkfs.ext4 -q -F -b 4096 fs.img 4M &>/dev/null
+[ "$("$E2SIZE" fs.img)" = "4194304" ] || error
+[ "$("$E2SIZE" -v fs.img)" = "ext4 4194304 4096" ] || error
+# a filesystem smaller than the file holding it
+rm -f fs.img
+truncate -s 8M fs.img
+mkfs.ext3 -q -F -b 1024 fs.img 6000 &>/dev/null
+[ "$("$E2SIZE" -v fs.img)" = "ext3 6144000 1024" ] || error
+rm -f fs.img
+mkfs.ext2 -q -F -b 1024 fs.img 3000 &>/dev/null
+[ "$("$E2SIZE" -v fs.img)" = "ext2 3072000 1024" ] || error
+
+# Formats without a checksum, built by hand: 10 XFS v4 blocks of 4K,
+# 12345 bytes of squashfs and 5 erofs blocks of 4K.
+rm -f fs.img
+truncate -s 64K fs.img
+poke fs.img 0 'XFSB\x00\x00\x10\x00\x00\x00\x00\x00\x00\x00\x00\x0a'
+poke fs.img 100 '\x00\x04'
+[ "$("$E2SIZE" -v fs.img)" = "xfs 40960 4096" ] || error
+# only ext2/3/4 can be estimated
+"$E2SIZE" -m fs.img &>/dev/null && error
+rm -f fs.img
+truncate -s 64K fs.img
+poke fs.img 0 'hsqs'
+poke fs.img 12 '\x00\x00\x02\x00'
+poke fs.img 40 '\x39\x30\x00\x00\x00\x00\x00\x00'
+[ "$("$E2SIZE" -v fs.img)" = "squashfs 12345 131072" ] || error
+rm -f fs.img
+truncate -s 64K fs.img
+poke fs.img 1024 '\xe2\xe1\xf5\xe0'
+poke fs.img 1036 '\x0c'
+poke fs.img 1060 '\x05\x00\x00\x00'
+[ "$("$E2SIZE" -v fs.img)" = "erofs 20480 4096" ] || error
+
+# nothing to size
+rm -f fs.img
+truncate -s 64K fs.img
+"$E2SIZE" fs.img &>/dev/null && error
+
+echo "Test a superblock that fails its checksum..."
+# libext2fs rejects it as well, so this can only be reported.
+rm -f fs.img
+mkfs.ext4 -q -F -b 4096 -O metadata_csum fs.img 4M &>/dev/null
+poke fs.img $((1024 + 0x3FC)) '\x00\x00\x00\x00'
+"$E2SIZE" fs.img >/dev/null 2>e2size.err && error
+grep -q "checksum" e2size.err || error
+
+echo "Test estimating the minimum size..."
+# resize2fs -P must agree, and shrinking to the estimate must work.
+rm -rf files
+mkdir files
+for i in $(seq 1 40); do
+  head -c 200K /dev/urandom > files/f$i
+done
+for opts in "-b 1024" "-b 4096" "-b 1024 -O ^flex_bg" "-b 4096 -N 40000"; do
+  rm -f fs.img
+  mkfs.ext4 -q -F $opts -d files fs.img 64M &>/dev/null
+  read size used min < <("$E2SIZE" -m fs.img) || error
+  bs=$(dumpe2fs -h fs.img 2>/dev/null | sed -n 's/^Block size: *//p')
+  blocks=$(dumpe2fs -h fs.img 2>/dev/null | sed -n 's/^Block count: *//p')
+  free=$(dumpe2fs -h fs.img 2>/dev/null | sed -n 's/^Free blocks: *//p')
+  [ "$size" -eq $((64 * 1024 * 1024)) ] || error
+  [ "$used" -eq $(((blocks - free) * bs)) ] || error
+  [ "$min" -eq $(($(resize2fs -P fs.img 2>/dev/null |
+                    sed -n 's/.*: //p') * bs)) ] || error
+  resize2fs -f fs.img $((min / bs)) &>/dev/null || error
+  e2fsck -fn fs.img &>/dev/null || error
+done
+
+echo "Test sizing filesystems inside GPT partitions..."
+# A 2M ext4 in a 4M partition, a 2000K ext2 filling most of a 2M
+# partition and an empty partition, none starting at the image's start.
+rm -f disk.img
+$CGPT create -c -s $((16 * 2048)) disk.img || error
+$CGPT add -b 2048 -s 8192 -t data -l ROOT disk.img || error
+$CGPT add -b 10240 -s 4096 -t data -l OEM disk.img || error
+$CGPT add -b 14336 -s 2048 -t data -l EMPTY disk.img || error
+rm -f fs.img
+mkfs.ext4 -q -F -b 4096 fs.img 2M &>/dev/null
+dd if=fs.img of=disk.img bs=512 seek=2048 conv=notrunc status=none
+rm -f fs.img
+mkfs.ext2 -q -F -b 1024 fs.img 2000 &>/dev/null
+dd if=fs.img of=disk.img bs=512 seek=10240 conv=notrunc status=none
+[ "$("$E2SIZE" -m -p 2 disk.img)" = "$("$E2SIZE" -m fs.img)" ] || error
+
+[ "$("$E2SIZE" -p 1 disk.img)" = "2097152" ] || error
+[ "$("$E2SIZE" -v -p 2 disk.img)" = "ext2 2048000 1024" ] || error
+[ "$("$E2SIZE" -p PARTLABEL=OEM disk.img)" = "2048000" ] || error
+# every partition with a filesystem, the empty one left out
+[ "$("$E2SIZE" -a disk.img)" = "$(printf '1 2097152\n2 2048000')" ] || error
+[ "$("$E2SIZE" -v -a disk.img)" = \
+  "$(printf '1 ext4 2097152 4096\n2 ext2 2048000 1024')" ] || error
+# but asking for it is an error, as are missing partitions and tables
+"$E2SIZE" -p 3 disk.img &>/dev/null && error
+"$E2SIZE" -p PARTLABEL=NOPE disk.img &>/dev/null && error
+"$E2SIZE" -p 1 fs.img &>/dev/null && error
+"$E2SIZE" -a -p 1 disk.img &>/dev/null && error
+
+happy "All e2size tests passed"
@@ -0,0 +1,80 @@
+#!/bin/bash -eu
+
+# Copyright (c) 2015 CoreOS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Run tests for loopy.
+
+# Load common constants and variables.
+. "$(dirname "$0")/common.sh"
+
+LOOPY=$(readlink -f "${1:-./loopy}")
+[ -x "$LOOPY" ] || error "Can't execute $LOOPY"
+
+# automake's exit status for a skipped test
+if [ "$(id -u)" -ne 0 ]; then
+  echo "Skipping loopy tests (requires root)"
+  exit 77
+fi
+if ! type mkfs.ext4 &>/dev/null; then
+  echo "Skipping loopy tests (requires mkfs.ext4)"
+  exit 77
+fi
+
+# Run tests in a dedicated directory for easy cleanup or debugging.
+DIR="${TEST_DIR}/loopy_test_dir"
+[ -d "$DIR" ] || mkdir -p "$DIR"
+warning "testing $LOOPY in $DIR"
+cd "$DIR"
+# manifest entries need absolute paths
+DIR=$(pwd)
+
+IMAGES=6
+unmount_all() {
+  local i
+  for i in $(seq ${IMAGES}); do
+    ! mountpoint -q mnt$i || umount mnt$i
+  done
+}
+trap unmount_all EXIT
+
+for i in $(seq ${IMAGES}); do
+  rm -rf src$i && mkdir -p src$i mnt$i
+  echo "image $i" > src$i/marker
+  rm -f img$i
+  mkfs.ext4 -q -F -d src$i img$i 2M >/dev/null 2>&1 || error
+done
+
+# Mounts the manifest with $1 workers and lists what ended up where.
+mount_all() {
+  local i
+  "$LOOPY" -m manifest -j $1 >/dev/null 2>loopy.err && error
+  grep -q "^1 of $((IMAGES + 1)) mounts failed" loopy.err || error
+  for i in $(seq ${IMAGES}); do
+    echo "mnt$i: $(cat mnt$i/marker) $(findmnt -n -o OPTIONS mnt$i |
+                                         cut -d, -f1)"
+  done
+  unmount_all
+}
+
+echo "Test loopy -m with one and several workers..."
+rm -f manifest
+for i in $(seq ${IMAGES}); do
+  echo "${DIR}/img$i ${DIR}/mnt$i ro" >> manifest
+done
+# a line that fails doesn't stop the others
+echo "${DIR}/missing.img ${DIR}/mnt1" >> manifest
+mount_all 1 > serial.out || error
+mount_all 4 > parallel.out || error
+for i in $(seq ${IMAGES}); do
+  grep -q "^mnt$i: image $i ro$" serial.out || error
+done
+cmp serial.out parallel.out || error
+
+# Nothing is left attached once the images are unmounted.
+for i in $(seq ${IMAGES}); do
+  losetup -j "${DIR}/img$i" | grep -q . && error
+done
+
+happy "loopy tests passed"